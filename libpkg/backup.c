@@ -18,13 +18,14 @@ pkgdb_dump(struct pkgdb *db, char *dest)
 	    PKG_LOAD_DIRS | PKG_LOAD_SCRIPTS | PKG_LOAD_OPTIONS |
 	    PKG_LOAD_MTREE | PKG_LOAD_LICENSES;
 
-	packing_init(&pack, dest ? dest : "./pkgdump", TXZ);
+	if (packing_init(&pack, dest ? dest : "./pkgdump", TXZ, -1, -1) != EPKG_OK)
+		return (EPKG_FATAL);
 
-	path = sbuf_new_auto();
 	if ((it = pkgdb_query(db, NULL, MATCH_ALL)) == NULL) {
-		/* TODO handle errors */
+		packing_finish(pack);
 		return (EPKG_FATAL);
 	}
+	path = sbuf_new_auto();
 
 	while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK) {
 		const char *name, *version, *mtree;
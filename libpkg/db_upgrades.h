@@ -119,6 +119,22 @@ static struct db_upgrades {
 	{8,
 	"DROP TABLE conflicts;"
 	},
+	{9,
+	"CREATE INDEX files_package ON files(package_id, path, sha256);"
+	"DROP INDEX deporigini;"
+	"CREATE INDEX deps_origin ON deps(origin, package_id);"
+	"CREATE INDEX pkg_directories_directory ON pkg_directories(directory_id);"
+	"CREATE INDEX pkg_categories_category ON pkg_categories(category_id);"
+	"CREATE INDEX pkg_licenses_license ON pkg_licenses(license_id);"
+	"CREATE INDEX pkg_users_user ON pkg_users(user_id);"
+	"CREATE INDEX pkg_groups_group ON pkg_groups(group_id);"
+	"CREATE INDEX packages_mtree ON packages(mtree_id);"
+	},
+	{10,
+	"ALTER TABLE packages ADD vkey BLOB;"
+	"UPDATE packages SET vkey = version_key(version);"
+	"CREATE INDEX packages_vkey ON packages(origin, vkey);"
+	},
 
 	/* Mark the end of the array */
 	{ -1, NULL },
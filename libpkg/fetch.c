@@ -1,8 +1,16 @@
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -12,66 +20,799 @@
 
 #include "pkg.h"
 #include "pkg_event.h"
+#include "pkg_private.h"
+
+/*
+ * A fetch session keeps the HTTP connections open between downloads: libfetch
+ * closes its HTTP connections after each request. Plain HTTP without proxy
+ * nor authentication is handled here, everything else goes to libfetch.
+ */
+struct fetch_conn {
+	char host[MAXHOSTNAMELEN + 1];
+	int port;
+	int fd;
+	char buf[BUFSIZ];
+	size_t pos;
+	size_t len;
+	off_t left;		/* bytes of the body not read yet */
+	bool keepalive;
+	bool broken;
+	struct fetch_session *s;
+	LIST_ENTRY(fetch_conn) next;
+};
+
+struct fetch_session {
+	pthread_mutex_t lock;
+	LIST_HEAD(, fetch_conn) idle;
+	int timeout;		/* seconds, 0 for none */
+	int64_t opened;
+	int64_t reused;
+};
+
+struct fetch_ftp {
+	FILE *f;
+};
+
+/*
+ * Why a request failed: the FETCH_* code and its message.  Returned to the
+ * caller instead of libfetch's fetchLastErrCode and fetchLastErrString,
+ * which every thread would share.
+ */
+struct fetch_error {
+	int code;
+	char msg[MAXERRSTRING];
+};
+
+/* format of the dates in the HTTP headers */
+#define HTTP_DATE "%a, %d %b %Y %H:%M:%S GMT"
+
+/* libfetch caches a single FTP connection per process */
+static pthread_mutex_t ftp_lock = PTHREAD_MUTEX_INITIALIZER;
+/* and reports its errors through globals */
+static pthread_mutex_t libfetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fetch_session *default_session = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static pthread_once_t timeout_once = PTHREAD_ONCE_INIT;
+static int64_t timeout = 0;
+
+/* libfetch reads its timeout from a global, set once for all the threads */
+static void
+timeout_init(void)
+{
+	if (pkg_config_int64(PKG_CONFIG_FETCH_TIMEOUT, &timeout) != EPKG_OK ||
+	    timeout < 0)
+		timeout = 0;
+	fetchTimeout = timeout;
+}
+
+struct fetch_session *
+fetch_session_new(void)
+{
+	struct fetch_session *s;
+
+	if ((s = calloc(1, sizeof(struct fetch_session))) == NULL) {
+		pkg_emit_errno("calloc", "fetch_session");
+		return (NULL);
+	}
+
+	pthread_once(&timeout_once, timeout_init);
+	pthread_mutex_init(&s->lock, NULL);
+	LIST_INIT(&s->idle);
+	s->timeout = timeout;
+
+	return (s);
+}
+
+void
+fetch_session_free(struct fetch_session *s)
+{
+	struct fetch_conn *c;
+
+	if (s == NULL)
+		return;
+
+	while (!LIST_EMPTY(&s->idle)) {
+		c = LIST_FIRST(&s->idle);
+		LIST_REMOVE(c, next);
+		close(c->fd);
+		free(c);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+void
+fetch_session_stats(struct fetch_session *s, int64_t *opened, int64_t *reused)
+{
+	pthread_mutex_lock(&s->lock);
+	*opened = s->opened;
+	*reused = s->reused;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* used by pkg_fetch_file(), the connections stay open until exit */
+static void
+default_session_init(void)
+{
+	default_session = fetch_session_new();
+}
+
+static void
+fetch_seterr(struct fetch_error *err, int code, const char *msg)
+{
+	err->code = code;
+	strlcpy(err->msg, msg, sizeof(err->msg));
+}
+
+/* libfetch only knows about the modification time */
+static FILE *
+fetch_libfetch_get(struct url *u, struct url_stat *st, struct fetch_cond *cond,
+    struct fetch_error *err)
+{
+	FILE *f;
+
+	if (cond != NULL) {
+		cond->etag[0] = '\0';
+		u->ims_time = cond->mtime;
+	}
+
+	pthread_mutex_lock(&libfetch_lock);
+	f = fetchXGet(u, st, cond != NULL && cond->mtime > 0 ? "i" : "");
+	if (f == NULL)
+		fetch_seterr(err, fetchLastErrCode, fetchLastErrString);
+	pthread_mutex_unlock(&libfetch_lock);
+
+	return (f);
+}
+
+/*
+ * Connect without waiting more than the timeout of the session, and make
+ * the reads and writes on the socket time out as well.
+ */
+static int
+fetch_connect(struct fetch_session *s, int fd, struct addrinfo *ai)
+{
+	struct pollfd pfd;
+	struct timeval tv;
+	socklen_t len = sizeof(int);
+	int flags, err = 0;
+
+	if (s->timeout == 0)
+		return (connect(fd, ai->ai_addr, ai->ai_addrlen));
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return (-1);
+
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			return (-1);
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		switch (poll(&pfd, 1, s->timeout * 1000)) {
+		case -1:
+			return (-1);
+		case 0:
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+			return (-1);
+		if (err != 0) {
+			errno = err;
+			return (-1);
+		}
+	}
+
+	tv.tv_sec = s->timeout;
+	tv.tv_usec = 0;
+	if (fcntl(fd, F_SETFL, flags) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		return (-1);
+
+	return (0);
+}
+
+static struct fetch_conn *
+fetch_conn_get(struct fetch_session *s, struct url *u, int port, bool *reused,
+    struct fetch_error *error)
+{
+	struct fetch_conn *c;
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int fd = -1;
+	int ret, err = 0;
+
+	pthread_mutex_lock(&s->lock);
+	LIST_FOREACH(c, &s->idle, next) {
+		if (c->port == port && strcmp(c->host, u->host) == 0) {
+			LIST_REMOVE(c, next);
+			pthread_mutex_unlock(&s->lock);
+			*reused = true;
+			return (c);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if ((ret = getaddrinfo(u->host, service, &hints, &res)) != 0) {
+		fetch_seterr(error, FETCH_RESOLV, gai_strerror(ret));
+		return (NULL);
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			continue;
+		if (fetch_connect(s, fd, ai) == 0)
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		fetch_seterr(error, err == ETIMEDOUT ? FETCH_TIMEOUT :
+		    FETCH_NETWORK, strerror(err));
+		return (NULL);
+	}
+
+	if ((c = calloc(1, sizeof(struct fetch_conn))) == NULL) {
+		fetch_seterr(error, FETCH_NETWORK, strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+
+	strlcpy(c->host, u->host, sizeof(c->host));
+	c->port = port;
+	c->fd = fd;
+	c->s = s;
+
+	pthread_mutex_lock(&s->lock);
+	s->opened++;
+	pthread_mutex_unlock(&s->lock);
+	*reused = false;
+
+	return (c);
+}
+
+/* back to the idle connections if the answer was read entirely */
+static void
+fetch_conn_release(struct fetch_conn *c)
+{
+	if (c->keepalive && !c->broken && c->left == 0 && c->pos == c->len) {
+		pthread_mutex_lock(&c->s->lock);
+		LIST_INSERT_HEAD(&c->s->idle, c, next);
+		pthread_mutex_unlock(&c->s->lock);
+		return;
+	}
+
+	close(c->fd);
+	free(c);
+}
+
+/* after a failed read or write on the connection */
+static void
+fetch_conn_seterr(struct fetch_error *err)
+{
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		fetch_seterr(err, FETCH_TIMEOUT, "operation timed out");
+	else
+		fetch_seterr(err, FETCH_NETWORK, "connection lost");
+}
+
+static int
+fetch_conn_getline(struct fetch_conn *c, char *line, size_t size)
+{
+	ssize_t r;
+	size_t n = 0;
+	char ch;
+
+	for (;;) {
+		if (c->pos == c->len) {
+			c->pos = c->len = 0;
+			if ((r = read(c->fd, c->buf, sizeof(c->buf))) <= 0) {
+				if (r == 0)
+					errno = ECONNRESET;
+				return (-1);
+			}
+			c->len = r;
+		}
+		ch = c->buf[c->pos++];
+		if (ch == '\n')
+			break;
+		if (n < size - 1)
+			line[n++] = ch;
+	}
+
+	if (n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+
+	return (0);
+}
+
+static int
+fetch_conn_read(void *cookie, char *buf, int len)
+{
+	struct fetch_conn *c = cookie;
+	ssize_t r;
+
+	if (c->left == 0)
+		return (0);
+	if (len > c->left)
+		len = c->left;
+
+	if (c->pos < c->len) {
+		r = MIN((size_t)len, c->len - c->pos);
+		memcpy(buf, c->buf + c->pos, r);
+		c->pos += r;
+	} else if ((r = read(c->fd, buf, len)) <= 0) {
+		c->broken = true;
+		return (r);
+	}
+	c->left -= r;
+
+	return (r);
+}
+
+static int
+fetch_conn_close(void *cookie)
+{
+	fetch_conn_release(cookie);
+
+	return (0);
+}
+
+static const char *
+fetch_header(const char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncasecmp(line, name, len) != 0 || line[len] != ':')
+		return (NULL);
+
+	line += len + 1;
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	return (line);
+}
+
+static FILE *
+fetch_http_get(struct fetch_session *s, struct url *u, struct url_stat *st,
+    struct fetch_cond *cond, struct fetch_error *err)
+{
+	struct fetch_conn *c = NULL;
+	FILE *f;
+	struct tm tm;
+	char line[BUFSIZ];
+	char req[BUFSIZ + MAXHOSTNAMELEN];
+	char date[64];
+	char etag[sizeof(cond->etag)];
+	const char *v;
+	intmax_t start = 0, end, size = -1, length = -1;
+	time_t mtime = 0;
+	int major, minor, code;
+	int port = u->port != 0 ? u->port : 80;
+	int len, attempt;
+	bool reused, chunked = false;
+
+	etag[0] = '\0';
+
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%d\r\n"
+	    "User-Agent: pkg\r\n", u->doc, u->host, port);
+	if (u->offset > 0)
+		len += snprintf(req + len, sizeof(req) - len,
+		    "Range: bytes=%jd-\r\n", (intmax_t)u->offset);
+	if (cond != NULL && cond->mtime > 0) {
+		strftime(date, sizeof(date), HTTP_DATE, gmtime_r(&cond->mtime, &tm));
+		len += snprintf(req + len, sizeof(req) - len,
+		    "If-Modified-Since: %s\r\n", date);
+	}
+	if (cond != NULL && cond->etag[0] != '\0')
+		len += snprintf(req + len, sizeof(req) - len,
+		    "If-None-Match: %s\r\n", cond->etag);
+	len += snprintf(req + len, sizeof(req) - len, "\r\n");
+	if (len >= (int)sizeof(req)) {
+		fetch_seterr(err, FETCH_PROTO, "URL too long");
+		return (NULL);
+	}
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if ((c = fetch_conn_get(s, u, port, &reused, err)) == NULL)
+			return (NULL);
+		if (write(c->fd, req, len) == len &&
+		    fetch_conn_getline(c, line, sizeof(line)) == 0) {
+			/* not counted before it answered, it may be closed */
+			if (reused) {
+				pthread_mutex_lock(&s->lock);
+				s->reused++;
+				pthread_mutex_unlock(&s->lock);
+			}
+			break;
+		}
+		/* an idle connection closed by the server */
+		c->broken = true;
+		fetch_conn_release(c);
+		c = NULL;
+		if (!reused) {
+			fetch_conn_seterr(err);
+			return (NULL);
+		}
+	}
+
+	if (c == NULL || sscanf(line, "HTTP/%d.%d %d", &major, &minor, &code) != 3) {
+		fetch_seterr(err, FETCH_PROTO, "invalid HTTP answer");
+		goto fail;
+	}
+	c->keepalive = (major == 1 && minor >= 1);
+
+	for (;;) {
+		if (fetch_conn_getline(c, line, sizeof(line)) != 0) {
+			fetch_conn_seterr(err);
+			goto fail;
+		}
+		if (line[0] == '\0')
+			break;
+		if ((v = fetch_header(line, "Content-Length")) != NULL)
+			length = strtoimax(v, NULL, 10);
+		else if ((v = fetch_header(line, "Content-Range")) != NULL)
+			sscanf(v, "bytes %jd-%jd/%jd", &start, &end, &size);
+		else if ((v = fetch_header(line, "Transfer-Encoding")) != NULL)
+			chunked = (strncasecmp(v, "chunked", 7) == 0);
+		else if ((v = fetch_header(line, "Last-Modified")) != NULL) {
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(v, HTTP_DATE, &tm) != NULL)
+				mtime = timegm(&tm);
+		} else if ((v = fetch_header(line, "ETag")) != NULL)
+			strlcpy(etag, v, sizeof(etag));
+		else if ((v = fetch_header(line, "Connection")) != NULL) {
+			if (strncasecmp(v, "close", 5) == 0)
+				c->keepalive = false;
+			else if (strncasecmp(v, "keep-alive", 10) == 0)
+				c->keepalive = true;
+		}
+	}
+
+	if (code == 416) {
+		fetch_seterr(err, FETCH_PROTO, "Requested Range Not Satisfiable");
+		goto fail;
+	}
+
+	/* answers without a body leave the connection usable */
+	if (code == 304 || code == 404) {
+		if (code == 304)
+			fetch_seterr(err, FETCH_UNCHANGED, "Not Modified");
+		else
+			fetch_seterr(err, FETCH_UNAVAIL, "Not Found");
+		c->broken = (code == 404 && (chunked || length != 0));
+		fetch_conn_release(c);
+		return (NULL);
+	}
+
+	/* redirections, errors and unknown lengths are left to libfetch */
+	if ((code != 200 && code != 206) || chunked || length < 0 ||
+	    (code == 206 && size < 0)) {
+		c->broken = true;
+		fetch_conn_release(c);
+		return (fetch_libfetch_get(u, st, cond, err));
+	}
+
+	c->left = length;
+	u->offset = (code == 206) ? start : 0;
+	u->length = length;
+	st->size = (code == 206) ? size : length;
+	st->atime = st->mtime = mtime;
+	if (cond != NULL)
+		strlcpy(cond->etag, etag, sizeof(cond->etag));
+
+	if ((f = funopen(c, fetch_conn_read, NULL, NULL, fetch_conn_close)) == NULL) {
+		fetch_seterr(err, FETCH_TEMP, strerror(errno));
+		goto fail;
+	}
+
+	return (f);
+
+	fail:
+	if (c != NULL) {
+		c->broken = true;
+		fetch_conn_release(c);
+	}
+
+	return (NULL);
+}
+
+static int
+fetch_ftp_read(void *cookie, char *buf, int len)
+{
+	struct fetch_ftp *ftp = cookie;
+	size_t r;
+
+	r = fread(buf, 1, len, ftp->f);
+	if (r == 0 && ferror(ftp->f))
+		return (-1);
+
+	return (r);
+}
+
+static int
+fetch_ftp_close(void *cookie)
+{
+	struct fetch_ftp *ftp = cookie;
+
+	fclose(ftp->f);
+	free(ftp);
+	pthread_mutex_unlock(&ftp_lock);
+
+	return (0);
+}
+
+static FILE *
+fetch_session_get(struct fetch_session *s, struct url *u, struct url_stat *st,
+    struct fetch_cond *cond, struct fetch_error *err)
+{
+	struct fetch_ftp *ftp;
+	FILE *f;
+
+	if (strcmp(u->scheme, SCHEME_HTTP) == 0 && u->user[0] == '\0' &&
+	    getenv("HTTP_PROXY") == NULL && getenv("http_proxy") == NULL &&
+	    getenv("HTTP_AUTH") == NULL)
+		return (fetch_http_get(s, u, st, cond, err));
+
+	if (strcmp(u->scheme, SCHEME_FTP) != 0)
+		return (fetch_libfetch_get(u, st, cond, err));
+
+	/* one FTP transfer at a time, until the stream is closed */
+	pthread_mutex_lock(&ftp_lock);
+	if ((f = fetch_libfetch_get(u, st, cond, err)) == NULL) {
+		pthread_mutex_unlock(&ftp_lock);
+		return (NULL);
+	}
+
+	if ((ftp = malloc(sizeof(struct fetch_ftp))) == NULL ||
+	    (ftp->f = f, f = funopen(ftp, fetch_ftp_read, NULL, NULL,
+	    fetch_ftp_close)) == NULL) {
+		fetch_seterr(err, FETCH_TEMP, strerror(errno));
+		fclose(ftp != NULL ? ftp->f : f);
+		free(ftp);
+		pthread_mutex_unlock(&ftp_lock);
+		return (NULL);
+	}
+
+	return (f);
+}
+
+static int fetch_file(struct fetch_session *s, const char *url,
+    const char *dest, bool resume, const char *sum, struct fetch_cond *cond,
+    fetch_cb cb, void *data);
 
 int
 pkg_fetch_file(const char *url, const char *dest)
+{
+	return (fetch_file(NULL, url, dest, false, NULL, NULL, NULL, NULL));
+}
+
+int
+pkg_fetch_file_cond(const char *url, const char *dest, struct fetch_cond *cond,
+    fetch_cb cb, void *data)
+{
+	return (fetch_file(NULL, url, dest, false, NULL, cond, cb, data));
+}
+
+int
+pkg_fetch_file_cb(struct fetch_session *s, const char *url, const char *dest,
+    bool resume, const char *sum, fetch_cb cb, void *data)
+{
+	return (fetch_file(s, url, dest, resume, sum, NULL, cb, data));
+}
+
+/*
+ * The file is downloaded to dest.part and renamed when complete. A transfer
+ * interrupted midway is resumed from the bytes already received; with
+ * resume, a dest.part left by a previous call is resumed as well and is
+ * kept if the download fails. A NULL session stands for a session shared by
+ * the whole process.
+ * When sum is given, the SHA-256 of the file is computed while it is received
+ * and a mismatching download is discarded instead of being renamed.
+ * With cond, nothing is downloaded when the file did not change.
+ */
+static int
+fetch_file(struct fetch_session *s, const char *url, const char *dest,
+    bool resume, const char *sum, struct fetch_cond *cond, fetch_cb cb,
+    void *data)
 {
 	int fd = -1;
 	FILE *remote = NULL;
+	struct url *u = NULL;
 	struct url_stat st;
+	struct fetch_error err;
+	struct stat sb;
 	off_t done = 0;
+	off_t offset;
 	off_t r;
 	int retry = 3;
 	time_t begin_dl;
 	time_t now;
 	time_t last = 0;
 	char buf[10240];
+	char partial[MAXPATHLEN + 1];
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
+	off_t hashed = -1;
 	int retcode = EPKG_OK;
 
-	if ((fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600)) == -1) {
-		pkg_emit_errno("open", dest);
+	if (s == NULL) {
+		pthread_once(&default_once, default_session_init);
+		if ((s = default_session) == NULL)
+			return (EPKG_FATAL);
+	}
+
+	snprintf(partial, sizeof(partial), "%s.part", dest);
+
+	/* a fresh download replaces what an interrupted one left */
+	if (!resume && unlink(partial) == -1 && errno != ENOENT) {
+		pkg_emit_errno("unlink", partial);
+		return (EPKG_FATAL);
+	}
+
+	if ((fd = open(partial, resume ? O_RDWR|O_CREAT :
+	    O_RDWR|O_CREAT|O_TRUNC|O_EXCL, 0600)) == -1) {
+		pkg_emit_errno("open", partial);
 		return(EPKG_FATAL);
 	}
 
-	while (remote == NULL) {
-		remote = fetchXGetURL(url, &st, "");
-		if (remote == NULL) {
-			--retry;
-			if (retry == 0) {
-				pkg_emit_error("%s: %s", url, fetchLastErrString);
+	pthread_mutex_lock(&libfetch_lock);
+	if ((u = fetchParseURL(url)) == NULL)
+		pkg_emit_error("%s: %s", url, fetchLastErrString);
+	pthread_mutex_unlock(&libfetch_lock);
+	if (u == NULL) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	for (;;) {
+		if (fstat(fd, &sb) == -1) {
+			pkg_emit_errno("fstat", partial);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		/* ask for what is still missing */
+		offset = done = sb.st_size;
+		u->offset = offset;
+		fetch_seterr(&err, FETCH_OK, "");
+		remote = fetch_session_get(s, u, &st, cond, &err);
+
+		if (remote == NULL && err.code == FETCH_UNCHANGED) {
+			retcode = EPKG_UPTODATE;
+			goto cleanup;
+		}
+
+		/* retrying will not make the file appear */
+		if (remote == NULL && err.code == FETCH_UNAVAIL) {
+			if (cond == NULL || !cond->optional)
+				pkg_emit_error("%s: %s", url, err.msg);
+			retcode = (cond != NULL && cond->optional) ? EPKG_END :
+			    EPKG_FATAL;
+			goto cleanup;
+		}
+
+		/* the server may not honour the range */
+		if (remote != NULL && u->offset != offset) {
+			if (ftruncate(fd, u->offset) == -1) {
+				pkg_emit_errno("ftruncate", partial);
 				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
-			sleep(1);
+			offset = done = u->offset;
 		}
-	}
 
-	begin_dl = time(NULL);
-	while (done < st.size) {
-		if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
+		if (remote != NULL && lseek(fd, offset, SEEK_SET) == -1) {
+			pkg_emit_errno("lseek", partial);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		/* the bytes kept from an earlier transfer are hashed first */
+		if (remote != NULL && sum != NULL && hashed != offset) {
+			SHA256_Init(&sha256);
+			for (hashed = 0; hashed < offset; hashed += r) {
+				r = MIN((off_t)sizeof(buf), offset - hashed);
+				if ((r = pread(fd, buf, r, hashed)) < 1) {
+					pkg_emit_errno("pread", partial);
+					retcode = EPKG_FATAL;
+					goto cleanup;
+				}
+				SHA256_Update(&sha256, buf, r);
+			}
+		}
+
+		begin_dl = time(NULL);
+		while (remote != NULL && done < st.size) {
+			if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
+				break;
+
+			if (write(fd, buf, r) != r) {
+				pkg_emit_errno("write", partial);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+
+			done += r;
+			if (sum != NULL) {
+				SHA256_Update(&sha256, buf, r);
+				hashed = done;
+			}
+			if (cb != NULL) {
+				cb(data, done, st.size);
+				continue;
+			}
+			now = time(NULL);
+			/* Only call the callback every second */
+			if (now > last || done == st.size) {
+				pkg_emit_fetching(url, st.size, done, (now - begin_dl));
+				last = now;
+			}
+		}
+
+		if (remote != NULL && !ferror(remote) && done >= st.size)
 			break;
 
-		if (write(fd, buf, r) != r) {
-			pkg_emit_errno("write", dest);
+		if (remote != NULL) {
+			fetch_seterr(&err, FETCH_NETWORK, "transfer interrupted");
+			fclose(remote);
+			remote = NULL;
+		}
+
+		/* the connection dropped, but the transfer went on */
+		if (done > offset) {
+			retry = 3;
+			continue;
+		}
+
+		if (--retry == 0) {
+			pkg_emit_error("%s: %s", url, err.msg);
 			retcode = EPKG_FATAL;
 			goto cleanup;
 		}
 
-		done += r;
-		now = time(NULL);
-		/* Only call the callback every second */
-		if (now > last || done == st.size) {
-			pkg_emit_fetching(url, st.size, done, (now - begin_dl));
-			last = now;
+		/* a range past the end of the file, start over */
+		if (done > 0 && done == offset && err.code == FETCH_PROTO &&
+		    ftruncate(fd, 0) == -1) {
+			pkg_emit_errno("ftruncate", partial);
+			retcode = EPKG_FATAL;
+			goto cleanup;
 		}
+
+		sleep(1);
 	}
 
-	if (ferror(remote)) {
-		pkg_emit_error("%s: %s", url, fetchLastErrString);
-		retcode = EPKG_FATAL;
-		goto cleanup;
+	if (sum != NULL) {
+		SHA256_Final(hash, &sha256);
+		sha256_hash(hash, cksum);
+		if (strcmp(cksum, sum) != 0) {
+			pkg_emit_error("%s: checksum mismatch", url);
+			unlink(partial);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
 	}
 
+	if (rename(partial, dest) == -1) {
+		pkg_emit_errno("rename", dest);
+		retcode = EPKG_FATAL;
+	} else if (cond != NULL)
+		cond->mtime = st.mtime;
+
 	cleanup:
 
 	if (fd > 0)
@@ -80,9 +821,12 @@ pkg_fetch_file(const char *url, const char *dest)
 	if (remote != NULL)
 		fclose(remote);
 
+	if (u != NULL)
+		fetchFreeURL(u);
+
 	/* Remove local file if fetch failed */
-	if (retcode != EPKG_OK)
-		unlink(dest);
+	if (retcode != EPKG_OK && !resume)
+		unlink(partial);
 
 	return (retcode);
 }
@@ -7,13 +7,15 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <limits.h>
 #include <string.h>
 
 #include "pkg.h"
 #include "pkg_event.h"
 #include "pkg_private.h"
 
-static const char *packing_set_format(struct archive *a, pkg_formats format);
+static const char *packing_set_format(struct archive *a, pkg_formats format,
+    int level, int threads);
 
 struct packing {
 	struct archive *aread;
@@ -22,13 +24,27 @@ struct packing {
 };
 
 int
-packing_init(struct packing **pack, const char *path, pkg_formats format)
+packing_init(struct packing **pack, const char *path, pkg_formats format,
+    int level, int threads)
 {
 	char archive_path[MAXPATHLEN];
 	const char *ext;
+	int64_t val;
 
 	assert(pack != NULL);
 
+	if (level < 0) {
+		if (pkg_config_int64(PKG_CONFIG_COMPRESSION_LEVEL, &val) != EPKG_OK)
+			return (EPKG_FATAL);
+		level = MIN(val, INT_MAX);
+	}
+
+	if (threads < 0) {
+		if (pkg_config_int64(PKG_CONFIG_COMPRESSION_THREADS, &val) != EPKG_OK)
+			return (EPKG_FATAL);
+		threads = MIN(val, INT_MAX);
+	}
+
 	if ((*pack = calloc(1, sizeof(struct packing))) == NULL) {
 		pkg_emit_errno("malloc", "packing");
 		return (EPKG_FATAL);
@@ -41,9 +57,11 @@ packing_init(struct packing **pack, const char *path, pkg_formats format)
 	if (!is_dir(path)) {
 		(*pack)->awrite = archive_write_new();
 		archive_write_set_format_pax_restricted((*pack)->awrite);
-		if ((ext = packing_set_format((*pack)->awrite, format)) == NULL) {
+		if ((ext = packing_set_format((*pack)->awrite, format, level,
+		    threads)) == NULL) {
 			archive_read_finish((*pack)->aread);
 			archive_write_finish((*pack)->awrite);
+			free(*pack);
 			*pack = NULL;
 			return EPKG_FATAL; /* error set by _set_format() */
 		}
@@ -55,6 +73,7 @@ packing_init(struct packing **pack, const char *path, pkg_formats format)
 			    archive_path);
 			archive_read_finish((*pack)->aread);
 			archive_write_finish((*pack)->awrite);
+			free(*pack);
 			*pack = NULL;
 			return EPKG_FATAL;
 		}
@@ -231,30 +250,119 @@ packing_finish(struct packing *pack)
 	return (EPKG_OK);
 }
 
+static int
+packing_set_options(struct archive *a, const char *filter, int level,
+    int threads)
+{
+	char opt[64];
+	int max = (strcmp(filter, "zstd") == 0) ? 19 : 9;
+
+	/* one level serves all the formats, up to the maximum of each */
+	if (level > max)
+		level = max;
+
+	if (level > 0) {
+		snprintf(opt, sizeof(opt), "%s:compression-level=%d", filter,
+		    level);
+		if (archive_write_set_options(a, opt) != ARCHIVE_OK)
+			pkg_emit_error("%s: %s", opt, archive_error_string(a));
+	}
+
+	/*
+	 * Several xz threads compress separate blocks, which can be
+	 * decompressed in parallel too.  Older libarchive do not know the
+	 * option and stay single-threaded.
+	 */
+	if (threads != 1 && (strcmp(filter, "xz") == 0 ||
+	    strcmp(filter, "zstd") == 0)) {
+		snprintf(opt, sizeof(opt), "%s:threads=%d", filter, threads);
+		if (archive_write_set_options(a, opt) != ARCHIVE_OK)
+			pkg_emit_error("%s: %s, compressing with a single "
+			    "thread", opt, archive_error_string(a));
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+packing_set_filter(struct archive *a, pkg_formats format)
+{
+	switch (format) {
+		case TZST:
+			/* libarchive knows zstd since 3.3.3 */
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+			return (archive_write_add_filter_zstd(a));
+#else
+			return (ARCHIVE_FATAL);
+#endif
+		case TXZ:
+			return (archive_write_set_compression_xz(a));
+		case TBZ:
+			return (archive_write_set_compression_bzip2(a));
+		case TGZ:
+			return (archive_write_set_compression_gzip(a));
+		case TAR:
+			return (archive_write_set_compression_none(a));
+	}
+	return (ARCHIVE_FATAL);
+}
+
+bool
+packing_format_supported(pkg_formats format)
+{
+	struct archive *a;
+	bool ret;
+
+	a = archive_write_new();
+	ret = (packing_set_filter(a, format) == ARCHIVE_OK);
+	archive_write_finish(a);
+
+	return (ret);
+}
+
 static const char *
-packing_set_format(struct archive *a, pkg_formats format)
+packing_set_format(struct archive *a, pkg_formats format, int level,
+    int threads)
 {
 	switch (format) {
+		case TZST:
+			if (packing_set_filter(a, TZST) == ARCHIVE_OK) {
+				if (packing_set_options(a, "zstd", level,
+				    threads) != EPKG_OK)
+					return (NULL);
+				return ("tzst");
+			} else {
+				pkg_emit_error("%s", "zstd is not supported, trying xz");
+			}
 		case TXZ:
-			if (archive_write_set_compression_xz(a) == ARCHIVE_OK) {
+			if (packing_set_filter(a, TXZ) == ARCHIVE_OK) {
+				if (packing_set_options(a, "xz", level,
+				    threads) != EPKG_OK)
+					return (NULL);
 				return ("txz");
 			} else {
 				pkg_emit_error("%s", "xz is not supported, trying bzip2");
 			}
 		case TBZ:
-			if (archive_write_set_compression_bzip2(a) == ARCHIVE_OK) {
+			if (packing_set_filter(a, TBZ) == ARCHIVE_OK) {
+				if (packing_set_options(a, "bzip2", level,
+				    threads) != EPKG_OK)
+					return (NULL);
 				return ("tbz");
 			} else {
 				pkg_emit_error("%s", "bzip2 is not supported, trying gzip");
 			}
 		case TGZ:
-			if (archive_write_set_compression_gzip(a) == ARCHIVE_OK) {
+			if (packing_set_filter(a, TGZ) == ARCHIVE_OK) {
+				if (packing_set_options(a, "gzip", level,
+				    threads) != EPKG_OK)
+					return (NULL);
 				return ("tgz");
 			} else {
 				pkg_emit_error("%s", "gzip is not supported, trying plain tar");
 			}
 		case TAR:
-			archive_write_set_compression_none(a);
+			packing_set_filter(a, TAR);
 			return ("tar");
 	}
 	return (NULL);
@@ -265,6 +373,8 @@ packing_format_from_string(const char *str)
 {
 	if (str == NULL)
 		return TXZ;
+	if (strcmp(str, "tzst") == 0)
+		return TZST;
 	if (strcmp(str, "txz") == 0)
 		return TXZ;
 	if (strcmp(str, "tbz") == 0)
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "pkg_event.h"
@@ -93,6 +94,7 @@ pkg_reset(struct pkg *pkg, pkg_t type)
 	pkg_list_free(pkg, PKG_GROUPS);
 
 	pkg->rowid = 0;
+	pkg->flags = 0;
 	pkg->type = type;
 }
 
@@ -863,6 +865,44 @@ pkg_list_free(struct pkg *pkg, pkg_list list)  {
 	}
 }
 
+/*
+ * Raw bytes of a package, hashed on their way to the decompressor.
+ */
+struct pkg_reader {
+	int fd;
+	SHA256_CTX sha256;
+	char buf[32768];
+};
+
+static ssize_t
+pkg_reader_read(struct archive *a, void *data, const void **buf)
+{
+	struct pkg_reader *r = data;
+	ssize_t n;
+
+	if ((n = read(r->fd, r->buf, sizeof(r->buf))) == -1) {
+		archive_set_error(a, errno, "read: %s", strerror(errno));
+		return (-1);
+	}
+	SHA256_Update(&r->sha256, r->buf, n);
+	*buf = r->buf;
+
+	return (n);
+}
+
+static int
+pkg_reader_close(struct archive *a, void *data)
+{
+	(void)a;
+	(void)data;
+
+	/* the caller still hashes the rest of the file */
+	return (ARCHIVE_OK);
+}
+
+static int pkg_open_archive(struct pkg **, struct archive **,
+    struct archive_entry **, const char *, struct sbuf *, struct pkg_reader *);
+
 int
 pkg_open(struct pkg **pkg_p, const char *path, struct sbuf *mbuf)
 {
@@ -880,8 +920,59 @@ pkg_open(struct pkg **pkg_p, const char *path, struct sbuf *mbuf)
 	return (EPKG_OK);
 }
 
+int
+pkg_open_cksum(struct pkg **pkg_p, const char *path, struct sbuf *mbuf,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	struct pkg_reader r;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	ssize_t n;
+	int ret;
+
+	if ((r.fd = open(path, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", path);
+		return (EPKG_FATAL);
+	}
+	SHA256_Init(&r.sha256);
+
+	ret = pkg_open_archive(pkg_p, &a, &ae, path, mbuf, &r);
+
+	if (ret != EPKG_OK && ret != EPKG_END) {
+		close(r.fd);
+		return (EPKG_FATAL);
+	}
+
+	archive_read_finish(a);
+
+	/* the files after the metadata are hashed without being decompressed */
+	while ((n = read(r.fd, r.buf, sizeof(r.buf))) > 0)
+		SHA256_Update(&r.sha256, r.buf, n);
+
+	close(r.fd);
+
+	if (n == -1) {
+		pkg_emit_errno("read", path);
+		return (EPKG_FATAL);
+	}
+
+	SHA256_Final(hash, &r.sha256);
+	sha256_hash(hash, cksum);
+
+	return (EPKG_OK);
+}
+
 int
 pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf)
+{
+	return (pkg_open_archive(pkg_p, a, ae, path, mbuf, NULL));
+}
+
+static int
+pkg_open_archive(struct pkg **pkg_p, struct archive **a,
+    struct archive_entry **ae, const char *path, struct sbuf *mbuf,
+    struct pkg_reader *r)
 {
 	struct pkg *pkg;
 	pkg_error_t retcode = EPKG_OK;
@@ -912,8 +1003,14 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 	archive_read_support_compression_all(*a);
 	archive_read_support_format_tar(*a);
 
-	if (archive_read_open_filename(*a, path, 4096) != ARCHIVE_OK) {
-		pkg_emit_error("archive_read_open_filename(%s): %s", path,
+	if (r != NULL)
+		ret = archive_read_open(*a, r, NULL, pkg_reader_read,
+		    pkg_reader_close);
+	else
+		ret = archive_read_open_filename(*a, path, 4096);
+
+	if (ret != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open(%s): %s", path,
 					   archive_error_string(*a));
 		retcode = EPKG_FATAL;
 		goto cleanup;
@@ -1007,7 +1104,7 @@ pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 	char spath[MAXPATHLEN + 1];
 	char dpath[MAXPATHLEN + 1];
 
-	if (packing_init(&pack, dest, 0) != EPKG_OK) {
+	if (packing_init(&pack, dest, 0, -1, -1) != EPKG_OK) {
 		/* TODO */
 		return EPKG_FATAL;
 	}
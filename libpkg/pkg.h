@@ -28,6 +28,8 @@ struct pkg_repos_entry;
 
 struct pkg_config_kv;
 
+struct pkg_cache_entry;
+
 typedef enum {
 	/**
 	 * The license logic is OR (dual in the ports)
@@ -84,7 +86,8 @@ typedef enum {
 	FIELD_NAME,
 	FIELD_NAMEVER,
 	FIELD_COMMENT,
-	FIELD_DESC
+	FIELD_DESC,
+	FIELD_CKSUM
 } pkgdb_field;
 
 /**
@@ -203,7 +206,16 @@ typedef enum _pkg_config_key {
 	PKG_CONFIG_ASSUME_ALWAYS_YES = 7,
 	PKG_CONFIG_REPOS = 8,
 	PKG_CONFIG_PLIST_KEYWORDS_DIR = 9,
-	PKG_CONFIG_SYSLOG = 10
+	PKG_CONFIG_SYSLOG = 10,
+	PKG_CONFIG_DBPROFILE = 11,
+	PKG_CONFIG_FETCH_WORKERS = 12,
+	PKG_CONFIG_EXTRACT_WORKERS = 13,
+	PKG_CONFIG_CACHE_SIZE = 14,
+	PKG_CONFIG_REPO_WORKERS = 15,
+	PKG_CONFIG_COMPRESSION_LEVEL = 16,
+	PKG_CONFIG_COMPRESSION_THREADS = 17,
+	PKG_CONFIG_FETCH_TIMEOUT = 18,
+	PKG_CONFIG_SEARCH_LIMIT = 19
 } pkg_config_key;
 
 typedef enum {
@@ -211,6 +223,11 @@ typedef enum {
 	PKG_CONFIG_KV_VALUE
 } pkg_config_kv_t;
 
+typedef enum {
+	PKG_CACHE_CKSUM,
+	PKG_CACHE_NAME
+} pkg_cache_t;
+
 /**
  * Error type used everywhere by libpkg.
  */
@@ -237,6 +254,10 @@ typedef enum {
 	 * Can not install the package because some dependencies are unresolved.
 	 */
 	EPKG_DEPENDENCY,
+	/**
+	 * Nothing to do: the remote file did not change since the last update.
+	 */
+	EPKG_UPTODATE,
 } pkg_error_t;
 
 /**
@@ -518,12 +539,24 @@ const char *pkg_option_value(struct pkg_option *);
 /**
  * Create a repository database.
  * @param path The path where the repository live.
- * @param callback A function which is called at every step of the process.
+ * @param incremental Only open the packages whose path, size or mtime
+ * changed since the existing repo.sqlite, the result is the same.
+ * @param callback A function which is called at every step of the process,
+ * with a NULL package for the unchanged ones.
  * @param data A pointer which is passed to the callback.
  * @param sum An 65 long char array to receive the sha256 sum
  */
-int pkg_create_repo(char *path, void (*callback)(struct pkg *, void *), void *);
-int pkg_finish_repo(char *patj, pem_password_cb *cb, char *rsa_key_path);
+int pkg_create_repo(char *path, bool incremental,
+    void (*callback)(struct pkg *, void *), void *);
+
+/**
+ * Pack the repository database created by pkg_create_repo() into repo.txz,
+ * signed with the given key if any.
+ * @param delta Also write repo.delta.txz, the changes since the previous
+ * repo.txz for pkg_update() to apply.
+ */
+int pkg_finish_repo(char *path, pem_password_cb *cb, char *rsa_key_path,
+    bool delta);
 
 /**
  * Open the local package database.
@@ -537,6 +570,12 @@ int pkgdb_open(struct pkgdb **db, pkgdb_t type);
  */
 void pkgdb_close(struct pkgdb *db);
 
+/**
+ * Get the prepared statement cache counters of the database connection:
+ * hits are statements reused, misses are statements prepared.
+ */
+void pkgdb_stmt_stats(struct pkgdb *db, int64_t *hits, int64_t *misses);
+
 /** 
  * Dump the content of the database in yaml format
  * only to use when mtree will be deprecated
@@ -604,6 +643,8 @@ struct pkgdb_it * pkgdb_query_which(struct pkgdb *db, const char *path);
  * @param pkg An allocated struct pkg or a pointer to a NULL pointer. In the
  * last case, the function take care of the allocation.
  * @param flags OR'ed PKG_LOAD_*
+ * On iterators returned by pkgdb_query(), the relations requested by flags
+ * are loaded for the whole result set with one ordered scan each.
  * @return An error code.
  */
 int pkgdb_it_next(struct pkgdb_it *, struct pkg **pkg, int flags);
@@ -663,8 +704,19 @@ int pkg_jobs_is_empty(struct pkg_jobs *jobs);
  */
 int pkg_jobs(struct pkg_jobs *jobs, struct pkg **pkg);
 
+/**
+ * Get the level of a package in the jobs queue once it is ordered by
+ * dependencies.  Jobs of one level do not depend on each other and only
+ * depend on jobs of the lower levels.
+ * @param nlevels If not NULL, set to the number of levels.
+ * @return An error code.
+ */
+int pkg_jobs_level(struct pkg_jobs *jobs, struct pkg *pkg, int *level, int *nlevels);
+
 /**
  * Apply the jobs in the queue (fetch and install).
+ * The queue is first ordered so that dependencies are installed before,
+ * or deleted after, the packages which need them.
  * @return An error code.
  */
 int pkg_jobs_apply(struct pkg_jobs *jobs, int force);
@@ -672,7 +724,7 @@ int pkg_jobs_apply(struct pkg_jobs *jobs, int force);
 /**
  * Archive formats options.
  */
-typedef enum pkg_formats { TAR, TGZ, TBZ, TXZ } pkg_formats;
+typedef enum pkg_formats { TAR, TGZ, TBZ, TXZ, TZST } pkg_formats;
 
 /**
  * Create package from an installed & registered package
@@ -686,11 +738,39 @@ int pkg_create_fakeroot(const char *, pkg_formats, const char *, const char *);
 
 int pkg_repo_verify(const char *path, unsigned char *sig, unsigned int sig_len);
 
+/**
+ * Update the local copy of the database of a repository from its
+ * packagesite. The delta since the local copy is applied when the
+ * repository publishes one, otherwise the whole database is fetched;
+ * nothing is downloaded when the repository did not change.
+ * @return EPKG_OK, EPKG_UPTODATE or an error code
+ */
+int pkg_update(const char *name, const char *packagesite);
+
+/**
+ * A repository for pkg_update_repos() and the outcome of its update.
+ */
+struct pkg_update_repo {
+	const char *name;
+	const char *packagesite;
+	int retcode;		/* as returned by pkg_update() */
+	double elapsed;		/* seconds spent on the repository */
+};
+
+/**
+ * Update several repositories at the same time, FETCH_WORKERS at most.
+ * Each database is swapped in on its own, once fetched and verified.
+ * @return EPKG_OK when every repository is up to date, an error code
+ * otherwise
+ */
+int pkg_update_repos(struct pkg_update_repo *repos, int nrepos);
+
 /**
  * Get the value of a configuration key
  */
 int pkg_config_string(pkg_config_key key, const char **value);
 int pkg_config_bool(pkg_config_key key, bool *value);
+int pkg_config_int64(pkg_config_key key, int64_t *value);
 int pkg_config_list(pkg_config_key key, struct pkg_config_kv **kv);
 const char *pkg_config_kv_get(struct pkg_config_kv *kv, pkg_config_kv_t type);
 
@@ -700,11 +780,43 @@ const char *pkg_config_kv_get(struct pkg_config_kv *kv, pkg_config_kv_t type);
 int pkg_version_cmp(const char * const , const char * const);
 
 /**
- * Fetch a file.
+ * Encode a version into a binary key.  Keys compare with memcmp(3), the
+ * shorter first when one is a prefix of the other, as pkg_version_cmp()
+ * compares the versions.
+ * @return An error code.
+ */
+int pkg_version_key(const char *version, struct sbuf *key);
+
+/**
+ * Fetch a file. The data is written to dest.part until the download is
+ * complete; a dropped transfer is resumed where it stopped.
  * @return An error code.
  */
 int pkg_fetch_file(const char *url, const char *dest);
 
+/**
+ * Iterate over the packages of the cache, as recorded in its index.
+ * @param e NULL to start from the first package
+ * @return EPKG_OK, EPKG_END after the last package or an error code
+ */
+int pkg_cache_list(struct pkg_cache_entry **e);
+const char *pkg_cache_get(struct pkg_cache_entry *e, pkg_cache_t attr);
+
+/**
+ * Remove the package with the given checksum from the cache.
+ * @return An error code.
+ */
+int pkg_cache_remove(const char *cksum);
+
+/**
+ * Remove the files of the cache which are neither a package stored under its
+ * checksum nor the index, such as the packages of the older layout.
+ * @param count Set to the number of files removed
+ * @param bytes Set to their size
+ * @return An error code.
+ */
+int pkg_cache_prune(int64_t *count, int64_t *bytes);
+
 /* glue to deal with ports */
 int ports_parse_plist(struct pkg *, char *);
 
@@ -727,6 +839,8 @@ typedef enum {
 	PKG_EVENT_FETCHING,
 	PKG_EVENT_INTEGRITYCHECK_BEGIN,
 	PKG_EVENT_INTEGRITYCHECK_FINISHED,
+	PKG_EVENT_STAGE_TIMES,
+	PKG_EVENT_CACHE_EVICTED,
 	/* errors */
 	PKG_EVENT_ERROR,
 	PKG_EVENT_ERRNO,
@@ -754,6 +868,19 @@ struct pkg_event {
 			off_t done;
 			time_t elapsed;
 		} e_fetching;
+		struct {
+			double fetch;	/* first request to last download */
+			double verify;
+			double extract;
+			double overlap;	/* extraction before the last download */
+			double total;
+			int64_t opened;	/* HTTP connections */
+			int64_t reused;	/* requests on an open connection */
+		} e_stage_times;
+		struct {
+			int64_t count;
+			int64_t bytes;
+		} e_cache_evicted;
 		struct {
 			struct pkg *pkg;
 		} e_already_installed;
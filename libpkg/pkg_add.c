@@ -34,7 +34,7 @@ dep_installed(struct pkg_dep *dep, struct pkgdb *db) {
 }
 
 static int
-do_extract(struct archive *a, struct archive_entry *ae)
+do_extract(struct archive *a, struct archive_entry *ae, struct archive *ad)
 {
 	int retcode = EPKG_OK;
 	int ret = 0;
@@ -42,7 +42,7 @@ do_extract(struct archive *a, struct archive_entry *ae)
 	struct stat st;
 
 	do {
-		if (archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS) != ARCHIVE_OK) {
+		if (archive_read_extract2(a, ae, ad) != ARCHIVE_OK) {
 			/*
 			 * show error except when the failure is during
 			 * extracting a directory and that the directory already
@@ -70,7 +70,7 @@ do_extract(struct archive *a, struct archive_entry *ae)
 		if (is_conf_file(archive_entry_pathname(ae), path, sizeof(path))
 		    && lstat(path, &st) == ENOENT) {
 			archive_entry_set_pathname(ae, path);
-			if (archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS) != ARCHIVE_OK) {
+			if (archive_read_extract2(a, ae, ad) != ARCHIVE_OK) {
 				pkg_emit_error("archive_read_extract(): %s",
 							   archive_error_string(a));
 				retcode = EPKG_FATAL;
@@ -88,21 +88,37 @@ do_extract(struct archive *a, struct archive_entry *ae)
 	return (retcode);
 }
 
+void
+pkg_add_state_free(struct pkg_add_state *st)
+{
+	if (st->a != NULL)
+		archive_read_finish(st->a);
+	if (st->ad != NULL)
+		archive_write_finish(st->ad);
+
+	pkg_free(st->pkg);
+
+	st->a = NULL;
+	st->ad = NULL;
+	st->pkg = NULL;
+}
+
+/*
+ * Open the package, check it can be installed, register it and run the
+ * pre-install script. Nothing is left to clean up on failure.
+ */
 int
-pkg_add(struct pkgdb *db, const char *path, int flags)
+pkg_add_prepare(struct pkgdb *db, const char *path, int flags,
+    struct pkg_add_state *st)
 {
 	const char *arch;
 	const char *origin;
-	struct archive *a;
-	struct archive_entry *ae;
 	struct pkgdb_it *it;
 	struct pkg *p = NULL;
-	struct pkg *pkg = NULL;
 	struct pkg_dep *dep = NULL;
 	struct utsname u;
-	bool extract = true;
-	bool handle_rc = false;
 	char dpath[MAXPATHLEN + 1];
+	char dir[MAXPATHLEN + 1];
 	const char *basedir;
 	const char *ext;
 	int retcode = EPKG_OK;
@@ -110,28 +126,33 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 
 	assert(path != NULL);
 
+	memset(st, 0, sizeof(struct pkg_add_state));
+	st->flags = flags;
+	st->extract = true;
+
 	/*
 	 * Open the package archive file, read all the meta files and set the
 	 * current archive_entry to the first non-meta file.
 	 * If there is no non-meta files, EPKG_END is returned.
 	 */
-	ret = pkg_open2(&pkg, &a, &ae, path, NULL);
+	ret = pkg_open2(&st->pkg, &st->a, &st->ae, path, NULL);
 	if (ret == EPKG_END)
-		extract = false;
+		st->extract = false;
 	else if (ret != EPKG_OK) {
 		retcode = ret;
 		goto cleanup;
 	}
 	if ((flags & PKG_ADD_UPGRADE) == 0)
-		pkg_emit_install_begin(pkg);
+		pkg_emit_install_begin(st->pkg);
 
-	if (pkg_is_valid(pkg) != EPKG_OK) {
+	if (pkg_is_valid(st->pkg) != EPKG_OK) {
 		pkg_emit_error("the package is not valid");
-		return (EPKG_FATAL);
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
 	if (flags & PKG_ADD_AUTOMATIC)
-		pkg_set(pkg, PKG_AUTOMATIC, true);
+		pkg_set(st->pkg, PKG_AUTOMATIC, true);
 
 	if (uname(&u) != 0) {
 		pkg_emit_errno("uname", "");
@@ -143,7 +164,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	 * Check the architecture
 	 */
 
-	pkg_get(pkg, PKG_ARCH, &arch, PKG_ORIGIN, &origin);
+	pkg_get(st->pkg, PKG_ARCH, &arch, PKG_ORIGIN, &origin);
 
 	if (strcmp(u.machine, arch) != 0) {
 		pkg_emit_error("wrong architecture: %s instead of %s",
@@ -167,9 +188,10 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 
 	ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC);
 	pkgdb_it_free(it);
+	pkg_free(p);
 
 	if (ret == EPKG_OK) {
-		pkg_emit_already_installed(pkg);
+		pkg_emit_already_installed(st->pkg);
 		retcode = EPKG_INSTALLED;
 		goto cleanup;
 	} else if (ret != EPKG_END) {
@@ -181,14 +203,16 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	 * Check for dependencies
 	 */
 
-	basedir = dirname(path);
+	/* dirname(3) is not thread safe */
+	strlcpy(dir, path, sizeof(dir));
+	basedir = dirname(dir);
 	if ((ext = strrchr(path, '.')) == NULL) {
 		pkg_emit_error("%s has no extension", path);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
 
-	while (pkg_deps(pkg, &dep) == EPKG_OK) {
+	while (pkg_deps(st->pkg, &dep) == EPKG_OK) {
 		if (dep_installed(dep, db) != EPKG_OK) {
 			snprintf(dpath, sizeof(dpath), "%s/%s-%s%s", basedir,
 					 pkg_dep_get(dep, PKG_DEP_NAME), pkg_dep_get(dep, PKG_DEP_VERSION),
@@ -201,18 +225,32 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 				}
 			} else {
 				retcode = EPKG_FATAL;
-				pkg_emit_missing_dep(pkg, dep);
+				pkg_emit_missing_dep(st->pkg, dep);
 				goto cleanup;
 			}
 		}
 	}
 
+	/*
+	 * archive_write_disk_new() switches the umask of the process back
+	 * and forth, which is not to happen in the extraction threads.
+	 */
+	if (st->extract) {
+		if ((st->ad = archive_write_disk_new()) == NULL) {
+			pkg_emit_errno("archive_write_disk_new", "");
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		archive_write_disk_set_options(st->ad, EXTRACT_ARCHIVE_FLAGS);
+		archive_write_disk_set_standard_lookup(st->ad);
+	}
+
 	/* register the package before installing it in case there are
 	 * problems that could be caught here. */
 	if ((flags & PKG_ADD_UPGRADE) == 0)
-		retcode = pkgdb_register_pkg(db, pkg, 0);
+		retcode = pkgdb_register_pkg(db, st->pkg, 0);
 	else
-		retcode = pkgdb_register_pkg(db, pkg, 1);
+		retcode = pkgdb_register_pkg(db, st->pkg, 1);
 
 	if (retcode != EPKG_OK)
 		goto cleanup;
@@ -221,28 +259,78 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	 * Execute pre-install scripts
 	 */
 	if ((flags & PKG_ADD_UPGRADE_NEW) == 0)
-		pkg_script_run(pkg, PKG_SCRIPT_PRE_INSTALL);
+		pkg_script_run(st->pkg, PKG_SCRIPT_PRE_INSTALL);
 
 	/* add the user and group if necessary */
 	/* pkg_add_user_group(pkg); */
 
+	return (EPKG_OK);
+
+	cleanup:
+	pkg_add_state_free(st);
+
+	return (retcode);
+}
+
+/*
+ * Extract the files on disk. The database is not used, so that several
+ * packages can be extracted at once.
+ */
+int
+pkg_add_extract(struct pkg_add_state *st)
+{
+	st->retcode = EPKG_OK;
+
+	if (st->extract == true)
+		st->retcode = do_extract(st->a, st->ae, st->ad);
+
 	/*
-	 * Extract the files on disk.
+	 * Closing the disk writer sets the modes and times of the directories.
+	 * The package may wait a while for its post-install scripts.
 	 */
-	if (extract == true && (retcode = do_extract(a, ae)) != EPKG_OK) {
+	if (st->ad != NULL) {
+		if (archive_write_close(st->ad) != ARCHIVE_OK &&
+		    st->retcode == EPKG_OK) {
+			pkg_emit_error("archive_write_close(): %s",
+			    archive_error_string(st->ad));
+			st->retcode = EPKG_FATAL;
+		}
+		archive_write_finish(st->ad);
+		st->ad = NULL;
+	}
+	if (st->a != NULL) {
+		archive_read_finish(st->a);
+		st->a = NULL;
+		st->ae = NULL;
+	}
+
+	return (st->retcode);
+}
+
+/*
+ * Run the post-install scripts and complete the registration, or clean up
+ * after a failed extraction. The state is still to be freed.
+ */
+int
+pkg_add_finish(struct pkgdb *db, struct pkg_add_state *st)
+{
+	bool handle_rc = false;
+	int retcode = st->retcode;
+
+	if (retcode != EPKG_OK) {
 		/* If the add failed, clean up */
-		pkg_delete_files(pkg, 1);
-		pkg_delete_dirs(db, pkg, 1);
+		pkg_delete_files(st->pkg, 1);
+		pkg_delete_dirs(db, st->pkg, 1);
 		goto cleanup_reg;
 	}
 
 	/*
 	 * Execute post install scripts
 	 */
-	if (flags & PKG_ADD_UPGRADE_NEW)
-		pkg_script_run(pkg, PKG_SCRIPT_POST_UPGRADE);
+	if (st->flags & PKG_ADD_UPGRADE_NEW)
+		pkg_script_run(st->pkg, PKG_SCRIPT_POST_UPGRADE);
 	else
-		pkg_script_run(pkg, PKG_SCRIPT_POST_INSTALL);
+		pkg_script_run(st->pkg, PKG_SCRIPT_POST_INSTALL);
 
 	/*
 	 * start the different related services if the users do want that
@@ -251,23 +339,30 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 
 	pkg_config_bool(PKG_CONFIG_HANDLE_RC_SCRIPTS, &handle_rc);
 	if (handle_rc)
-		pkg_start_rc_scripts(pkg);
+		pkg_start_rc_scripts(st->pkg);
 
 	cleanup_reg:
-	if ((flags & PKG_ADD_UPGRADE) == 0)
+	if ((st->flags & PKG_ADD_UPGRADE) == 0)
 		pkgdb_register_finale(db, retcode);
 
-	if (retcode == EPKG_OK && (flags & PKG_ADD_UPGRADE) == 0)
-		pkg_emit_install_finished(p);
+	if (retcode == EPKG_OK && (st->flags & PKG_ADD_UPGRADE) == 0)
+		pkg_emit_install_finished(st->pkg);
 
-	cleanup:
-	if (a != NULL)
-		archive_read_finish(a);
+	return (retcode);
+}
+
+int
+pkg_add(struct pkgdb *db, const char *path, int flags)
+{
+	struct pkg_add_state st;
+	int retcode;
 
-	if (p != NULL)
-		pkg_free(p);
+	if ((retcode = pkg_add_prepare(db, path, flags, &st)) != EPKG_OK)
+		return (retcode);
 
-	pkg_free(pkg);
+	pkg_add_extract(&st);
+	retcode = pkg_add_finish(db, &st);
+	pkg_add_state_free(&st);
 
 	return (retcode);
 }
@@ -0,0 +1,639 @@
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "pkg_event.h"
+#include "pkg_private.h"
+
+/*
+ * The packages are cached under their SHA-256, PKG_CACHEDIR/ab/abcdef..., so
+ * that a package found in several repositories is stored once.
+ *
+ * The index, PKG_CACHEDIR/index, records the size, the modification time and
+ * the inode of each package when its checksum was verified; a package which
+ * did not change since is trusted without being hashed again.  It also
+ * records when each package was last used, the least recently used packages
+ * are evicted when the cache grows over CACHE_SIZE, except the ones pinned
+ * by a running process until it releases them.  One line per package, the
+ * least recently used first, "-" for no pins:
+ *	cksum size mtime inode name-version atime pid,pid,...
+ */
+#define CACHE_INDEX "index"
+
+struct pkg_cache_entry {
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *name;
+	int64_t size;
+	int64_t mtime;
+	int64_t ino;
+	int64_t atime;
+	bool removed;
+	pid_t *pins;		/* the processes using it, not evicted */
+	size_t npins;
+	STAILQ_ENTRY(pkg_cache_entry) next;
+};
+
+/* never freed, so that pkg_cache_list() survives the updates of the index */
+static STAILQ_HEAD(, pkg_cache_entry) cache = STAILQ_HEAD_INITIALIZER(cache);
+static bool cache_loaded = false;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+cache_cksum_valid(const char *cksum)
+{
+	size_t i;
+
+	if (cksum == NULL || strlen(cksum) != SHA256_DIGEST_LENGTH * 2)
+		return (false);
+
+	for (i = 0; cksum[i] != '\0'; i++) {
+		if (!isxdigit((unsigned char)cksum[i]))
+			return (false);
+	}
+
+	return (true);
+}
+
+int
+pkg_cache_path(const char *cksum, char *path, size_t len)
+{
+	const char *cachedir;
+
+	if (!cache_cksum_valid(cksum)) {
+		pkg_emit_error("invalid package checksum '%s'",
+		    cksum != NULL ? cksum : "");
+		return (EPKG_FATAL);
+	}
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(path, len, "%s/%.2s/%s", cachedir, cksum, cksum);
+
+	return (EPKG_OK);
+}
+
+/*
+ * The entry of a checksum, removed ones included, created if needed
+ */
+static struct pkg_cache_entry *
+cache_entry(const char *cksum)
+{
+	struct pkg_cache_entry *e;
+
+	STAILQ_FOREACH(e, &cache, next) {
+		if (strcmp(e->cksum, cksum) == 0)
+			return (e);
+	}
+
+	if ((e = calloc(1, sizeof(struct pkg_cache_entry))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_cache_entry");
+		return (NULL);
+	}
+
+	strlcpy(e->cksum, cksum, sizeof(e->cksum));
+	e->removed = true;
+	STAILQ_INSERT_TAIL(&cache, e, next);
+
+	return (e);
+}
+
+static void
+cache_entry_set(struct pkg_cache_entry *e, struct stat *st, const char *name)
+{
+	/* the name may be in use by a caller of pkg_cache_list() */
+	if (e->name == NULL || strcmp(e->name, name) != 0) {
+		free(e->name);
+		e->name = strdup(name);
+	}
+
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->ino = st->st_ino;
+	e->removed = false;
+}
+
+static bool
+cache_pinned(struct pkg_cache_entry *e, pid_t pid)
+{
+	size_t i;
+
+	for (i = 0; i < e->npins; i++) {
+		if (e->pins[i] == pid)
+			return (true);
+	}
+
+	return (false);
+}
+
+static int
+cache_pin(struct pkg_cache_entry *e, pid_t pid)
+{
+	pid_t *pins;
+
+	if (cache_pinned(e, pid))
+		return (EPKG_OK);
+
+	if ((pins = realloc(e->pins, (e->npins + 1) * sizeof(pid_t))) == NULL) {
+		pkg_emit_errno("realloc", "pkg_cache_entry");
+		return (EPKG_FATAL);
+	}
+	e->pins = pins;
+	e->pins[e->npins++] = pid;
+
+	return (EPKG_OK);
+}
+
+/* the pins of the given process or, with 0, of the processes which exited */
+static void
+cache_unpin(struct pkg_cache_entry *e, pid_t pid)
+{
+	size_t i = 0;
+
+	while (i < e->npins) {
+		if (pid != 0 ? e->pins[i] == pid :
+		    kill(e->pins[i], 0) == -1 && errno == ESRCH)
+			e->pins[i] = e->pins[--e->npins];
+		else
+			i++;
+	}
+}
+
+/* pids separated by commas, as written by cache_save() */
+static void
+cache_pins_parse(struct pkg_cache_entry *e, const char *pins)
+{
+	char *end;
+	long pid;
+
+	e->npins = 0;
+	while (*pins != '\0') {
+		pid = strtol(pins, &end, 10);
+		if (end == pins)
+			break;
+		if (pid > 0 && cache_pin(e, pid) != EPKG_OK)
+			break;
+		pins = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/*
+ * Evict the least recently used packages until the cache fits in the
+ * budget, called with cache_lock held
+ */
+static void
+cache_evict(int64_t budget, int64_t *count, int64_t *bytes)
+{
+	struct pkg_cache_entry *e, *lru;
+	char path[MAXPATHLEN + 1];
+	char *slash;
+	int64_t total = 0;
+
+	STAILQ_FOREACH(e, &cache, next) {
+		if (!e->removed)
+			total += e->size;
+	}
+
+	while (total > budget) {
+		/* the order of the list breaks the ties */
+		lru = NULL;
+		STAILQ_FOREACH(e, &cache, next) {
+			if (e->removed || e->npins > 0)
+				continue;
+			if (lru == NULL || e->atime < lru->atime)
+				lru = e;
+		}
+
+		/* what is left is in use */
+		if (lru == NULL)
+			break;
+
+		if (pkg_cache_path(lru->cksum, path, sizeof(path)) != EPKG_OK ||
+		    (unlink(path) == -1 && errno != ENOENT)) {
+			pkg_emit_errno("unlink", path);
+			break;
+		}
+		if ((slash = strrchr(path, '/')) != NULL) {
+			*slash = '\0';
+			rmdir(path);
+		}
+
+		lru->removed = true;
+		total -= lru->size;
+		(*count)++;
+		*bytes += lru->size;
+	}
+}
+
+/*
+ * Merge the index into the entries in memory, called with cache_lock held
+ */
+static int
+cache_load(const char *cachedir)
+{
+	FILE *fp;
+	struct pkg_cache_entry *e;
+	struct stat st;
+	char path[MAXPATHLEN + 1];
+	char line[MAXPATHLEN + 256];
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char name[MAXPATHLEN + 1];
+	char pins[256];
+	intmax_t size, mtime, ino, atime;
+	int n;
+
+	/* the packages missing from the index are gone */
+	STAILQ_FOREACH(e, &cache, next)
+		e->removed = true;
+
+	snprintf(path, sizeof(path), "%s/%s", cachedir, CACHE_INDEX);
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT) {
+			pkg_emit_errno("fopen", path);
+			return (EPKG_FATAL);
+		}
+		cache_loaded = true;
+		return (EPKG_OK);
+	}
+
+	memset(&st, 0, sizeof(st));
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n = sscanf(line, "%64s %jd %jd %jd %1024s %jd %255s", cksum,
+		    &size, &mtime, &ino, name, &atime, pins);
+		if (n < 5 || !cache_cksum_valid(cksum))
+			continue;
+		if ((e = cache_entry(cksum)) == NULL)
+			break;
+		st.st_size = size;
+		st.st_mtime = mtime;
+		st.st_ino = ino;
+		cache_entry_set(e, &st, name);
+		/* used by another process meanwhile */
+		if (n == 6 && atime > e->atime)
+			e->atime = atime;
+		else if (n == 5)
+			e->atime = mtime;
+		cache_pins_parse(e, n == 7 ? pins : "");
+		/* a process killed before releasing them */
+		cache_unpin(e, 0);
+	}
+	fclose(fp);
+
+	cache_loaded = true;
+
+	return (EPKG_OK);
+}
+
+static int
+cache_save(const char *cachedir)
+{
+	FILE *fp;
+	struct pkg_cache_entry *e;
+	char path[MAXPATHLEN + 1];
+	char tmp[MAXPATHLEN + 1];
+	size_t i;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", cachedir, CACHE_INDEX);
+	snprintf(tmp, sizeof(tmp), "%s/%s.XXXXXX", cachedir, CACHE_INDEX);
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		pkg_emit_errno("mkstemp", tmp);
+		return (EPKG_FATAL);
+	}
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		pkg_emit_errno("fdopen", tmp);
+		close(fd);
+		unlink(tmp);
+		return (EPKG_FATAL);
+	}
+
+	STAILQ_FOREACH(e, &cache, next) {
+		if (e->removed)
+			continue;
+		fprintf(fp, "%s %jd %jd %jd %s %jd ", e->cksum,
+		    (intmax_t)e->size, (intmax_t)e->mtime, (intmax_t)e->ino,
+		    e->name, (intmax_t)e->atime);
+		for (i = 0; i < e->npins; i++)
+			fprintf(fp, "%s%jd", i > 0 ? "," : "",
+			    (intmax_t)e->pins[i]);
+		fprintf(fp, "%s\n", e->npins == 0 ? "-" : "");
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) == -1) {
+		pkg_emit_errno("rename", path);
+		unlink(tmp);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Record a package as just used and pin it or, with a NULL st, forget it;
+ * with a NULL cksum the pins of this process are dropped and only the budget
+ * is enforced. The index is read again under an exclusive lock of the cache
+ * directory since other processes update it too.
+ */
+static int
+cache_update(const char *cksum, struct stat *st, const char *name)
+{
+	struct pkg_cache_entry *e;
+	const char *cachedir;
+	int64_t budget, count = 0, bytes = 0;
+	int dfd;
+	int ret;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK ||
+	    pkg_config_int64(PKG_CONFIG_CACHE_SIZE, &budget) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	if ((dfd = open(cachedir, O_RDONLY)) == -1 ||
+	    flock(dfd, LOCK_EX) == -1) {
+		pkg_emit_errno("flock", cachedir);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if ((ret = cache_load(cachedir)) != EPKG_OK)
+		goto cleanup;
+
+	if (cksum != NULL && (e = cache_entry(cksum)) == NULL) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (cksum != NULL && st != NULL) {
+		cache_entry_set(e, st, name);
+		e->atime = time(NULL);
+		if ((ret = cache_pin(e, getpid())) != EPKG_OK)
+			goto cleanup;
+		/* the most recently used last */
+		STAILQ_REMOVE(&cache, e, pkg_cache_entry, next);
+		STAILQ_INSERT_TAIL(&cache, e, next);
+	} else if (cksum != NULL) {
+		e->removed = true;
+	} else {
+		STAILQ_FOREACH(e, &cache, next)
+			cache_unpin(e, getpid());
+	}
+
+	/* CACHE_SIZE is in megabytes, 0 for no limit */
+	if (budget > 0)
+		cache_evict(budget * 1024 * 1024, &count, &bytes);
+
+	ret = cache_save(cachedir);
+
+	cleanup:
+	if (dfd != -1)
+		close(dfd);
+	pthread_mutex_unlock(&cache_lock);
+
+	if (count > 0)
+		pkg_emit_cache_evicted(count, bytes);
+
+	return (ret);
+}
+
+bool
+pkg_cache_verified(const char *cksum)
+{
+	struct pkg_cache_entry *e;
+	struct stat st;
+	const char *cachedir;
+	char path[MAXPATHLEN + 1];
+	bool ret = false;
+
+	if (pkg_cache_path(cksum, path, sizeof(path)) != EPKG_OK ||
+	    stat(path, &st) == -1)
+		return (false);
+
+	pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir);
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_loaded || cache_load(cachedir) == EPKG_OK) {
+		STAILQ_FOREACH(e, &cache, next) {
+			if (e->removed || strcmp(e->cksum, cksum) != 0)
+				continue;
+			ret = (e->size == st.st_size && e->mtime == st.st_mtime &&
+			    e->ino == (int64_t)st.st_ino);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return (ret);
+}
+
+int
+pkg_cache_stamp(const char *cksum, const char *name)
+{
+	struct stat st;
+	char path[MAXPATHLEN + 1];
+
+	if (pkg_cache_path(cksum, path, sizeof(path)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (stat(path, &st) == -1) {
+		pkg_emit_errno("stat", path);
+		return (EPKG_FATAL);
+	}
+
+	return (cache_update(cksum, &st, name));
+}
+
+void
+pkg_cache_release(void)
+{
+	struct pkg_cache_entry *e;
+	bool pinned = false;
+
+	pthread_mutex_lock(&cache_lock);
+	STAILQ_FOREACH(e, &cache, next)
+		pinned |= cache_pinned(e, getpid());
+	pthread_mutex_unlock(&cache_lock);
+
+	/* and what could not be evicted while in use goes now */
+	if (pinned)
+		cache_update(NULL, NULL, NULL);
+}
+
+int
+pkg_cache_remove(const char *cksum)
+{
+	char path[MAXPATHLEN + 1];
+	char *slash;
+
+	if (pkg_cache_path(cksum, path, sizeof(path)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (unlink(path) == -1 && errno != ENOENT) {
+		pkg_emit_errno("unlink", path);
+		return (EPKG_FATAL);
+	}
+
+	/* the directory goes with its last package */
+	if ((slash = strrchr(path, '/')) != NULL) {
+		*slash = '\0';
+		rmdir(path);
+	}
+
+	return (cache_update(cksum, NULL, NULL));
+}
+
+/* a package under its checksum or the index, found by pkg_cache_prune() */
+static bool
+cache_owned(FTSENT *ent)
+{
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	if (ent->fts_level == 1)
+		return (strcmp(ent->fts_name, CACHE_INDEX) == 0);
+
+	if (ent->fts_level != 2 || strlen(ent->fts_parent->fts_name) != 2 ||
+	    strncmp(ent->fts_name, ent->fts_parent->fts_name, 2) != 0)
+		return (false);
+
+	/* a download, running or to be resumed, is kept too */
+	strlcpy(cksum, ent->fts_name, sizeof(cksum));
+	return (cache_cksum_valid(cksum) &&
+	    (ent->fts_name[sizeof(cksum) - 1] == '\0' ||
+	    strcmp(ent->fts_name + sizeof(cksum) - 1, ".part") == 0));
+}
+
+int
+pkg_cache_prune(int64_t *count, int64_t *bytes)
+{
+	FTS *fts;
+	FTSENT *ent;
+	const char *cachedir;
+	char *paths[2];
+	int dfd;
+	int ret = EPKG_OK;
+
+	*count = 0;
+	*bytes = 0;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	/* the index is only written under the lock, its leftovers go too */
+	if ((dfd = open(cachedir, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return (EPKG_OK);
+		pkg_emit_errno("open", cachedir);
+		return (EPKG_FATAL);
+	}
+	if (flock(dfd, LOCK_EX) == -1) {
+		pkg_emit_errno("flock", cachedir);
+		close(dfd);
+		return (EPKG_FATAL);
+	}
+
+	paths[0] = __DECONST(char *, cachedir);
+	paths[1] = NULL;
+	fts = fts_open(paths, FTS_COMFOLLOW | FTS_PHYSICAL | FTS_XDEV |
+	    FTS_NOCHDIR, NULL);
+	if (fts == NULL) {
+		pkg_emit_errno("fts_open", cachedir);
+		close(dfd);
+		return (EPKG_FATAL);
+	}
+
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_D:
+		case FTS_DC:
+			continue;
+		case FTS_DP:
+			/* the directories left empty, the old layout's included */
+			if (ent->fts_level > 0)
+				rmdir(ent->fts_accpath);
+			continue;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			pkg_emit_error("%s: %s", ent->fts_path,
+			    strerror(ent->fts_errno));
+			ret = EPKG_FATAL;
+			continue;
+		}
+
+		if (ent->fts_level == 0 || cache_owned(ent))
+			continue;
+
+		if (unlink(ent->fts_accpath) == -1) {
+			pkg_emit_errno("unlink", ent->fts_path);
+			ret = EPKG_FATAL;
+			continue;
+		}
+		(*count)++;
+		*bytes += ent->fts_statp->st_size;
+	}
+
+	fts_close(fts);
+	close(dfd);
+
+	return (ret);
+}
+
+int
+pkg_cache_list(struct pkg_cache_entry **e)
+{
+	const char *cachedir;
+	int ret = EPKG_OK;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (*e == NULL) {
+		if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK ||
+		    cache_load(cachedir) != EPKG_OK) {
+			pthread_mutex_unlock(&cache_lock);
+			return (EPKG_FATAL);
+		}
+		*e = STAILQ_FIRST(&cache);
+	} else {
+		*e = STAILQ_NEXT(*e, next);
+	}
+
+	while (*e != NULL && (*e)->removed)
+		*e = STAILQ_NEXT(*e, next);
+
+	if (*e == NULL)
+		ret = EPKG_END;
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return (ret);
+}
+
+const char *
+pkg_cache_get(struct pkg_cache_entry *e, pkg_cache_t attr)
+{
+	switch (attr) {
+	case PKG_CACHE_CKSUM:
+		return (e->cksum);
+	case PKG_CACHE_NAME:
+		return (e->name);
+	}
+
+	return (NULL);
+}
@@ -15,6 +15,7 @@
 #define STRING 0
 #define BOOL 1
 #define LIST 2
+#define INTEGER 3
 
 struct pkg_config_kv {
 	char *key;
@@ -98,6 +99,60 @@ static struct config_entry c[] = {
 		"SYSLOG",
 		"YES",
 		{ NULL }
+	},
+	[PKG_CONFIG_DBPROFILE] = {
+		STRING,
+		"PKG_DBPROFILE",
+		"safe",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_WORKERS] = {
+		INTEGER,
+		"FETCH_WORKERS",
+		"4",
+		{ NULL }
+	},
+	[PKG_CONFIG_EXTRACT_WORKERS] = {
+		INTEGER,
+		"EXTRACT_WORKERS",
+		"1",
+		{ NULL }
+	},
+	[PKG_CONFIG_CACHE_SIZE] = {
+		INTEGER,
+		"CACHE_SIZE",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_REPO_WORKERS] = {
+		INTEGER,
+		"REPO_WORKERS",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_COMPRESSION_LEVEL] = {
+		INTEGER,
+		"COMPRESSION_LEVEL",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_COMPRESSION_THREADS] = {
+		INTEGER,
+		"COMPRESSION_THREADS",
+		"1",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_TIMEOUT] = {
+		INTEGER,
+		"FETCH_TIMEOUT",
+		"30",
+		{ NULL }
+	},
+	[PKG_CONFIG_SEARCH_LIMIT] = {
+		INTEGER,
+		"SEARCH_LIMIT",
+		"100",
+		{ NULL }
 	}
 };
 
@@ -220,6 +275,38 @@ pkg_config_bool(pkg_config_key key, bool *val)
 	return (EPKG_OK);
 }
 
+int
+pkg_config_int64(pkg_config_key key, int64_t *val)
+{
+	const char *str, *errstr = NULL;
+
+	*val = 0;
+
+	if (parsed != true) {
+		pkg_emit_error("pkg_init() must be called before pkg_config_int64()");
+		return (EPKG_FATAL);
+	}
+
+	if (c[key].type != INTEGER) {
+		pkg_emit_error("this config entry is not an integer");
+		return (EPKG_FATAL);
+	}
+
+	if ((str = c[key].val) == NULL)
+		str = c[key].def;
+
+	if (str == NULL)
+		return (EPKG_FATAL);
+
+	*val = strtonum(str, 0, INT64_MAX, &errstr);
+	if (errstr != NULL) {
+		pkg_emit_error("%s: '%s' is %s", c[key].key, str, errstr);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 int
 pkg_config_list(pkg_config_key key, struct pkg_config_kv **kv)
 {
@@ -329,6 +416,7 @@ pkg_shutdown(void)
 			switch (c[i].type) {
 			case STRING:
 			case BOOL:
+			case INTEGER:
 				free(c[i].val);
 				break;
 			case LIST:
@@ -95,7 +95,7 @@ pkg_create_archive(const char *outdir, struct pkg *pkg, pkg_formats format, int
 		return (NULL);
 	}
 
-	if (packing_init(&pkg_archive, pkg_path, format) != EPKG_OK)
+	if (packing_init(&pkg_archive, pkg_path, format, -1, -1) != EPKG_OK)
 		pkg_archive = NULL;
 
 	if (pkg_path != NULL)
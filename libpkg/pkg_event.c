@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <syslog.h>
 
 #include "pkg.h"
@@ -5,6 +6,8 @@
 
 static pkg_event_cb _cb = NULL;
 static void *_data = NULL;
+/* events may be emitted from the fetch workers */
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
 
 void
 pkg_event_register(pkg_event_cb cb, void *data)
@@ -16,8 +19,12 @@ pkg_event_register(pkg_event_cb cb, void *data)
 static void
 pkg_emit_event(struct pkg_event *ev)
 {
-	if (_cb != NULL)
-		_cb(_data, ev);
+	if (_cb == NULL)
+		return;
+
+	pthread_mutex_lock(&_lock);
+	_cb(_data, ev);
+	pthread_mutex_unlock(&_lock);
 }
 
 void
@@ -121,6 +128,36 @@ pkg_emit_integritycheck_finished(void)
 	pkg_emit_event(&ev);
 }
 
+void
+pkg_emit_stage_times(double fetch, double verify, double extract,
+    double overlap, double total, int64_t opened, int64_t reused)
+{
+	struct pkg_event ev;
+	ev.type = PKG_EVENT_STAGE_TIMES;
+
+	ev.e_stage_times.fetch = fetch;
+	ev.e_stage_times.verify = verify;
+	ev.e_stage_times.extract = extract;
+	ev.e_stage_times.overlap = overlap;
+	ev.e_stage_times.total = total;
+	ev.e_stage_times.opened = opened;
+	ev.e_stage_times.reused = reused;
+
+	pkg_emit_event(&ev);
+}
+
+void
+pkg_emit_cache_evicted(int64_t count, int64_t bytes)
+{
+	struct pkg_event ev;
+	ev.type = PKG_EVENT_CACHE_EVICTED;
+
+	ev.e_cache_evicted.count = count;
+	ev.e_cache_evicted.bytes = bytes;
+
+	pkg_emit_event(&ev);
+}
+
 void
 pkg_emit_deinstall_begin(struct pkg *p)
 {
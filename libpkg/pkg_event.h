@@ -15,5 +15,8 @@ void pkg_emit_missing_dep(struct pkg *p, struct pkg_dep *d);
 void pkg_emit_required(struct pkg *p, int force);
 void pkg_emit_integritycheck_begin(void);
 void pkg_emit_integritycheck_finished(void);
+void pkg_emit_stage_times(double fetch, double verify, double extract,
+    double overlap, double total, int64_t opened, int64_t reused);
+void pkg_emit_cache_evicted(int64_t count, int64_t bytes);
 
 #endif
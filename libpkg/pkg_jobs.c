@@ -4,9 +4,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <libutil.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "pkg.h"
 #include "pkgdb.h"
@@ -25,12 +28,35 @@ pkg_jobs_new(struct pkg_jobs **j, pkg_jobs_t t, struct pkgdb *db)
 	}
 
 	STAILQ_INIT(&(*j)->jobs);
+	LIST_INIT(&(*j)->nodes);
 	(*j)->db = db;
 	(*j)->type = t;
 
+	if (((*j)->fetch = fetch_session_new()) == NULL) {
+		free(*j);
+		*j = NULL;
+		return (EPKG_FATAL);
+	}
+
 	return (EPKG_OK);
 }
 
+static void
+pkg_jobs_nodes_free(struct pkg_jobs *j)
+{
+	struct pkg_jobs_node *n;
+
+	while (!LIST_EMPTY(&j->nodes)) {
+		n = LIST_FIRST(&j->nodes);
+		LIST_REMOVE(n, entries);
+		free(n->parents);
+		free(n);
+	}
+
+	j->resolved = false;
+	j->nlevels = 0;
+}
+
 void
 pkg_jobs_free(struct pkg_jobs *j)
 {
@@ -39,12 +65,18 @@ pkg_jobs_free(struct pkg_jobs *j)
 	if (j == NULL)
 		return;
 
+	pkg_jobs_nodes_free(j);
+
 	while (!STAILQ_EMPTY(&j->jobs)) {
 		p = STAILQ_FIRST(&j->jobs);
 		STAILQ_REMOVE_HEAD(&j->jobs, next);
 		pkg_free(p);
 	}
+	fetch_session_free(j->fetch);
 	free(j);
+
+	/* the packages of the jobs may be evicted now */
+	pkg_cache_release();
 }
 
 int
@@ -54,6 +86,7 @@ pkg_jobs_add(struct pkg_jobs *j, struct pkg *pkg)
 	assert(pkg != NULL);
 
 	STAILQ_INSERT_TAIL(&j->jobs, pkg, next);
+	j->resolved = false;
 
 	return (EPKG_OK);
 }
@@ -82,6 +115,248 @@ pkg_jobs(struct pkg_jobs *j, struct pkg **pkg)
 		return (EPKG_OK);
 }
 
+static int
+pkg_jobs_node_cmp(const void *a, const void *b)
+{
+	struct pkg_jobs_node * const *n1 = a;
+	struct pkg_jobs_node * const *n2 = b;
+	const char *o1, *o2;
+
+	pkg_get((*n1)->pkg, PKG_ORIGIN, &o1);
+	pkg_get((*n2)->pkg, PKG_ORIGIN, &o2);
+
+	return (strcmp(o1, o2));
+}
+
+static int
+pkg_jobs_node_origin_cmp(const void *key, const void *node)
+{
+	struct pkg_jobs_node * const *n = node;
+	const char *origin;
+
+	pkg_get((*n)->pkg, PKG_ORIGIN, &origin);
+
+	return (strcmp(key, origin));
+}
+
+static int
+pkg_jobs_node_add_parent(struct pkg_jobs_node *n, struct pkg_jobs_node *parent)
+{
+	struct pkg_jobs_node **parents;
+	size_t cap;
+
+	if (n->parents_len == n->parents_cap) {
+		cap = (n->parents_cap == 0) ? 4 : n->parents_cap * 2;
+		parents = realloc(n->parents, cap * sizeof(struct pkg_jobs_node *));
+		if (parents == NULL) {
+			pkg_emit_errno("realloc", "pkg_jobs_node");
+			return (EPKG_FATAL);
+		}
+		n->parents = parents;
+		n->parents_cap = cap;
+	}
+
+	n->parents[n->parents_len++] = parent;
+	parent->nrefs++;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Link every job to the jobs it depends on: the repository dependencies
+ * for installs, the local ones for deletions.
+ */
+static int
+pkg_jobs_link(struct pkg_jobs *j, struct pkg_jobs_node **index, size_t nnodes)
+{
+	struct pkg_jobs_node **dep;
+	struct sbuf *sql = sbuf_new_auto();
+	sqlite3_stmt *stmt;
+	const char *origin, *reponame;
+	size_t i;
+	int ret = EPKG_OK;
+
+	const char deps_sql[] = ""
+		"SELECT d.origin FROM '%s'.deps AS d, '%s'.packages AS p "
+		"WHERE p.origin = ?1 AND d.package_id = p.id;";
+
+	for (i = 0; i < nnodes && ret == EPKG_OK; i++) {
+		pkg_get(index[i]->pkg, PKG_ORIGIN, &origin, PKG_REPONAME, &reponame);
+
+		if (j->type == PKG_JOBS_DEINSTALL)
+			reponame = "main";
+		else if (reponame == NULL)
+			reponame = "remote";
+		else if (pkgdb_repo_attach(j->db, reponame) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			break;
+		}
+
+		sbuf_reset(sql);
+		sbuf_printf(sql, deps_sql, reponame, reponame);
+		sbuf_finish(sql);
+
+		if ((stmt = pkgdb_stmt_get(j->db, sbuf_get(sql))) == NULL) {
+			ret = EPKG_FATAL;
+			break;
+		}
+
+		sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			dep = bsearch(sqlite3_column_text(stmt, 0), index, nnodes,
+			    sizeof(struct pkg_jobs_node *), pkg_jobs_node_origin_cmp);
+			if (dep == NULL || *dep == index[i])
+				continue;
+			if ((ret = pkg_jobs_node_add_parent(*dep, index[i])) != EPKG_OK)
+				break;
+		}
+		sqlite3_reset(stmt);
+	}
+
+	sbuf_delete(sql);
+
+	return (ret);
+}
+
+/*
+ * Order the jobs queue by dependencies with Kahn's algorithm.  Jobs
+ * without pending dependencies form a level; ordering a level releases
+ * the jobs of the next one.  Jobs left over depend on a cycle: they are
+ * reported and queued last, in their original order.
+ */
+int
+pkg_jobs_resolv(struct pkg_jobs *j)
+{
+	struct pkg_jobs_node **nodes = NULL, **index = NULL, **order = NULL;
+	struct pkg_jobs_node *n;
+	struct pkg *p = NULL;
+	struct sbuf *cycle = NULL;
+	const char *name, *version;
+	size_t nnodes = 0, head, tail, end, i, k;
+	int level, ret = EPKG_FATAL;
+
+	assert(j != NULL);
+
+	if (j->resolved)
+		return (EPKG_OK);
+
+	pkg_jobs_nodes_free(j);
+
+	while (pkg_jobs(j, &p) == EPKG_OK)
+		nnodes++;
+
+	if (nnodes == 0) {
+		j->resolved = true;
+		return (EPKG_OK);
+	}
+
+	if ((nodes = calloc(nnodes, sizeof(struct pkg_jobs_node *))) == NULL ||
+	    (index = calloc(nnodes, sizeof(struct pkg_jobs_node *))) == NULL ||
+	    (order = calloc(nnodes, sizeof(struct pkg_jobs_node *))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_resolv");
+		goto cleanup;
+	}
+
+	i = 0;
+	while (pkg_jobs(j, &p) == EPKG_OK) {
+		if ((n = calloc(1, sizeof(struct pkg_jobs_node))) == NULL) {
+			pkg_emit_errno("calloc", "pkg_jobs_node");
+			goto cleanup;
+		}
+		n->pkg = p;
+		LIST_INSERT_HEAD(&j->nodes, n, entries);
+		nodes[i] = index[i] = n;
+		i++;
+	}
+
+	qsort(index, nnodes, sizeof(struct pkg_jobs_node *), pkg_jobs_node_cmp);
+
+	if (pkg_jobs_link(j, index, nnodes) != EPKG_OK)
+		goto cleanup;
+
+	tail = 0;
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i]->nrefs == 0)
+			order[tail++] = nodes[i];
+	}
+
+	level = 0;
+	for (head = 0; head < tail; level++) {
+		for (end = tail; head < end; head++) {
+			n = order[head];
+			n->level = level;
+			for (k = 0; k < n->parents_len; k++) {
+				if (--n->parents[k]->nrefs == 0)
+					order[tail++] = n->parents[k];
+			}
+		}
+	}
+
+	if (tail < nnodes) {
+		cycle = sbuf_new_auto();
+		for (i = 0; i < nnodes; i++) {
+			if (nodes[i]->nrefs == 0)
+				continue;
+			nodes[i]->level = level;
+			order[tail++] = nodes[i];
+			pkg_get(nodes[i]->pkg, PKG_NAME, &name, PKG_VERSION, &version);
+			sbuf_printf(cycle, " %s-%s", name, version);
+		}
+		sbuf_finish(cycle);
+		pkg_emit_error("dependency cycle, ordering arbitrarily:%s",
+		    sbuf_get(cycle));
+		sbuf_delete(cycle);
+		level++;
+	}
+
+	j->nlevels = level;
+
+	/* requeue the jobs, deletions go from the top of the graph down */
+	STAILQ_INIT(&j->jobs);
+	for (i = 0; i < nnodes; i++) {
+		if (j->type == PKG_JOBS_DEINSTALL) {
+			n = order[nnodes - 1 - i];
+			n->level = j->nlevels - 1 - n->level;
+		} else {
+			n = order[i];
+		}
+		STAILQ_INSERT_TAIL(&j->jobs, n->pkg, next);
+	}
+
+	j->resolved = true;
+	ret = EPKG_OK;
+
+	cleanup:
+	free(nodes);
+	free(index);
+	free(order);
+
+	return (ret);
+}
+
+int
+pkg_jobs_level(struct pkg_jobs *j, struct pkg *pkg, int *level, int *nlevels)
+{
+	struct pkg_jobs_node *n;
+
+	assert(j != NULL && pkg != NULL);
+
+	if (pkg_jobs_resolv(j) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	LIST_FOREACH(n, &j->nodes, entries) {
+		if (n->pkg == pkg) {
+			if (level != NULL)
+				*level = n->level;
+			if (nlevels != NULL)
+				*nlevels = j->nlevels;
+			return (EPKG_OK);
+		}
+	}
+
+	return (EPKG_END);
+}
+
 static int
 pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg *p2)
 {
@@ -116,27 +391,544 @@ pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg *p2)
 	return (EPKG_OK);
 }
 
+/*
+ * Concurrent fetching: workers take the next package of the queue and
+ * download it to the cache, the caller waits for the packages in order
+ * and reports the aggregated progress of all the downloads.
+ */
+#define FETCH_PENDING (-1)
+
+static double
+pkg_jobs_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+struct fetch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	struct fetch_session *session;
+	struct pkg **pkgs;
+	int *status;		/* FETCH_PENDING until the worker is done */
+	int npkgs;
+	int next;		/* next package to hand to a worker */
+	int64_t total;
+	int64_t done;		/* includes the packages found in the cache */
+	int64_t downloaded;
+	time_t begin;
+	time_t last;
+	double started;
+	double finished;	/* when the last download completed */
+	bool progress;
+	bool abort;
+	char label[32];
+};
+
+struct fetch_job {
+	struct fetch_pool *pool;
+	off_t done;
+};
+
+static void
+fetch_pool_progress(void *data, off_t done, __unused off_t total)
+{
+	struct fetch_job *fj = data;
+	struct fetch_pool *fp = fj->pool;
+
+	/* a mismatching cached package is being fetched again */
+	if (done < fj->done)
+		fj->done = 0;
+
+	pthread_mutex_lock(&fp->lock);
+	fp->done += done - fj->done;
+	fp->downloaded += done - fj->done;
+	pthread_mutex_unlock(&fp->lock);
+
+	fj->done = done;
+}
+
+static void *
+fetch_pool_worker(void *arg)
+{
+	struct fetch_pool *fp = arg;
+	struct fetch_job fj;
+	int64_t size;
+	int i, ret;
+
+	fj.pool = fp;
+
+	pthread_mutex_lock(&fp->lock);
+	while (!fp->abort && fp->next < fp->npkgs) {
+		i = fp->next++;
+		pthread_mutex_unlock(&fp->lock);
+
+		fj.done = 0;
+		ret = pkg_repo_fetch_cb(fp->pkgs[i], fp->session,
+		    fetch_pool_progress, &fj);
+		pkg_get(fp->pkgs[i], PKG_NEW_PKGSIZE, &size);
+
+		pthread_mutex_lock(&fp->lock);
+		fp->done += size - fj.done;
+		fp->finished = pkg_jobs_time();
+		fp->status[i] = ret;
+		if (ret != EPKG_OK)
+			fp->abort = true;
+		pthread_cond_broadcast(&fp->cond);
+	}
+	pthread_mutex_unlock(&fp->lock);
+
+	return (NULL);
+}
+
+static int
+fetch_pool_start(struct fetch_pool *fp, struct pkg_jobs *j, int64_t workers,
+    bool progress)
+{
+	struct pkg *p = NULL;
+	int64_t size;
+	int i, ret;
+
+	memset(fp, 0, sizeof(struct fetch_pool));
+
+	while (pkg_jobs(j, &p) == EPKG_OK)
+		fp->npkgs++;
+
+	if (workers > fp->npkgs)
+		workers = fp->npkgs;
+
+	fp->pkgs = calloc(fp->npkgs, sizeof(struct pkg *));
+	fp->status = calloc(fp->npkgs, sizeof(int));
+	fp->threads = calloc(workers, sizeof(pthread_t));
+	if (fp->pkgs == NULL || fp->status == NULL || fp->threads == NULL) {
+		pkg_emit_errno("calloc", "fetch_pool");
+		free(fp->pkgs);
+		free(fp->status);
+		free(fp->threads);
+		return (EPKG_FATAL);
+	}
+
+	i = 0;
+	while (pkg_jobs(j, &p) == EPKG_OK) {
+		pkg_get(p, PKG_NEW_PKGSIZE, &size);
+		fp->total += size;
+		fp->status[i] = FETCH_PENDING;
+		fp->pkgs[i++] = p;
+	}
+
+	snprintf(fp->label, sizeof(fp->label), "%d packages", fp->npkgs);
+	fp->session = j->fetch;
+	fp->progress = progress;
+	fp->begin = time(NULL);
+	fp->started = fp->finished = pkg_jobs_time();
+	pthread_mutex_init(&fp->lock, NULL);
+	pthread_cond_init(&fp->cond, NULL);
+
+	for (i = 0; i < workers; i++) {
+		ret = pthread_create(&fp->threads[i], NULL, fetch_pool_worker, fp);
+		if (ret != 0) {
+			pkg_emit_error("pthread_create: %s", strerror(ret));
+			break;
+		}
+		fp->nthreads++;
+	}
+
+	if (fp->nthreads == 0) {
+		pthread_mutex_destroy(&fp->lock);
+		pthread_cond_destroy(&fp->cond);
+		free(fp->pkgs);
+		free(fp->status);
+		free(fp->threads);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Wait for the i-th package, reporting the progress every second
+ */
+static int
+fetch_pool_wait(struct fetch_pool *fp, int i)
+{
+	struct timespec ts;
+	int64_t done, downloaded;
+	time_t now;
+	int ret;
+
+	pthread_mutex_lock(&fp->lock);
+	for (;;) {
+		if ((ret = fp->status[i]) != FETCH_PENDING)
+			break;
+		if (fp->abort && i >= fp->next) {
+			ret = EPKG_FATAL;
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&fp->cond, &fp->lock, &ts);
+
+		now = time(NULL);
+		if (now == fp->last)
+			continue;
+		fp->last = now;
+		done = fp->done;
+		downloaded = fp->downloaded;
+
+		pthread_mutex_unlock(&fp->lock);
+		/* done == total would end the progress meter */
+		if (fp->progress && downloaded > 0 && done < fp->total)
+			pkg_emit_fetching(fp->label, fp->total, done,
+			    now - fp->begin);
+		pthread_mutex_lock(&fp->lock);
+	}
+	pthread_mutex_unlock(&fp->lock);
+
+	return (ret);
+}
+
+/* whether the i-th package is downloaded or failed to be, without waiting */
+static bool
+fetch_pool_ready(struct fetch_pool *fp, int i)
+{
+	bool ret;
+
+	pthread_mutex_lock(&fp->lock);
+	ret = (fp->status[i] != FETCH_PENDING);
+	pthread_mutex_unlock(&fp->lock);
+
+	return (ret);
+}
+
+static void
+fetch_pool_stop(struct fetch_pool *fp, int ret)
+{
+	int i;
+
+	pthread_mutex_lock(&fp->lock);
+	fp->abort = true;
+	pthread_mutex_unlock(&fp->lock);
+
+	for (i = 0; i < fp->nthreads; i++)
+		pthread_join(fp->threads[i], NULL);
+
+	if (ret == EPKG_OK && fp->progress && fp->downloaded > 0)
+		pkg_emit_fetching(fp->label, fp->total, fp->total,
+		    time(NULL) - fp->begin);
+
+	pthread_mutex_destroy(&fp->lock);
+	pthread_cond_destroy(&fp->cond);
+	free(fp->pkgs);
+	free(fp->status);
+	free(fp->threads);
+}
+
+int
+pkg_jobs_fetch(struct pkg_jobs *j)
+{
+	struct fetch_pool fp;
+	struct pkg *p = NULL;
+	int64_t workers;
+	int i, ret = EPKG_OK;
+
+	if (pkg_config_int64(PKG_CONFIG_FETCH_WORKERS, &workers) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (workers <= 1) {
+		while (pkg_jobs(j, &p) == EPKG_OK) {
+			if (pkg_repo_fetch_cb(p, j->fetch, NULL, NULL) != EPKG_OK)
+				return (EPKG_FATAL);
+		}
+		return (EPKG_OK);
+	}
+
+	if (pkg_jobs_is_empty(j))
+		return (EPKG_OK);
+
+	if (fetch_pool_start(&fp, j, workers, true) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < fp.npkgs; i++) {
+		if ((ret = fetch_pool_wait(&fp, i)) != EPKG_OK)
+			break;
+	}
+
+	fetch_pool_stop(&fp, ret);
+
+	return (ret);
+}
+
+/*
+ * Extraction of the packages of one dependency level: the calling thread
+ * takes its share of the packages.
+ */
+struct extract_pool {
+	pthread_mutex_t lock;
+	struct pkg_add_state *st;
+	int n;
+	int next;
+};
+
+static void *
+extract_pool_worker(void *arg)
+{
+	struct extract_pool *ep = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&ep->lock);
+		i = ep->next++;
+		pthread_mutex_unlock(&ep->lock);
+
+		if (i >= ep->n)
+			break;
+		pkg_add_extract(&ep->st[i]);
+	}
+
+	return (NULL);
+}
+
+static int
+pkg_jobs_extract(struct pkg_add_state *st, int n, int64_t workers)
+{
+	struct extract_pool ep;
+	pthread_t *threads = NULL;
+	int i, nthreads = 0;
+
+	if (workers > n)
+		workers = n;
+
+	ep.st = st;
+	ep.n = n;
+	ep.next = 0;
+	pthread_mutex_init(&ep.lock, NULL);
+
+	if (workers > 1 && (threads = calloc(workers - 1, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < workers - 1; i++) {
+			if (pthread_create(&threads[i], NULL, extract_pool_worker, &ep) != 0)
+				break;
+			nthreads++;
+		}
+	}
+
+	extract_pool_worker(&ep);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ep.lock);
+	free(threads);
+
+	for (i = 0; i < n; i++) {
+		if (st[i].retcode != EPKG_OK)
+			return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * The packages of an install go through the stages in order: downloaded by
+ * the fetch pool, verified, extracted and committed, that is registered for
+ * good once their post-install scripts have run.
+ */
+struct install_state {
+	struct pkg_jobs *j;
+	struct fetch_pool fp;
+	struct pkg **newpkgs;		/* the manifests read by the verification */
+	struct pkg_add_state *states;
+	struct sbuf *buf;
+	int nverified;
+	int nextracted;
+	int ncommitted;
+	bool checked;			/* the whole set is verified */
+	double verify;
+};
+
+/*
+ * Verify the next package once it is downloaded: its files against those of
+ * the packages verified before it and of the installed packages the set does
+ * not replace. The manifest read here is the one installed.
+ */
+static int
+install_verify(struct install_state *is)
+{
+	const char *pkgsum;
+	char path[MAXPATHLEN + 1];
+	double t;
+	int i = is->nverified;
+	int ret;
+
+	if ((ret = fetch_pool_wait(&is->fp, i)) != EPKG_OK)
+		return (ret);
+
+	t = pkg_jobs_time();
+	is->nverified++;
+	pkg_get(is->fp.pkgs[i], PKG_CKSUM, &pkgsum);
+	if (pkg_cache_path(pkgsum, path, sizeof(path)) != EPKG_OK ||
+	    pkg_open(&is->newpkgs[i], path, is->buf) != EPKG_OK) {
+		ret = EPKG_FATAL;
+	} else {
+		if (pkgdb_integrity_append(is->j->db, is->newpkgs[i]) != EPKG_OK)
+			ret = EPKG_FATAL;
+		if (pkgdb_integrity_check_pkg(is->j->db, is->newpkgs[i]) != EPKG_OK)
+			ret = EPKG_FATAL;
+	}
+	is->verify += pkg_jobs_time() - t;
+
+	return (ret);
+}
+
+/*
+ * Verify the packages left, reporting all their conflicts, then check the
+ * whole set.
+ */
+static int
+install_check_set(struct install_state *is)
+{
+	double t;
+	int ret = EPKG_OK;
+
+	while (is->nverified < is->fp.npkgs) {
+		if (fetch_pool_wait(&is->fp, is->nverified) != EPKG_OK)
+			return (EPKG_FATAL);
+		if (install_verify(is) != EPKG_OK)
+			ret = EPKG_FATAL;
+	}
+
+	if (ret == EPKG_OK) {
+		t = pkg_jobs_time();
+		ret = pkgdb_integrity_check(is->j->db);
+		is->verify += pkg_jobs_time() - t;
+	}
+
+	if (ret == EPKG_OK) {
+		is->checked = true;
+		pkg_emit_integritycheck_finished();
+	}
+
+	return (ret);
+}
+
+/*
+ * Whether the i-th package may be extracted before the whole set is checked.
+ * A conflict found later rolls it back by removing its files, so it must not
+ * replace an installed package nor run a script before its files are
+ * extracted.
+ */
+static bool
+install_stageable(struct install_state *is, int i)
+{
+	struct pkg_script *script = NULL;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	const char *origin, *newversion;
+	pkg_script_t type;
+	bool ret;
+
+	pkg_get(is->fp.pkgs[i], PKG_ORIGIN, &origin, PKG_NEWVERSION,
+	    &newversion);
+	if (newversion != NULL)
+		return (false);
+
+	while (pkg_scripts(is->newpkgs[i], &script) == EPKG_OK) {
+		type = pkg_script_type(script);
+		if (type == PKG_SCRIPT_PRE_INSTALL || type == PKG_SCRIPT_INSTALL)
+			return (false);
+	}
+
+	if ((it = pkgdb_integrity_conflict_local(is->j->db, origin)) == NULL)
+		return (false);
+	ret = (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_END);
+	pkgdb_it_free(it);
+	pkg_free(pkg);
+
+	return (ret);
+}
+
+/*
+ * Run the post-install scripts of the packages extracted up to the given
+ * one, in order, or remove their files if the installation failed.
+ */
+static int
+install_commit(struct install_state *is, int to, bool announced, int ret)
+{
+	struct pkg *p;
+	const char *newversion;
+	int i;
+
+	for (i = is->ncommitted; i < to; i++) {
+		p = is->fp.pkgs[i];
+		pkg_get(p, PKG_NEWVERSION, &newversion);
+
+		if (!announced && ret == EPKG_OK) {
+			if (newversion != NULL)
+				pkg_emit_upgrade_begin(p);
+			else
+				pkg_emit_install_begin(is->states[i].pkg);
+		}
+
+		/* the files are not kept past a failure */
+		if (ret != EPKG_OK)
+			is->states[i].retcode = EPKG_FATAL;
+		if (pkg_add_finish(is->j->db, &is->states[i]) != EPKG_OK)
+			ret = EPKG_FATAL;
+		else if (newversion != NULL)
+			pkg_emit_upgrade_finished(p);
+		else
+			pkg_emit_install_finished(is->states[i].pkg);
+		pkg_add_state_free(&is->states[i]);
+	}
+	is->ncommitted = to;
+
+	return (ret);
+}
+
+/*
+ * Packages are verified as soon as they are downloaded, while the workers
+ * are still fetching the next ones. Until the whole set is verified, only
+ * the packages which can be rolled back are extracted: their post-install
+ * scripts wait for the check, and a conflict found meanwhile removes their
+ * files. The first package which cannot be rolled back waits for the last
+ * download. With EXTRACT_WORKERS, the packages of a dependency level are
+ * installed together: the scripts and the registrations run one package
+ * after the other and only the extractions run at once.
+ */
 static int
 pkg_jobs_install(struct pkg_jobs *j)
 {
+	struct install_state is;
 	struct pkg *p = NULL;
 	struct pkg *pkg = NULL;
 	struct pkg *newpkg = NULL;
 	struct pkg *pkg_temp = NULL;
 	struct pkgdb_it *it = NULL;
-	struct sbuf *buf = sbuf_new_auto();
 	STAILQ_HEAD(,pkg) pkg_queue;
 	const char *cachedir;
 	char path[MAXPATHLEN + 1];
 	int ret = EPKG_OK;
 	int flags = 0;
+	int i, k, m, n, level, batch;
 	int64_t dlsize = 0;
+	int64_t workers, xworkers;
+	int64_t opened = 0, reused = 0;
+	double begin, t, extract = 0, xbegin = 0;
+	bool staged;
 	struct statfs fs;
 	char dlsz[7];
 	char fsz[7];
 
 	STAILQ_INIT(&pkg_queue);
 
+	if (pkg_jobs_is_empty(j))
+		return (EPKG_OK);
+
 	/* check for available size to fetch */
 	while (pkg_jobs(j, &p) == EPKG_OK) {
 		int64_t pkgsize;
@@ -163,54 +955,128 @@ pkg_jobs_install(struct pkg_jobs *j)
 		pkg_emit_error("Not enough space in %s, needed %s available %s", cachedir, dlsz, fsz);
 		return (EPKG_FATAL);
 	}
-		
-	/* Fetch */
-	p = NULL;
-	while (pkg_jobs(j, &p) == EPKG_OK) {
-		if (pkg_repo_fetch(p) != EPKG_OK)
-			return (EPKG_FATAL);
-	}
 
-	p = NULL;
-	/* integrity checking */
-	pkg_emit_integritycheck_begin();
+	if (pkg_config_int64(PKG_CONFIG_FETCH_WORKERS, &workers) != EPKG_OK ||
+	    pkg_config_int64(PKG_CONFIG_EXTRACT_WORKERS, &xworkers) != EPKG_OK)
+		return (EPKG_FATAL);
 
+	/* keep a few packages ahead so that no extraction thread is idle */
+	batch = xworkers > 1 ? xworkers * 2 : 1;
+
+	/* the installed packages replaced by the jobs are not conflicts */
+	p = NULL;
 	while (pkg_jobs(j, &p) == EPKG_OK) {
-		const char *pkgrepopath;
+		const char *pkgorigin;
 
-		pkg_get(p, PKG_REPOPATH, &pkgrepopath, -1);
-		snprintf(path, sizeof(path), "%s/%s", cachedir,
-		    pkgrepopath);
-		if (pkg_open(&pkg, path, buf) != EPKG_OK)
+		pkg_get(p, PKG_ORIGIN, &pkgorigin);
+		if (pkgdb_integrity_replace(j->db, pkgorigin) != EPKG_OK)
 			return (EPKG_FATAL);
-
-		if (pkgdb_integrity_append(j->db, pkg) != EPKG_OK)
-			ret = EPKG_FATAL;
 	}
 
-	pkg_free(pkg);
-	sbuf_delete(buf);
+	/*
+	 * The integrity check messages are the progress: the aggregated
+	 * fetching progress would be drawn over them.
+	 */
+	memset(&is, 0, sizeof(struct install_state));
+	is.j = j;
+	begin = pkg_jobs_time();
+	if (fetch_pool_start(&is.fp, j, workers > 1 ? workers : 1, false) != EPKG_OK)
+		return (EPKG_FATAL);
 
-	if (pkgdb_integrity_check(j->db) != EPKG_OK || ret != EPKG_OK)
+	is.newpkgs = calloc(is.fp.npkgs, sizeof(struct pkg *));
+	is.states = calloc(is.fp.npkgs, sizeof(struct pkg_add_state));
+	if (is.newpkgs == NULL || is.states == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_install");
+		fetch_pool_stop(&is.fp, EPKG_FATAL);
+		free(is.newpkgs);
+		free(is.states);
 		return (EPKG_FATAL);
+	}
 
-	pkg_emit_integritycheck_finished();
-	p = NULL;
-	/* Install */
+	is.buf = sbuf_new_auto();
+	pkg_emit_integritycheck_begin();
 	sql_exec(j->db->sqlite, "SAVEPOINT upgrade;");
-	while (pkg_jobs(j, &p) == EPKG_OK) {
-		const char *pkgorigin, *pkgrepopath, *newversion, *origin;
-		bool automatic;
-		flags = 0;
+	for (i = 0; i < is.fp.npkgs && ret == EPKG_OK; i = k) {
+		/* Verify */
+		if (i == is.nverified && (ret = install_verify(&is)) != EPKG_OK) {
+			/* the other conflicts are still reported */
+			install_check_set(&is);
+			break;
+		}
+
+		if (!is.checked && !install_stageable(&is, i)) {
+			if ((ret = install_check_set(&is)) != EPKG_OK)
+				break;
+			t = pkg_jobs_time();
+			ret = install_commit(&is, is.nextracted, false, ret);
+			extract += pkg_jobs_time() - t;
+			if (ret != EPKG_OK)
+				break;
+		}
+		staged = !is.checked;
+
+		/*
+		 * The next packages of the same dependency level, only those
+		 * already downloaded until the whole set is checked
+		 */
+		if (pkg_jobs_level(j, is.fp.pkgs[i], &level, NULL) != EPKG_OK)
+			level = -1;
+		for (k = i + 1; k < is.fp.npkgs && k - i < batch && level >= 0; k++) {
+			if (pkg_jobs_level(j, is.fp.pkgs[k], &m, NULL) != EPKG_OK ||
+			    m != level)
+				break;
+			if (!staged)
+				continue;
+			if (k == is.nverified) {
+				if (!fetch_pool_ready(&is.fp, k))
+					break;
+				if ((ret = install_verify(&is)) != EPKG_OK)
+					break;
+			}
+			if (!install_stageable(&is, k))
+				break;
+		}
+		if (ret != EPKG_OK) {
+			install_check_set(&is);
+			break;
+		}
 
-		pkg_get(p, PKG_ORIGIN, &pkgorigin, PKG_REPOPATH, &pkgrepopath,
-		    PKG_NEWVERSION, &newversion, PKG_AUTOMATIC, &automatic);
+		for (n = 0; n < k - i; n++) {
+			const char *pkgorigin, *pkgsum, *newversion, *origin;
+			bool automatic;
+			flags = 0;
+
+			p = is.fp.pkgs[i + n];
+			newpkg = is.newpkgs[i + n];
+			pkg_get(p, PKG_ORIGIN, &pkgorigin, PKG_CKSUM, &pkgsum,
+			    PKG_NEWVERSION, &newversion, PKG_AUTOMATIC, &automatic);
+			if (pkg_cache_path(pkgsum, path, sizeof(path)) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				break;
+			}
+
+			/* Extract */
+			t = pkg_jobs_time();
+			if (newversion != NULL) {
+				pkg = NULL;
+				it = pkgdb_query(j->db, pkgorigin, MATCH_EXACT);
+				if (it != NULL) {
+					if (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC|PKG_LOAD_FILES|PKG_LOAD_SCRIPTS|PKG_LOAD_DIRS) == EPKG_OK) {
+						STAILQ_INSERT_TAIL(&pkg_queue, pkg, next);
+						pkg_script_run(pkg, PKG_SCRIPT_PRE_DEINSTALL);
+						pkg_get(pkg, PKG_ORIGIN, &origin);
+						pkgdb_unregister_pkg(j->db, origin);
+						pkg = NULL;
+					}
+					pkgdb_it_free(it);
+				}
+			}
+
+			it = pkgdb_integrity_conflict_local(j->db, pkgorigin);
 
-		if (newversion != NULL) {
-			pkg = NULL;
-			it = pkgdb_query(j->db, pkgorigin, MATCH_EXACT);
 			if (it != NULL) {
-				if (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC|PKG_LOAD_FILES|PKG_LOAD_SCRIPTS|PKG_LOAD_DIRS) == EPKG_OK) {
+				pkg = NULL;
+				while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC|PKG_LOAD_FILES|PKG_LOAD_SCRIPTS|PKG_LOAD_DIRS) == EPKG_OK) {
 					STAILQ_INSERT_TAIL(&pkg_queue, pkg, next);
 					pkg_script_run(pkg, PKG_SCRIPT_PRE_DEINSTALL);
 					pkg_get(pkg, PKG_ORIGIN, &origin);
@@ -219,68 +1085,92 @@ pkg_jobs_install(struct pkg_jobs *j)
 				}
 				pkgdb_it_free(it);
 			}
-		}
 
-		it = pkgdb_integrity_conflict_local(j->db, pkgorigin);
+			/* several or staged packages report when they are done */
+			if (k - i == 1 && !staged) {
+				if (newversion != NULL)
+					pkg_emit_upgrade_begin(p);
+				else
+					pkg_emit_install_begin(newpkg);
+			}
+			STAILQ_FOREACH(pkg, &pkg_queue, next)
+				pkg_jobs_keep_files_to_del(pkg, newpkg);
 
-		if (it != NULL) {
-			pkg = NULL;
-			while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC|PKG_LOAD_FILES|PKG_LOAD_SCRIPTS|PKG_LOAD_DIRS) == EPKG_OK) {
-				STAILQ_INSERT_TAIL(&pkg_queue, pkg, next);
-				pkg_script_run(pkg, PKG_SCRIPT_PRE_DEINSTALL);
+			STAILQ_FOREACH_SAFE(pkg, &pkg_queue, next, pkg_temp) {
 				pkg_get(pkg, PKG_ORIGIN, &origin);
-				pkgdb_unregister_pkg(j->db, origin);
-				pkg = NULL;
+				if (strcmp(pkgorigin, origin) == 0) {
+					STAILQ_REMOVE(&pkg_queue, pkg, pkg, next);
+					pkg_delete_files(pkg, 1);
+					pkg_script_run(pkg, PKG_SCRIPT_POST_DEINSTALL);
+					pkg_delete_dirs(j->db, pkg, 0);
+					pkg_free(pkg);
+					break;
+				}
 			}
-			pkgdb_it_free(it);
-		}
-		snprintf(path, sizeof(path), "%s/%s", cachedir, pkgrepopath);
 
-		pkg_open(&newpkg, path, NULL);
-		if (newversion != NULL) {
-			pkg_emit_upgrade_begin(p);
-		} else {
-			pkg_emit_install_begin(newpkg);
-		}
-		STAILQ_FOREACH(pkg, &pkg_queue, next)
-			pkg_jobs_keep_files_to_del(pkg, newpkg);
-
-		STAILQ_FOREACH_SAFE(pkg, &pkg_queue, next, pkg_temp) {
-			pkg_get(pkg, PKG_ORIGIN, &origin);
-			if (strcmp(pkgorigin, origin) == 0) {
-				STAILQ_REMOVE(&pkg_queue, pkg, pkg, next);
-				pkg_delete_files(pkg, 1);
-				pkg_script_run(pkg, PKG_SCRIPT_POST_DEINSTALL);
-				pkg_delete_dirs(j->db, pkg, 0);
-				pkg_free(pkg);
+			flags |= PKG_ADD_UPGRADE;
+			if (automatic)
+				flags |= PKG_ADD_AUTOMATIC;
+
+			if (pkg_add_prepare(j->db, path, flags, &is.states[i + n]) != EPKG_OK)
+				ret = EPKG_FATAL;
+			extract += pkg_jobs_time() - t;
+			if (ret != EPKG_OK)
 				break;
-			}
 		}
 
-		flags |= PKG_ADD_UPGRADE;
-		if (automatic)
-			flags |= PKG_ADD_AUTOMATIC;
-
-		if (pkg_add(j->db, path, flags) != EPKG_OK) {
-			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
-			return (EPKG_FATAL);
+		/* the registrations are rolled back, nothing is extracted */
+		if (ret != EPKG_OK) {
+			for (m = 0; m < n; m++)
+				pkg_add_state_free(&is.states[i + m]);
+			break;
 		}
 
-		if (newversion != NULL)
-			pkg_emit_upgrade_finished(p);
-		else
-			pkg_emit_install_finished(newpkg);
+		/* a batch is installed or rolled back as a whole */
+		t = pkg_jobs_time();
+		if (xbegin == 0)
+			xbegin = t;
+		if (pkg_jobs_extract(&is.states[i], n, xworkers) != EPKG_OK)
+			ret = EPKG_FATAL;
+		is.nextracted = k;
+		if (!staged)
+			ret = install_commit(&is, k, k - i == 1, ret);
+		extract += pkg_jobs_time() - t;
 
-		if (STAILQ_EMPTY(&pkg_queue)) {
+		if (ret == EPKG_OK && is.checked && STAILQ_EMPTY(&pkg_queue)) {
 			sql_exec(j->db->sqlite, "RELEASE upgrade;");
 			sql_exec(j->db->sqlite, "SAVEPOINT upgrade;");
 		}
 	}
+
+	/* the packages extracted early are kept once the set is checked */
+	if (ret == EPKG_OK && !is.checked)
+		ret = install_check_set(&is);
+	t = pkg_jobs_time();
+	ret = install_commit(&is, is.nextracted, false, ret);
+	extract += pkg_jobs_time() - t;
+
+	if (ret != EPKG_OK)
+		sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
 	sql_exec(j->db->sqlite, "RELEASE upgrade;");
 
-	pkg_free(newpkg);
+	sql_exec(j->db->sqlite, "DROP TABLE IF EXISTS integritycheck;");
+	sql_exec(j->db->sqlite, "DROP TABLE IF EXISTS integrityreplace;");
 
-	return (EPKG_OK);
+	for (i = 0; i < is.fp.npkgs; i++)
+		pkg_free(is.newpkgs[i]);
+	fetch_pool_stop(&is.fp, ret);
+	if (j->fetch != NULL)
+		fetch_session_stats(j->fetch, &opened, &reused);
+	pkg_emit_stage_times(is.fp.finished - is.fp.started, is.verify, extract,
+	    xbegin > 0 && is.fp.finished > xbegin ? is.fp.finished - xbegin : 0,
+	    pkg_jobs_time() - begin, opened, reused);
+
+	sbuf_delete(is.buf);
+	free(is.newpkgs);
+	free(is.states);
+
+	return (ret);
 }
 
 static int
@@ -304,6 +1194,9 @@ pkg_jobs_deinstall(struct pkg_jobs *j, int force)
 int
 pkg_jobs_apply(struct pkg_jobs *j, int force)
 {
+	if (pkg_jobs_resolv(j) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	if (j->type == PKG_JOBS_INSTALL)
 		return (pkg_jobs_install(j));
 	if (j->type == PKG_JOBS_DEINSTALL)
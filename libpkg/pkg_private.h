@@ -101,13 +101,18 @@ struct pkg_option {
 
 struct pkg_jobs {
 	STAILQ_HEAD(jobs, pkg) jobs;
+	LIST_HEAD(nodes, pkg_jobs_node) nodes;
 	struct pkgdb *db;
 	pkg_jobs_t type;
+	bool resolved;
+	int nlevels;
+	struct fetch_session *fetch;
 };
 
 struct pkg_jobs_node {
 	struct pkg *pkg;
-	size_t nrefs;
+	size_t nrefs; /* deps not ordered yet */
+	int level;
 	struct pkg_jobs_node **parents; /* rdeps */
 	size_t parents_len;
 	size_t parents_cap;
@@ -138,8 +143,89 @@ int pkg_delete(struct pkg *pkg, struct pkgdb *db, int flags);
 #define PKG_DELETE_FORCE (1<<0)
 #define PKG_DELETE_UPGRADE (1<<1)
 
+/*
+ * pkg_add() in three steps for the installs extracting several packages at
+ * once: only pkg_add_extract() may run on another thread.
+ */
+struct pkg_add_state {
+	struct pkg *pkg;
+	struct archive *a;
+	struct archive_entry *ae;
+	struct archive *ad;	/* the disk writer of the extraction */
+	int flags;
+	bool extract;
+	int retcode;	/* of the extraction */
+};
+
+int pkg_add_prepare(struct pkgdb *db, const char *path, int flags,
+    struct pkg_add_state *st);
+int pkg_add_extract(struct pkg_add_state *st);
+int pkg_add_finish(struct pkgdb *db, struct pkg_add_state *st);
+void pkg_add_state_free(struct pkg_add_state *st);
+
 int pkg_repo_fetch(struct pkg *pkg);
 
+/**
+ * Progress of a single download: bytes received so far out of total.
+ * Used instead of the fetching event when several downloads run at once.
+ */
+typedef void (*fetch_cb)(void *data, off_t done, off_t total);
+int pkg_fetch_file_cb(struct fetch_session *s, const char *url,
+    const char *dest, bool resume, const char *sum, fetch_cb cb, void *data);
+int pkg_repo_fetch_cb(struct pkg *pkg, struct fetch_session *s, fetch_cb cb,
+    void *data);
+
+/**
+ * Validators of the copy of a file at hand, sent along a conditional
+ * download and replaced by the ones of the file downloaded. An ETag is only
+ * known for the HTTP connections of a fetch session.
+ */
+struct fetch_cond {
+	time_t mtime;
+	char etag[128];
+	bool optional;		/* a missing file is not an error */
+};
+
+/**
+ * Fetch a file unless it did not change since cond was recorded.
+ * @return EPKG_OK, EPKG_UPTODATE when unchanged, EPKG_END when an optional
+ * file is missing or an error code
+ */
+int pkg_fetch_file_cond(const char *url, const char *dest,
+    struct fetch_cond *cond, fetch_cb cb, void *data);
+
+/**
+ * HTTP connections kept open across the downloads of a session, safe to
+ * share between threads. A NULL session is a default one living until exit.
+ */
+struct fetch_session *fetch_session_new(void);
+void fetch_session_free(struct fetch_session *s);
+void fetch_session_stats(struct fetch_session *s, int64_t *opened,
+    int64_t *reused);
+
+/**
+ * Path in the cache of the package with the given checksum.
+ */
+int pkg_cache_path(const char *cksum, char *path, size_t len);
+
+/**
+ * Whether the cached package did not change since its checksum was verified.
+ */
+bool pkg_cache_verified(const char *cksum);
+
+/**
+ * Record in the cache index that the package matches its checksum and was
+ * just used. No process evicts the package until this one calls
+ * pkg_cache_release() or exits, older ones are evicted to fit in CACHE_SIZE.
+ */
+int pkg_cache_stamp(const char *cksum, const char *name);
+void pkg_cache_release(void);
+
+/**
+ * Fetch every package of the jobs into the cache, FETCH_WORKERS at a time.
+ */
+int pkg_jobs_fetch(struct pkg_jobs *j);
+
 int pkg_stop_rc_scripts(struct pkg *);
 int pkg_start_rc_scripts(struct pkg *);
 
@@ -150,6 +236,13 @@ int pkg_delete_user_group(struct pkgdb *db, struct pkg *pkg);
 
 int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf);
 
+/**
+ * pkg_open() which also computes the sha256 of the package while the
+ * archive is read, instead of reading it again.
+ */
+int pkg_open_cksum(struct pkg **p, const char *path, struct sbuf *mbuf,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1]);
+
 void pkg_list_free(struct pkg *, pkg_list);
 
 int pkg_dep_new(struct pkg_dep **);
@@ -183,7 +276,14 @@ int pkg_jobs_resolv(struct pkg_jobs *jobs);
 
 struct packing;
 
-int packing_init(struct packing **pack, const char *path, pkg_formats format);
+/**
+ * @param level Compression level, 0 for the default of the format and
+ * negative for COMPRESSION_LEVEL.
+ * @param threads xz compression threads, 0 for one per CPU and negative
+ * for COMPRESSION_THREADS.
+ */
+int packing_init(struct packing **pack, const char *path, pkg_formats format,
+    int level, int threads);
 int packing_append_file(struct packing *pack, const char *filepath, const char *newpath);
 int packing_append_file_attr(struct packing *pack, const char *filepath, const char *newpath, const char *uname, const char *gname, mode_t perm);
 int packing_append_buffer(struct packing *pack, const char *buffer, const char *path, int size);
@@ -191,6 +291,11 @@ int packing_append_tree(struct packing *pack, const char *treepath, const char *
 int packing_finish(struct packing *pack);
 pkg_formats packing_format_from_string(const char *str);
 
+/**
+ * Whether the libarchive in use can write, and read, the format.
+ */
+bool packing_format_supported(pkg_formats format);
+
 int pkg_delete_files(struct pkg *pkg, int force);
 int pkg_delete_dirs(struct pkgdb *db, struct pkg *pkg, int force);
 
@@ -198,6 +303,8 @@ int pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res);
 
 int pkgdb_integrity_append(struct pkgdb *db, struct pkg *p);
 int pkgdb_integrity_check(struct pkgdb *db);
+int pkgdb_integrity_replace(struct pkgdb *db, const char *origin);
+int pkgdb_integrity_check_pkg(struct pkgdb *db, struct pkg *p);
 struct pkgdb_it *pkgdb_integrity_conflict_local(struct pkgdb *db, const char *origin);
 
 int pkg_set_mtree(struct pkg *, const char *mtree);
@@ -5,9 +5,12 @@
 #include <archive_entry.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fts.h>
-#include <libgen.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -23,39 +26,49 @@
 
 int
 pkg_repo_fetch(struct pkg *pkg)
+{
+	return (pkg_repo_fetch_cb(pkg, NULL, NULL, NULL));
+}
+
+int
+pkg_repo_fetch_cb(struct pkg *pkg, struct fetch_session *s, fetch_cb cb,
+    void *data)
 {
 	char dest[MAXPATHLEN + 1];
 	char url[MAXPATHLEN + 1];
-	int fetched = 0;
+	char path[MAXPATHLEN + 1];
 	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
-	char *path = NULL;
+	char fullname[MAXPATHLEN + 1];
+	char *slash;
 	const char *packagesite = NULL;
-	const char *cachedir = NULL;
 	bool multirepos_enabled = false;
 	int retcode = EPKG_OK;
 	const char *repopath, *repourl, *sum, *name, *version;
 
 	assert((pkg->type & PKG_REMOTE) == PKG_REMOTE);
 
-	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
-		return (EPKG_FATAL);
-
 	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_REPOURL, &repourl,
 	    PKG_CKSUM, &sum, PKG_NAME, &name, PKG_VERSION, &version);
 
-	snprintf(dest, sizeof(dest), "%s/%s", cachedir, repopath);
+	/* the same package from several repositories is cached once */
+	if (pkg_cache_path(sum, dest, sizeof(dest)) != EPKG_OK)
+		return (EPKG_FATAL);
+	snprintf(fullname, sizeof(fullname), "%s-%s", name, version);
 
 	/* If it is already in the local cachedir, dont bother to download it */
-	if (access(dest, F_OK) == 0)
+	if (access(dest, F_OK) == 0) {
+		if (pkg_cache_verified(sum)) {
+			pkg_cache_stamp(sum, fullname);
+			return (EPKG_OK);
+		}
 		goto checksum;
-
-	/* Create the dirs in cachedir */
-	if ((path = dirname(dest)) == NULL) {
-		pkg_emit_errno("dirname", dest);
-		retcode = EPKG_FATAL;
-		goto cleanup;
 	}
 
+	/* Create the dirs in cachedir, dirname(3) is not thread safe */
+	strlcpy(path, dest, sizeof(path));
+	if ((slash = strrchr(path, '/')) != NULL && slash != path)
+		*slash = '\0';
+
 	if ((retcode = mkdirs(path)) != EPKG_OK)
 		goto cleanup;
 
@@ -83,27 +96,25 @@ pkg_repo_fetch(struct pkg *pkg)
 	else
 		snprintf(url, sizeof(url), "%s/%s", packagesite, repopath);
 
-	retcode = pkg_fetch_file(url, dest);
-	fetched = 1;
-
-	if (retcode != EPKG_OK)
-		goto cleanup;
+	/*
+	 * An interrupted download is resumed by the next run, the checksum
+	 * is verified while downloading.
+	 */
+	retcode = pkg_fetch_file_cb(s, url, dest, true, sum, cb, data);
+	if (retcode == EPKG_OK)
+		pkg_cache_stamp(sum, fullname);
+	goto cleanup;
 
 	checksum:
 	retcode = sha256_file(dest, cksum);
+	if (retcode == EPKG_OK && strcmp(cksum, sum)) {
+		pkg_emit_error("cached package %s: checksum mismatch, fetching from remote",
+		    fullname);
+		unlink(dest);
+		return (pkg_repo_fetch_cb(pkg, s, cb, data));
+	}
 	if (retcode == EPKG_OK)
-		if (strcmp(cksum, sum)) {
-			if (fetched == 1) {
-				pkg_emit_error("%s-%s failed checksum from repository",
-				    name, version);
-				retcode = EPKG_FATAL;
-			} else {
-				pkg_emit_error("cached package %s-%s: checksum mismatch, fetching from remote",
-				    name, version);
-				unlink(dest);
-				return (pkg_repo_fetch(pkg));
-			}
-		}
+		pkg_cache_stamp(sum, fullname);
 
 	cleanup:
 	if (retcode != EPKG_OK)
@@ -191,19 +202,290 @@ pkg_repo_verify(const char *path, unsigned char *sig, unsigned int sig_len)
 	return (EPKG_OK);
 }
 
+/*
+ * Extract the database of the repository archive to dest.
+ */
+static int
+repo_extract_db(const char *archive, const char *dest)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	int fd;
+	int retcode = EPKG_END;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_filename(a, archive, 4096) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open_filename(%s): %s", archive,
+					   archive_error_string(a));
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		if (strcmp(archive_entry_pathname(ae), "repo.sqlite") != 0)
+			continue;
+
+		if ((fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+			pkg_emit_errno("open", dest);
+			retcode = EPKG_FATAL;
+			break;
+		}
+
+		retcode = EPKG_OK;
+		if (archive_read_data_into_fd(a, fd) != ARCHIVE_OK) {
+			pkg_emit_error("%s: %s", archive, archive_error_string(a));
+			retcode = EPKG_FATAL;
+		}
+		close(fd);
+		break;
+	}
+
+	cleanup:
+	archive_read_finish(a);
+
+	return (retcode);
+}
+
+/*
+ * The packages found in the tree are opened and hashed by REPO_WORKERS
+ * threads, then inserted by the calling thread in the order of the walk: the
+ * database does not depend on the number of workers.
+ */
+#define REPO_PENDING -1
+
+struct repo_item {
+	char *path;
+	const char *relpath;	/* in path, relative to the repository */
+	int64_t size;
+	int64_t mtime;
+	int64_t oldid;		/* unchanged in the previous catalogue */
+	struct pkg *pkg;
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	int status;		/* REPO_PENDING until opened and hashed */
+};
+
+struct repo_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	struct repo_item *items;
+	int nitems;
+	int next;		/* next package to hand to a worker */
+	int written;		/* packages inserted so far */
+	int ahead;		/* packages kept in memory for the inserts */
+	bool abort;
+};
+
+static int
+repo_prepare(struct repo_item *it, struct sbuf *manifest)
+{
+	if (pkg_open_cksum(&it->pkg, it->path, manifest, it->cksum) != EPKG_OK)
+		return (EPKG_WARN);
+
+	return (EPKG_OK);
+}
+
+static void *
+repo_pool_worker(void *arg)
+{
+	struct repo_pool *rp = arg;
+	struct sbuf *manifest = sbuf_new_auto();
+	int i, ret;
+
+	pthread_mutex_lock(&rp->lock);
+	while (!rp->abort && rp->next < rp->nitems) {
+		if (rp->next >= rp->written + rp->ahead) {
+			pthread_cond_wait(&rp->cond, &rp->lock);
+			continue;
+		}
+		i = rp->next++;
+		if (rp->items[i].status != REPO_PENDING)
+			continue;
+		pthread_mutex_unlock(&rp->lock);
+
+		ret = repo_prepare(&rp->items[i], manifest);
+
+		pthread_mutex_lock(&rp->lock);
+		rp->items[i].status = ret;
+		pthread_cond_broadcast(&rp->cond);
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	sbuf_delete(manifest);
+
+	return (NULL);
+}
+
+static int
+repo_pool_start(struct repo_pool *rp)
+{
+	int64_t workers;
+	int i, ret;
+
+	if (pkg_config_int64(PKG_CONFIG_REPO_WORKERS, &workers) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (workers == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > rp->nitems)
+		workers = rp->nitems;
+	rp->ahead = workers * 4;
+
+	/* a single worker is the calling thread */
+	if (workers <= 1)
+		return (EPKG_OK);
+
+	if ((rp->threads = calloc(workers, sizeof(pthread_t))) == NULL) {
+		pkg_emit_errno("calloc", "repo_pool");
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < workers; i++) {
+		ret = pthread_create(&rp->threads[i], NULL, repo_pool_worker, rp);
+		if (ret != 0) {
+			pkg_emit_error("pthread_create: %s", strerror(ret));
+			break;
+		}
+		rp->nthreads++;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Wait for the i-th package to be ready for the inserts
+ */
+static int
+repo_pool_wait(struct repo_pool *rp, int i, struct sbuf *manifest)
+{
+	int ret;
+
+	if (rp->items[i].oldid != 0)
+		return (EPKG_OK);
+
+	if (rp->nthreads == 0)
+		return (repo_prepare(&rp->items[i], manifest));
+
+	pthread_mutex_lock(&rp->lock);
+	rp->written = i;
+	pthread_cond_broadcast(&rp->cond);
+	while ((ret = rp->items[i].status) == REPO_PENDING)
+		pthread_cond_wait(&rp->cond, &rp->lock);
+	pthread_mutex_unlock(&rp->lock);
+
+	return (ret);
+}
+
+static void
+repo_pool_stop(struct repo_pool *rp)
+{
+	int i;
+
+	pthread_mutex_lock(&rp->lock);
+	rp->abort = true;
+	pthread_cond_broadcast(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+
+	for (i = 0; i < rp->nthreads; i++)
+		pthread_join(rp->threads[i], NULL);
+
+	for (i = 0; i < rp->nitems; i++) {
+		free(rp->items[i].path);
+		if (rp->items[i].pkg != NULL)
+			pkg_free(rp->items[i].pkg);
+	}
+
+	pthread_mutex_destroy(&rp->lock);
+	pthread_cond_destroy(&rp->cond);
+	free(rp->items);
+	free(rp->threads);
+}
+
+/*
+ * The rows of a package unchanged since the previous catalogue, attached as
+ * old, are copied in the same order a full rebuild inserts them.
+ */
+static const char * const repo_copy[] = {
+	"INSERT INTO packages (origin, name, version, comment, desc, arch, "
+		"osversion, maintainer, www, prefix, pkgsize, flatsize, "
+		"licenselogic, cksum, path, pkg_format_version, vkey, mtime) "
+		"SELECT origin, name, version, comment, desc, arch, osversion, "
+		"maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, "
+		"path, pkg_format_version, vkey, mtime "
+		"FROM old.packages WHERE id = ?1;",
+	"INSERT INTO deps (origin, name, version, package_id) "
+		"SELECT origin, name, version, ?2 FROM old.deps "
+		"WHERE package_id = ?1 ORDER BY rowid;",
+	"INSERT OR IGNORE INTO categories(name) "
+		"SELECT c.name FROM old.pkg_categories pc, old.categories c "
+		"WHERE pc.package_id = ?1 AND c.id = pc.category_id "
+		"ORDER BY pc.rowid;",
+	"INSERT INTO pkg_categories(package_id, category_id) "
+		"SELECT ?2, n.id FROM old.pkg_categories pc, old.categories c, "
+		"categories n WHERE pc.package_id = ?1 AND c.id = pc.category_id "
+		"AND n.name = c.name ORDER BY pc.rowid;",
+	"INSERT OR IGNORE INTO licenses(name) "
+		"SELECT l.name FROM old.pkg_licenses pl, old.licenses l "
+		"WHERE pl.package_id = ?1 AND l.id = pl.license_id "
+		"ORDER BY pl.rowid;",
+	"INSERT INTO pkg_licenses(package_id, license_id) "
+		"SELECT ?2, n.id FROM old.pkg_licenses pl, old.licenses l, "
+		"licenses n WHERE pl.package_id = ?1 AND l.id = pl.license_id "
+		"AND n.name = l.name ORDER BY pl.rowid;",
+	"INSERT INTO options (option, value, package_id) "
+		"SELECT option, value, ?2 FROM old.options "
+		"WHERE package_id = ?1 ORDER BY rowid;",
+	NULL
+};
+
+#define REPO_NCOPY (sizeof(repo_copy) / sizeof(repo_copy[0]))
+
+static int
+repo_copy_pkg(sqlite3 *sqlite, sqlite3_stmt **stmts, int64_t oldid)
+{
+	int64_t id = 0;
+	int i;
+
+	for (i = 0; stmts[i] != NULL; i++) {
+		sqlite3_bind_int64(stmts[i], 1, oldid);
+		if (i > 0)
+			sqlite3_bind_int64(stmts[i], 2, id);
+
+		if (sqlite3_step(stmts[i]) != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+		sqlite3_reset(stmts[i]);
+
+		if (i == 0)
+			id = sqlite3_last_insert_rowid(sqlite);
+	}
+
+	return (EPKG_OK);
+}
+
 int
-pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *data)
+pkg_create_repo(char *path, bool incremental,
+    void (progress)(struct pkg *pkg, void *data), void *data)
 {
 	FTS *fts = NULL;
 	FTSENT *ent = NULL;
 
 	struct stat st;
 	struct pkg *pkg = NULL;
+	struct repo_pool rp;
+	struct repo_item *it;
+	int i;
 	struct pkg_dep *dep = NULL;
 	struct pkg_category *category = NULL;
 	struct pkg_license *license = NULL;
 	struct pkg_option *option = NULL;
 	struct sbuf *manifest = sbuf_new_auto();
+	struct sbuf *vkey = sbuf_new_auto();
 	char *ext = NULL;
 
 	sqlite3 *sqlite = NULL;
@@ -214,15 +496,19 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	sqlite3_stmt *stmt_cat1 = NULL;
 	sqlite3_stmt *stmt_cat2 = NULL;
 	sqlite3_stmt *stmt_opts = NULL;
+	sqlite3_stmt *stmt_old = NULL;
+	sqlite3_stmt *stmt_copy[REPO_NCOPY];
 
 	int64_t package_id;
 	char *errmsg = NULL;
 	int retcode = EPKG_OK;
-	char *pkg_path;
-	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
+	bool reuse = false;
+	bool moved = false;
 
 	char *repopath[2];
 	char repodb[MAXPATHLEN + 1];
+	char repoold[MAXPATHLEN + 1];
+	char repoarchive[MAXPATHLEN + 1];
 
 	const char initsql[] = ""
 		"CREATE TABLE packages ("
@@ -242,8 +528,12 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			"licenselogic INTEGER NOT NULL,"
 			"cksum TEXT NOT NULL,"
 			"path TEXT NOT NULL," /* relative path to the package in the repository */
-			"pkg_format_version INTEGER"
+			"pkg_format_version INTEGER,"
+			"vkey BLOB," /* pkg_version_key() of the version */
+			"mtime INTEGER" /* of the package, for pkg repo -i */
 		");"
+		"CREATE INDEX packages_vkey ON packages(origin, vkey);"
+		"CREATE VIRTUAL TABLE packages_fts USING fts4(name, comment, desc);"
 		"CREATE TABLE deps ("
 			"origin TEXT,"
 			"name TEXT,"
@@ -275,14 +565,18 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			"value TEXT,"
 			"UNIQUE (package_id, option)"
 		");"
-		"PRAGMA user_version=2;"
+		"PRAGMA user_version=5;"
 		;
 	const char pkgsql[] = ""
 		"INSERT INTO packages ("
 				"origin, name, version, comment, desc, arch, osversion, "
-				"maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, path"
+				"maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, path, vkey, "
+				"mtime"
 		")"
-		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15);";
+		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16, "
+		"?17);";
+	const char oldsql[] = "SELECT id FROM old.packages "
+		"WHERE path = ?1 AND pkgsize = ?2 AND mtime = ?3;";
 	const char depssql[] = ""
 		"INSERT INTO deps (origin, name, version, package_id) "
 		"VALUES (?1, ?2, ?3, ?4);";
@@ -303,13 +597,36 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	repopath[0] = path;
 	repopath[1] = NULL;
 
+	memset(&rp, 0, sizeof(struct repo_pool));
+	memset(stmt_copy, 0, sizeof(stmt_copy));
+	pthread_mutex_init(&rp.lock, NULL);
+	pthread_cond_init(&rp.cond, NULL);
+
 	snprintf(repodb, sizeof(repodb), "%s/repo.sqlite", path);
 
-	if (stat(repodb, &st) != -1)
-		if (unlink(repodb) != 0) {
+	snprintf(repoold, sizeof(repoold), "%s/repo.sqlite.old", path);
+
+	/*
+	 * The previous catalogue is kept aside for the unchanged packages,
+	 * pkg_finish_repo() only leaves it in repo.txz.
+	 */
+	if (stat(repodb, &st) != -1) {
+		if (incremental) {
+			if (rename(repodb, repoold) != 0) {
+				pkg_emit_errno("rename", repodb);
+				return EPKG_FATAL;
+			}
+			reuse = moved = true;
+		} else if (unlink(repodb) != 0) {
 			pkg_emit_errno("unlink", path);
 			return EPKG_FATAL;
 		}
+	} else if (incremental) {
+		snprintf(repoarchive, sizeof(repoarchive), "%s/repo.txz", path);
+		if (access(repoarchive, F_OK) == 0 &&
+		    repo_extract_db(repoarchive, repoold) == EPKG_OK)
+			reuse = true;
+	}
 
 	sqlite3_initialize();
 	if (sqlite3_open(repodb, &sqlite) != SQLITE_OK) {
@@ -320,6 +637,23 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	if ((retcode = sql_exec(sqlite, initsql)) != EPKG_OK)
 		goto cleanup;
 
+	if (reuse) {
+		if ((retcode = sql_exec(sqlite, "ATTACH '%q' AS old;", repoold)) != EPKG_OK)
+			goto cleanup;
+
+		/* catalogues older than the mtime column are rebuilt in full */
+		if (sqlite3_prepare_v2(sqlite, oldsql, -1, &stmt_old, NULL) != SQLITE_OK)
+			stmt_old = NULL;
+
+		for (i = 0; stmt_old != NULL && repo_copy[i] != NULL; i++) {
+			if (sqlite3_prepare_v2(sqlite, repo_copy[i], -1, &stmt_copy[i], NULL) != SQLITE_OK) {
+				ERROR_SQLITE(sqlite);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+		}
+	}
+
 	if ((retcode = sql_exec(sqlite, "BEGIN TRANSACTION;")) != EPKG_OK)
 		goto cleanup;
 
@@ -353,7 +687,7 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		goto cleanup;
 	}
 
-	if ((fts = fts_open(repopath, FTS_PHYSICAL, NULL)) == NULL) {
+	if ((fts = fts_open(repopath, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
 		pkg_emit_errno("fts_open", path);
 		retcode = EPKG_FATAL;
 		goto cleanup;
@@ -372,12 +706,6 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	}
 
 	while ((ent = fts_read(fts)) != NULL) {
-		const char *name, *version, *origin, *comment, *desc;
-		const char *arch, *osversion, *maintainer, *www, *prefix;
-		int64_t flatsize;
-		lic_t licenselogic;
-
-		cksum[0] = '\0';
 		/* skip everything that is not a file */
 		if (ent->fts_info != FTS_F)
 			continue;
@@ -390,22 +718,83 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		if (strcmp(ext, ".tgz") != 0 &&
 				strcmp(ext, ".tbz") != 0 &&
 				strcmp(ext, ".txz") != 0 &&
+				strcmp(ext, ".tzst") != 0 &&
 				strcmp(ext, ".tar") != 0)
 			continue;
 
-		if (strcmp(ent->fts_name, "repo.txz") == 0)
+		if (strcmp(ent->fts_name, "repo.txz") == 0 ||
+		    strcmp(ent->fts_name, "repo.tzst") == 0 ||
+		    strcmp(ent->fts_name, "repo.delta.txz") == 0)
+			continue;
+
+		if (rp.nitems % 1024 == 0) {
+			it = realloc(rp.items,
+			    (rp.nitems + 1024) * sizeof(struct repo_item));
+			if (it == NULL) {
+				pkg_emit_errno("realloc", "repo_pool");
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			rp.items = it;
+		}
+
+		it = &rp.items[rp.nitems];
+		memset(it, 0, sizeof(struct repo_item));
+		if ((it->path = strdup(ent->fts_path)) == NULL) {
+			pkg_emit_errno("strdup", ent->fts_path);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		it->relpath = it->path + strlen(path);
+		while (it->relpath[0] == '/' )
+			it->relpath++;
+		it->size = ent->fts_statp->st_size;
+		it->mtime = ent->fts_statp->st_mtime;
+		it->status = REPO_PENDING;
+		rp.nitems++;
+
+		if (stmt_old == NULL)
 			continue;
 
-		pkg_path = ent->fts_path;
-		pkg_path += strlen(path);
-		while (pkg_path[0] == '/' )
-			pkg_path++;
+		sqlite3_bind_text(stmt_old, 1, it->relpath, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt_old, 2, it->size);
+		sqlite3_bind_int64(stmt_old, 3, it->mtime);
+		if (sqlite3_step(stmt_old) == SQLITE_ROW) {
+			it->oldid = sqlite3_column_int64(stmt_old, 0);
+			it->status = EPKG_OK;
+		}
+		sqlite3_reset(stmt_old);
+	}
 
-		if (pkg_open(&pkg, ent->fts_accpath, manifest) != EPKG_OK) {
+	if ((retcode = repo_pool_start(&rp)) != EPKG_OK)
+		goto cleanup;
+
+	for (i = 0; i < rp.nitems; i++) {
+		const char *name, *version, *origin, *comment, *desc;
+		const char *arch, *osversion, *maintainer, *www, *prefix;
+		int64_t flatsize;
+		lic_t licenselogic;
+
+		it = &rp.items[i];
+		if (repo_pool_wait(&rp, i, manifest) != EPKG_OK) {
+			if (it->pkg != NULL)
+				pkg_free(it->pkg);
+			it->pkg = NULL;
 			retcode = EPKG_WARN;
 			continue;
 		}
 
+		if (it->oldid != 0) {
+			if (progress != NULL)
+				progress(NULL, data);
+			if (repo_copy_pkg(sqlite, stmt_copy, it->oldid) != EPKG_OK) {
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			continue;
+		}
+		pkg = it->pkg;
+
 		if (progress != NULL)
 			progress(pkg, data);
 
@@ -425,12 +814,14 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		sqlite3_bind_text(stmt_pkg, 8, maintainer, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt_pkg, 9, www, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt_pkg, 10, prefix, -1, SQLITE_STATIC);
-		sqlite3_bind_int64(stmt_pkg, 11, ent->fts_statp->st_size);
+		sqlite3_bind_int64(stmt_pkg, 11, it->size);
 		sqlite3_bind_int64(stmt_pkg, 12, flatsize);
-		sha256_file(ent->fts_accpath, cksum);
 		sqlite3_bind_int64(stmt_pkg, 13, licenselogic);
-		sqlite3_bind_text(stmt_pkg, 14, cksum, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt_pkg, 15, pkg_path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 14, it->cksum, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 15, it->relpath, -1, SQLITE_STATIC);
+		pkg_version_key(version, vkey);
+		sqlite3_bind_blob(stmt_pkg, 16, sbuf_data(vkey), sbuf_len(vkey), SQLITE_STATIC);
+		sqlite3_bind_int64(stmt_pkg, 17, it->mtime);
 
 		if (sqlite3_step(stmt_pkg) != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite);
@@ -510,8 +901,18 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			}
 			sqlite3_reset(stmt_opts);
 		}
+
+		/* the workers only run REPO_WORKERS * 4 packages ahead */
+		pkg_free(pkg);
+		it->pkg = NULL;
 	}
 
+	/* full text index of the descriptions, for pkg search */
+	if ((retcode = sql_exec(sqlite, "INSERT INTO packages_fts(docid, name, comment, desc) "
+	    "SELECT id, name, comment, desc FROM packages;"
+	    "INSERT INTO packages_fts(packages_fts) VALUES('optimize');")) != EPKG_OK)
+		goto cleanup;
+
 	if (sqlite3_exec(sqlite, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK) {
 		pkg_emit_error("sqlite: %s", errmsg);
 		retcode = EPKG_FATAL;
@@ -521,8 +922,7 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	if (fts != NULL)
 		fts_close(fts);
 
-	if (pkg != NULL)
-		pkg_free(pkg);
+	repo_pool_stop(&rp);
 
 	if (stmt_pkg != NULL)
 		sqlite3_finalize(stmt_pkg);
@@ -545,35 +945,270 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	if (stmt_opts != NULL)
 		sqlite3_finalize(stmt_opts);
 
+	if (stmt_old != NULL)
+		sqlite3_finalize(stmt_old);
+
+	for (i = 0; repo_copy[i] != NULL; i++)
+		if (stmt_copy[i] != NULL)
+			sqlite3_finalize(stmt_copy[i]);
+
 	if (sqlite != NULL)
 		sqlite3_close(sqlite);
 
+	/* put the previous catalogue back if this one failed */
+	if (moved && retcode == EPKG_FATAL) {
+		if (rename(repoold, repodb) != 0)
+			pkg_emit_errno("rename", repoold);
+	} else if (reuse)
+		unlink(repoold);
+
 	if (errmsg != NULL)
 		sqlite3_free(errmsg);
 
 	sbuf_delete(manifest);
+	sbuf_delete(vkey);
 
 	sqlite3_shutdown();
 
 	return (retcode);
 }
 
+/*
+ * A delta is an SQL script turning the previous database of the repository
+ * into the current one: the packages which are gone or were rebuilt are
+ * deleted and the new ones inserted, referring to each other by origin.
+ * Its first line names both databases by their checksum.
+ */
+static const char delta_head[] = ""
+	"CREATE TEMPORARY TABLE delta_gone (origin TEXT PRIMARY KEY);\n"
+	"CREATE TEMPORARY TABLE delta_new (origin TEXT PRIMARY KEY);\n";
+static const char delta_delete[] = ""
+	"DELETE FROM packages_fts WHERE docid IN "
+		"(SELECT id FROM packages WHERE origin IN delta_gone);\n"
+	"DELETE FROM deps WHERE package_id IN "
+		"(SELECT id FROM packages WHERE origin IN delta_gone);\n"
+	"DELETE FROM pkg_categories WHERE package_id IN "
+		"(SELECT id FROM packages WHERE origin IN delta_gone);\n"
+	"DELETE FROM pkg_licenses WHERE package_id IN "
+		"(SELECT id FROM packages WHERE origin IN delta_gone);\n"
+	"DELETE FROM options WHERE package_id IN "
+		"(SELECT id FROM packages WHERE origin IN delta_gone);\n"
+	"DELETE FROM packages WHERE origin IN delta_gone;\n";
+static const char delta_tail[] = ""
+	"INSERT INTO packages_fts(docid, name, comment, desc) "
+		"SELECT id, name, comment, desc FROM packages "
+		"WHERE origin IN delta_new;\n"
+	"DROP TABLE delta_gone;\n"
+	"DROP TABLE delta_new;\n";
+
+/* each row of these queries is a statement of the delta */
+static const char * const delta_gone[] = {
+	"SELECT 'INSERT INTO delta_gone VALUES(' || quote(origin) || ');' "
+		"FROM delta_gone;",
+	"SELECT 'INSERT INTO delta_new VALUES(' || quote(origin) || ');' "
+		"FROM delta_new;",
+	NULL
+};
+static const char * const delta_new[] = {
+	"SELECT 'INSERT INTO packages (origin, name, version, comment, desc, "
+		"arch, osversion, maintainer, www, prefix, pkgsize, flatsize, "
+		"licenselogic, cksum, path, pkg_format_version, vkey, mtime) "
+		"VALUES (' || "
+		"quote(origin) || ', ' || quote(name) || ', ' || quote(version) || "
+		"', ' || quote(comment) || ', ' || quote(desc) || ', ' || "
+		"quote(arch) || ', ' || quote(osversion) || ', ' || "
+		"quote(maintainer) || ', ' || quote(www) || ', ' || quote(prefix) || "
+		"', ' || quote(pkgsize) || ', ' || quote(flatsize) || ', ' || "
+		"quote(licenselogic) || ', ' || quote(cksum) || ', ' || quote(path) || "
+		"', ' || quote(pkg_format_version) || ', ' || quote(vkey) || ', ' || "
+		"quote(mtime) || ');' "
+		"FROM packages WHERE id IN (SELECT id FROM delta_new);",
+	"SELECT 'INSERT INTO deps (origin, name, version, package_id) SELECT ' || "
+		"quote(d.origin) || ', ' || quote(d.name) || ', ' || "
+		"quote(d.version) || ', id FROM packages WHERE origin = ' || "
+		"quote(n.origin) || ';' "
+		"FROM deps d, delta_new n WHERE d.package_id = n.id;",
+	"SELECT 'INSERT OR IGNORE INTO categories(name) VALUES(' || "
+		"quote(c.name) || ');' || char(10) || "
+		"'INSERT INTO pkg_categories(package_id, category_id) "
+		"SELECT p.id, c.id FROM packages p, categories c WHERE p.origin = ' || "
+		"quote(n.origin) || ' AND c.name = ' || quote(c.name) || ';' "
+		"FROM pkg_categories pc, categories c, delta_new n "
+		"WHERE pc.package_id = n.id AND c.id = pc.category_id;",
+	"SELECT 'INSERT OR IGNORE INTO licenses(name) VALUES(' || "
+		"quote(l.name) || ');' || char(10) || "
+		"'INSERT INTO pkg_licenses(package_id, license_id) "
+		"SELECT p.id, l.id FROM packages p, licenses l WHERE p.origin = ' || "
+		"quote(n.origin) || ' AND l.name = ' || quote(l.name) || ';' "
+		"FROM pkg_licenses pl, licenses l, delta_new n "
+		"WHERE pl.package_id = n.id AND l.id = pl.license_id;",
+	"SELECT 'INSERT INTO options (option, value, package_id) SELECT ' || "
+		"quote(o.option) || ', ' || quote(o.value) || "
+		"', id FROM packages WHERE origin = ' || quote(n.origin) || ';' "
+		"FROM options o, delta_new n WHERE o.package_id = n.id;",
+	NULL
+};
+
+static int
+repo_delta_write(sqlite3 *sqlite, FILE *fp, const char * const *queries)
+{
+	sqlite3_stmt *stmt = NULL;
+	int ret;
+
+	for (; *queries != NULL; queries++) {
+		if (sqlite3_prepare_v2(sqlite, *queries, -1, &stmt, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+			fprintf(fp, "%s\n", sqlite3_column_text(stmt, 0));
+		sqlite3_finalize(stmt);
+
+		if (ret != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+	}
+
+	return (EPKG_OK);
+}
+
+static int64_t
+repo_version(sqlite3 *sqlite, const char *schema)
+{
+	sqlite3_stmt *stmt;
+	char sql[64];
+	int64_t version = -1;
+
+	snprintf(sql, sizeof(sql), "PRAGMA %s.user_version;", schema);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return (-1);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return (version);
+}
+
+static int
+repo_delta(const char *db, const char *prev, const char *delta)
+{
+	FILE *fp = NULL;
+	sqlite3 *sqlite = NULL;
+	char from[SHA256_DIGEST_LENGTH * 2 +1];
+	char to[SHA256_DIGEST_LENGTH * 2 +1];
+	int retcode = EPKG_OK;
+
+	/* a package is rebuilt when its file changed */
+	const char changesql[] = ""
+		"CREATE TEMPORARY TABLE delta_gone AS SELECT origin "
+			"FROM old.packages o WHERE NOT EXISTS (SELECT 1 FROM "
+			"main.packages p WHERE p.origin = o.origin AND "
+			"p.cksum = o.cksum AND p.path = o.path);"
+		"CREATE TEMPORARY TABLE delta_new AS SELECT id, origin "
+			"FROM main.packages p WHERE NOT EXISTS (SELECT 1 FROM "
+			"old.packages o WHERE o.origin = p.origin AND "
+			"o.cksum = p.cksum AND o.path = p.path);";
+
+	if (sha256_file(prev, from) != EPKG_OK ||
+	    sha256_file(db, to) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (sqlite3_open(db, &sqlite) != SQLITE_OK)
+		return (EPKG_FATAL);
+
+	if ((retcode = sql_exec(sqlite, "ATTACH '%q' AS old;", prev)) != EPKG_OK)
+		goto cleanup;
+
+	/* a delta does not change the schema of the catalogue */
+	if (repo_version(sqlite, "main") != repo_version(sqlite, "old")) {
+		retcode = EPKG_END;
+		goto cleanup;
+	}
+
+	if ((retcode = sql_exec(sqlite, changesql)) != EPKG_OK)
+		goto cleanup;
+
+	if ((fp = fopen(delta, "w")) == NULL) {
+		pkg_emit_errno("fopen", delta);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	fprintf(fp, "-- pkg delta %s %s\n%s", from, to, delta_head);
+	if ((retcode = repo_delta_write(sqlite, fp, delta_gone)) != EPKG_OK)
+		goto cleanup;
+	fputs(delta_delete, fp);
+	if ((retcode = repo_delta_write(sqlite, fp, delta_new)) != EPKG_OK)
+		goto cleanup;
+	fputs(delta_tail, fp);
+
+	if (ferror(fp)) {
+		pkg_emit_errno("fprintf", delta);
+		retcode = EPKG_FATAL;
+	}
+
+	cleanup:
+	if (fp != NULL && fclose(fp) != 0 && retcode == EPKG_OK) {
+		pkg_emit_errno("fclose", delta);
+		retcode = EPKG_FATAL;
+	}
+
+	if (retcode != EPKG_OK)
+		unlink(delta);
+
+	sqlite3_close(sqlite);
+
+	return (retcode);
+}
+
+static int
+repo_sign(struct packing *pack, RSA *rsa, const char *path)
+{
+	unsigned char *sigret;
+	unsigned int siglen = 0;
+	char sha256[SHA256_DIGEST_LENGTH * 2 +1];
+
+	if ((sigret = calloc(1, RSA_size(rsa) + 1)) == NULL) {
+		pkg_emit_errno("calloc", "signature");
+		return (EPKG_FATAL);
+	}
+
+	sha256_file(path, sha256);
+
+	if (RSA_sign(NID_sha1, sha256, sizeof(sha256), sigret, &siglen, rsa) == 0) {
+		/* XXX pass back RSA errors correctly */
+		pkg_emit_error("%s: %lu", path, ERR_get_error());
+		free(sigret);
+		return (EPKG_FATAL);
+	}
+
+	packing_append_buffer(pack, sigret, "signature", siglen + 1);
+	free(sigret);
+
+	return (EPKG_OK);
+}
+
 int
-pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
+pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path,
+    bool delta)
 {
 	char repo_path[MAXPATHLEN + 1];
 	char repo_archive[MAXPATHLEN + 1];
+	char prev_path[MAXPATHLEN + 1];
+	char delta_path[MAXPATHLEN + 1];
 	struct packing *pack;
-	int max_len = 0;
-	unsigned char *sigret = NULL;
-	int siglen = 0;
 	RSA *rsa = NULL;
-	char sha256[SHA256_DIGEST_LENGTH * 2 +1];
+	bool has_delta = false;
+	int retcode = EPKG_OK;
+	int i;
+
+	/* repo.tzst holds the same database, quicker to decompress */
+	const pkg_formats formats[] = { TXZ, TZST };
 
 	snprintf(repo_path, sizeof(repo_path), "%s/repo.sqlite", path);
-	snprintf(repo_archive, sizeof(repo_archive), "%s/repo", path);
 
-	packing_init(&pack, repo_archive, TXZ);
 	if (rsa_key_path != NULL) {
 		if (access(rsa_key_path, R_OK) == -1) {
 			pkg_emit_errno("access", rsa_key_path);
@@ -585,28 +1220,76 @@ pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
 		OpenSSL_add_all_algorithms();
 		OpenSSL_add_all_ciphers();
 
-		rsa = load_rsa_private_key(rsa_key_path, password_cb);
-		max_len = RSA_size(rsa);
-		sigret = malloc(max_len + 1);
-		memset(sigret, 0, max_len);
-
-		sha256_file(repo_path, sha256);
-
-		if (RSA_sign(NID_sha1, sha256, sizeof(sha256), sigret, &siglen, rsa) == 0) {
-			/* XXX pass back RSA errors correctly */
+		if ((rsa = load_rsa_private_key(rsa_key_path, password_cb)) == NULL) {
 			pkg_emit_error("%s: %lu", rsa_key_path, ERR_get_error());
 			return EPKG_FATAL;
 		}
+	}
 
-		packing_append_buffer(pack, sigret, "signature", siglen + 1);
+	/* a delta only applies to the database it was made from */
+	snprintf(repo_archive, sizeof(repo_archive), "%s/repo.delta.txz", path);
+	if (unlink(repo_archive) == -1 && errno != ENOENT) {
+		pkg_emit_errno("unlink", repo_archive);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
 
-		free(sigret);
+	snprintf(repo_archive, sizeof(repo_archive), "%s/repo.tzst", path);
+	if (unlink(repo_archive) == -1 && errno != ENOENT) {
+		pkg_emit_errno("unlink", repo_archive);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	snprintf(repo_archive, sizeof(repo_archive), "%s/repo.txz", path);
+	snprintf(prev_path, sizeof(prev_path), "%s/repo.sqlite.prev", path);
+	snprintf(delta_path, sizeof(delta_path), "%s/delta.sql", path);
+	if (delta && access(repo_archive, F_OK) == 0) {
+		if (repo_extract_db(repo_archive, prev_path) == EPKG_OK &&
+		    repo_delta(repo_path, prev_path, delta_path) == EPKG_OK)
+			has_delta = true;
+		unlink(prev_path);
+	}
+
+	if (has_delta) {
+		snprintf(repo_archive, sizeof(repo_archive), "%s/repo.delta", path);
+		if (packing_init(&pack, repo_archive, TXZ, -1, -1) != EPKG_OK) {
+			unlink(delta_path);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (rsa != NULL && (retcode = repo_sign(pack, rsa, delta_path)) != EPKG_OK) {
+			packing_finish(pack);
+			unlink(delta_path);
+			goto cleanup;
+		}
+		packing_append_file(pack, delta_path, "delta.sql");
+		unlink(delta_path);
+		packing_finish(pack);
+	}
+
+	snprintf(repo_archive, sizeof(repo_archive), "%s/repo", path);
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+		if (formats[i] == TZST && !packing_format_supported(TZST))
+			continue;
+		if (packing_init(&pack, repo_archive, formats[i], -1, -1) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (rsa != NULL && (retcode = repo_sign(pack, rsa, repo_path)) != EPKG_OK) {
+			packing_finish(pack);
+			goto cleanup;
+		}
+		packing_append_file(pack, repo_path, "repo.sqlite");
+		packing_finish(pack);
+	}
+	unlink(repo_path);
+
+	cleanup:
+	if (rsa != NULL) {
 		RSA_free(rsa);
 		ERR_free_strings();
 	}
-	packing_append_file(pack, repo_path, "repo.sqlite");
-	unlink(repo_path);
-	packing_finish(pack);
 
-	return (EPKG_OK);
+	return (retcode);
 }
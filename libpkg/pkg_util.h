@@ -25,6 +25,7 @@ int file_fetch(const char *, const char *);
 int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
+void sha256_hash(unsigned char[SHA256_DIGEST_LENGTH], char[SHA256_DIGEST_LENGTH * 2 +1]);
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 void sha256_str(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 #endif
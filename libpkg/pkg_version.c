@@ -1,5 +1,8 @@
+#include <sys/types.h>
+
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -295,3 +298,96 @@ pkg_version_cmp(const char * const pkg1, const char * const pkg2)
 	}
 	return result;
 }
+
+/*
+ * Tags of the components in a version key.  Components equal to zero
+ * ({0, 0, 0}, the value of a missing component) are left out, so the
+ * key of a version lists the position and value of its other components
+ * and the end tag sorts them against the missing ones.
+ */
+#define VKEY_NEG	0x01
+#define VKEY_END	0x02
+#define VKEY_POS	0x03
+
+static void
+version_key_int(struct sbuf *key, uint64_t v, size_t len)
+{
+	unsigned char buf[8];
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = v >> (8 * (len - 1 - i));
+
+	sbuf_bcat(key, buf, len);
+}
+
+static void
+version_key_component(struct sbuf *key, uint32_t block, uint32_t pos,
+    version_component *vc)
+{
+	int sign;
+
+	if (vc->n != 0)
+		sign = (vc->n < 0 ? -1 : 1);
+	else if (vc->a != 0)
+		sign = (vc->a < 0 ? -1 : 1);
+	else if (vc->pl != 0)
+		sign = (vc->pl < 0 ? -1 : 1);
+	else
+		return;
+
+	/*
+	 * A component which is not zero decides the comparison against a
+	 * version missing it, and the earlier it comes the more it weighs:
+	 * the positions of the positive ones are stored inverted.
+	 */
+	if (sign > 0) {
+		block = ~block;
+		pos = ~pos;
+	}
+
+	sbuf_putc(key, sign > 0 ? VKEY_POS : VKEY_NEG);
+	version_key_int(key, block, 4);
+	version_key_int(key, pos, 4);
+	version_key_int(key, (uint64_t)vc->n ^ (UINT64_C(1) << 63), 8);
+	version_key_int(key, (uint32_t)vc->a ^ (UINT32_C(1) << 31), 4);
+	version_key_int(key, (uint64_t)vc->pl ^ (UINT64_C(1) << 63), 8);
+}
+
+/*
+ * pkg_version_key(version, key) encodes a version into a key whose
+ * memcmp(3) order, shorter keys first on a common prefix, is the order of
+ * pkg_version_cmp(): the epoch, the components by blocks (the parts
+ * separated by `+') and the revision.
+ */
+int
+pkg_version_key(const char *version, struct sbuf *key)
+{
+	const char *v, *ve;
+	unsigned long epoch, revision;
+	version_component vc;
+	uint32_t block = 0, pos = 0;
+
+	if ((v = split_version(version, &ve, &epoch, &revision)) == NULL)
+		return (EPKG_FATAL);
+
+	sbuf_clear(key);
+	version_key_int(key, epoch, 8);
+
+	while (v < ve) {
+		if (*v == '+') {
+			v++;
+			block++;
+			pos = 0;
+			continue;
+		}
+		v = get_component(v, &vc);
+		version_key_component(key, block, pos++, &vc);
+	}
+
+	sbuf_putc(key, VKEY_END);
+	version_key_int(key, revision, 8);
+	sbuf_finish(key);
+
+	return (EPKG_OK);
+}
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <regex.h>
@@ -23,21 +24,29 @@
 #include "pkg_util.h"
 
 #include "db_upgrades.h"
-#define DBVERSION 8
+#define DBVERSION 10
 
 static struct pkgdb_it * pkgdb_it_new(struct pkgdb *, sqlite3_stmt *, int);
 static void pkgdb_regex(sqlite3_context *, int, sqlite3_value **, int);
 static void pkgdb_regex_basic(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_regex_extended(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_regex_delete(void *);
-static void pkgdb_pkglt(sqlite3_context *, int, sqlite3_value **);
-static void pkgdb_pkggt(sqlite3_context *, int, sqlite3_value **);
+static void pkgdb_version_key(sqlite3_context *, int, sqlite3_value **);
 static int get_pragma(sqlite3 *, const char *, int64_t *);
 static int pkgdb_upgrade(struct pkgdb *);
-static void populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg);
+static void populate_pkg(struct pkgdb_it *it, struct pkg *pkg);
 static int create_temporary_pkgjobs(sqlite3 *);
+static int pkgdb_jobs_closure(struct pkgdb *, const char *);
 static void pkgdb_detach_remotes(sqlite3 *);
-static bool is_attached(sqlite3 *, const char *);
+static void pkgdb_stmt_flush(struct pkgdb *);
+static int pkgdb_set_journal(sqlite3 *, const char *);
+static int pkgdb_set_profile(struct pkgdb *);
+static int pkgdb_repo_add(struct pkgdb *, const char *);
+static bool is_reserved_repo(const char *);
+static int pkgdb_repo_attach_all(struct pkgdb *);
+static int64_t pkgdb_repo_version(struct pkgdb *, const char *);
+static const char *pkgdb_repo_vkey(struct pkgdb *, const char *);
+static void pkgdb_fts_rank(sqlite3_context *, int, sqlite3_value **);
 
 static struct column_mapping {
 	const char * const name;
@@ -69,9 +78,181 @@ static struct column_mapping {
 	{ NULL, -1 }
 };
 
+/*
+ * Durability profiles of the local database, selected by PKG_DBPROFILE.
+ * The write-ahead log lets readers go on while an installation holds a
+ * transaction open.  cache_size is in pages.
+ */
+static struct db_profile {
+	const char * const name;
+	const char * const journal;
+	const char * const synchronous;
+	int cache_size;
+} db_profiles[] = {
+	{ "safe", "DELETE", "FULL", 2000 },
+	{ "normal", "WAL", "NORMAL", 8000 },
+	{ "fast", "WAL", "OFF", 32000 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+/*
+ * Ordered scans used to load a relation for every package returned by a
+ * pkgdb_query() iterator at once.  The first column is always the package
+ * id and the rows are sorted like the iterator itself (p.name, p.id) so
+ * that they can be merged into each package as pkgdb_it_next() advances.
+ * The %s is replaced by the filter of the iterator.
+ */
+static struct relation_scan {
+	int flag;
+	const char *sql;
+} relations[PKGDB_IT_NRELATIONS] = {
+	{ PKG_LOAD_DEPS,
+	"SELECT p.id, d.name, d.origin, d.version "
+	"FROM packages AS p, deps AS d "
+	"WHERE d.package_id = p.id%s "
+	"ORDER BY p.name, p.id" },
+	{ PKG_LOAD_RDEPS,
+	"SELECT p.id, r.name, r.origin, r.version "
+	"FROM packages AS p, deps AS d, packages AS r "
+	"WHERE d.origin = p.origin AND r.id = d.package_id%s "
+	"ORDER BY p.name, p.id" },
+	{ PKG_LOAD_FILES,
+	"SELECT p.id, f.path, f.sha256 "
+	"FROM packages AS p, files AS f "
+	"WHERE f.package_id = p.id%s "
+	"ORDER BY p.name, p.id, f.path ASC" },
+	{ PKG_LOAD_DIRS,
+	"SELECT p.id, d.path, pd.try "
+	"FROM packages AS p, pkg_directories AS pd, directories AS d "
+	"WHERE pd.package_id = p.id AND pd.directory_id = d.id%s "
+	"ORDER BY p.name, p.id, d.path DESC" },
+	{ PKG_LOAD_SCRIPTS,
+	"SELECT p.id, s.script, s.type "
+	"FROM packages AS p, scripts AS s "
+	"WHERE s.package_id = p.id%s "
+	"ORDER BY p.name, p.id" },
+	{ PKG_LOAD_OPTIONS,
+	"SELECT p.id, o.option, o.value "
+	"FROM packages AS p, options AS o "
+	"WHERE o.package_id = p.id%s "
+	"ORDER BY p.name, p.id" },
+	{ PKG_LOAD_MTREE,
+	"SELECT p.id, m.content "
+	"FROM packages AS p, mtree AS m "
+	"WHERE m.id = p.mtree_id%s "
+	"ORDER BY p.name, p.id" },
+	{ PKG_LOAD_CATEGORIES,
+	"SELECT p.id, c.name "
+	"FROM packages AS p, pkg_categories AS pc, categories AS c "
+	"WHERE pc.package_id = p.id AND pc.category_id = c.id%s "
+	"ORDER BY p.name, p.id, c.name DESC" },
+	{ PKG_LOAD_LICENSES,
+	"SELECT p.id, l.name "
+	"FROM packages AS p, pkg_licenses AS pl, licenses AS l "
+	"WHERE pl.package_id = p.id AND pl.license_id = l.id%s "
+	"ORDER BY p.name, p.id, l.name DESC" },
+	{ PKG_LOAD_USERS,
+	"SELECT p.id, u.name "
+	"FROM packages AS p, pkg_users AS pu, users AS u "
+	"WHERE pu.package_id = p.id AND pu.user_id = u.id%s "
+	"ORDER BY p.name, p.id, u.name DESC" },
+	{ PKG_LOAD_GROUPS,
+	"SELECT p.id, g.name "
+	"FROM packages AS p, pkg_groups AS pg, groups AS g "
+	"WHERE pg.package_id = p.id AND pg.group_id = g.id%s "
+	"ORDER BY p.name, p.id, g.name DESC" },
+};
+
+static unsigned int
+pkgdb_stmt_hash(const char *sql)
+{
+	unsigned int h = 5381;
+
+	while (*sql != '\0')
+		h = h * 33 + (unsigned char)*sql++;
+
+	return (h % PKGDB_STMT_BUCKETS);
+}
+
+/*
+ * Return the statement prepared for sql on this connection, preparing it
+ * on first use.  The statement is handed out reset and without bindings;
+ * callers must sqlite3_reset() it when done instead of finalizing it, and
+ * must not use the same sql twice at once.  Never hand one to an iterator:
+ * it outlives the caller and is finalized by pkgdb_it_free().
+ */
+sqlite3_stmt *
+pkgdb_stmt_get(struct pkgdb *db, const char *sql)
+{
+	struct pkgdb_stmt *cs;
+	unsigned int h;
+
+	assert(db != NULL && sql != NULL);
+
+	h = pkgdb_stmt_hash(sql);
+	LIST_FOREACH(cs, &db->stmts[h], next) {
+		if (strcmp(cs->sql, sql) == 0) {
+			db->stmt_hits++;
+			sqlite3_reset(cs->stmt);
+			sqlite3_clear_bindings(cs->stmt);
+			return (cs->stmt);
+		}
+	}
+
+	if ((cs = calloc(1, sizeof(struct pkgdb_stmt))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_stmt");
+		return (NULL);
+	}
+
+	if ((cs->sql = strdup(sql)) == NULL) {
+		pkg_emit_errno("strdup", "pkgdb_stmt");
+		free(cs);
+		return (NULL);
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &cs->stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		free(cs->sql);
+		free(cs);
+		return (NULL);
+	}
+
+	db->stmt_misses++;
+	LIST_INSERT_HEAD(&db->stmts[h], cs, next);
+
+	return (cs->stmt);
+}
+
+static void
+pkgdb_stmt_flush(struct pkgdb *db)
+{
+	struct pkgdb_stmt *cs;
+	int i;
+
+	for (i = 0; i < PKGDB_STMT_BUCKETS; i++) {
+		while (!LIST_EMPTY(&db->stmts[i])) {
+			cs = LIST_FIRST(&db->stmts[i]);
+			LIST_REMOVE(cs, next);
+			sqlite3_finalize(cs->stmt);
+			free(cs->sql);
+			free(cs);
+		}
+	}
+}
+
+void
+pkgdb_stmt_stats(struct pkgdb *db, int64_t *hits, int64_t *misses)
+{
+	assert(db != NULL);
+
+	if (hits != NULL)
+		*hits = db->stmt_hits;
+	if (misses != NULL)
+		*misses = db->stmt_misses;
+}
 
 static int
-load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
+load_val(struct pkgdb *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
 {
 	sqlite3_stmt *stmt;
 	int ret;
@@ -81,10 +262,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_add
 	if (pkg->flags & flags)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -92,12 +271,12 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_add
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db);
+		ERROR_SQLITE(db->sqlite);
 		return (EPKG_FATAL);
 	}
 
@@ -105,39 +284,65 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_add
 	return (EPKG_OK);
 }
 
-static void
-populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg) {
-	int i, icol = 0;
+/*
+ * Resolve the columns of the iterator statement into indexes of columns[]
+ * once, so that populate_pkg() does not have to look names up on each row.
+ */
+static int
+map_columns(struct pkgdb_it *it)
+{
 	const char *colname;
+	int i, icol;
+
+	it->ncols = sqlite3_column_count(it->stmt);
+	if (it->ncols == 0)
+		return (EPKG_OK);
+
+	if ((it->colmap = calloc(it->ncols, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_it");
+		return (EPKG_FATAL);
+	}
+
+	for (icol = 0; icol < it->ncols; icol++) {
+		colname = sqlite3_column_name(it->stmt, icol);
+		for (i = 0; columns[i].name != NULL; i++) {
+			if (strcmp(columns[i].name, colname) == 0)
+				break;
+		}
+		it->colmap[icol] = (columns[i].name != NULL) ? i : -1;
+	}
+
+	return (EPKG_OK);
+}
+
+static void
+populate_pkg(struct pkgdb_it *it, struct pkg *pkg) {
+	sqlite3_stmt *stmt = it->stmt;
+	int icol, i;
 
 	assert(stmt != NULL);
 
-	for (icol = 0; icol < sqlite3_column_count(stmt); icol++) {
-		colname = sqlite3_column_name(stmt, icol);
+	for (icol = 0; icol < it->ncols; icol++) {
+		i = it->colmap[icol];
 		switch (sqlite3_column_type(stmt, icol)) {
 			case SQLITE_TEXT:
-				for (i = 0; columns[i].name != NULL; i++ ) {
-					if (!strcmp(columns[i].name, colname)) {
-						pkg_set(pkg, columns[i].type, sqlite3_column_text(stmt, icol));
-						break;
-					}
-				}
-				if (columns[i].name == NULL)
-					pkg_emit_error("Unknown column %s", colname);
+				if (i != -1)
+					pkg_set(pkg, columns[i].type, sqlite3_column_text(stmt, icol));
+				else
+					pkg_emit_error("Unknown column %s",
+					    sqlite3_column_name(stmt, icol));
 				break;
 			case SQLITE_INTEGER:
-				for (i = 0; columns[i].name != NULL; i++ ) {
-					if (!strcmp(columns[i].name, colname)) {
-						pkg_set(pkg, columns[i].type, sqlite3_column_int64(stmt, icol));
-						break;
-					}
-				}
-				if (columns[i].name == NULL)
-					pkg_emit_error("Unknown column %s", colname);
+				if (i != -1)
+					pkg_set(pkg, columns[i].type, sqlite3_column_int64(stmt, icol));
+				else
+					pkg_emit_error("Unknown column %s",
+					    sqlite3_column_name(stmt, icol));
 				break;
 			case SQLITE_BLOB:
 			case SQLITE_FLOAT:
-				pkg_emit_error("Wrong type for column: %s", colname);
+				pkg_emit_error("Wrong type for column: %s",
+				    sqlite3_column_name(stmt, icol));
 				/* just ignore currently */
 				break;
 			case SQLITE_NULL:
@@ -198,29 +403,63 @@ pkgdb_regex_delete(void *p)
 }
 
 static void
-pkgdb_pkgcmp(sqlite3_context *ctx, int argc, sqlite3_value **argv, int sign)
+pkgdb_version_key(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 {
-	const unsigned char *version1 = NULL;
-	const unsigned char *version2 = NULL;
-	if (argc != 2 || (version1 = sqlite3_value_text(argv[0])) == NULL
-			|| (version2 = sqlite3_value_text(argv[1])) == NULL) {
-		sqlite3_result_error(ctx, "Invalid comparison\n", -1);
+	const unsigned char *version = NULL;
+	struct sbuf *key;
+
+	if (argc != 1 || (version = sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_error(ctx, "Invalid version\n", -1);
 		return;
 	}
 
-	sqlite3_result_int(ctx, (pkg_version_cmp(version1, version2) == sign));
+	key = sbuf_new_auto();
+	if (pkg_version_key(version, key) != EPKG_OK)
+		sqlite3_result_error(ctx, "Invalid version\n", -1);
+	else
+		sqlite3_result_blob(ctx, sbuf_data(key), sbuf_len(key),
+		    SQLITE_TRANSIENT);
+	sbuf_delete(key);
 }
 
+/*
+ * Rank of a full text search match, from matchinfo() in its default "pcx"
+ * format: the hits of each phrase in each column of the row, relative to
+ * its hits in all the rows, weighted by column.
+ */
 static void
-pkgdb_pkglt(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+pkgdb_fts_rank(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 {
-	pkgdb_pkgcmp(ctx, argc, argv, -1);
-}
+	/* name, comment, desc */
+	static const double weights[] = { 4.0, 2.0, 1.0 };
+	const unsigned int *mi;
+	const unsigned int *hits;
+	unsigned int nphrases, ncols, i, j;
+	double rank = 0;
+
+	if (argc != 1 || (mi = sqlite3_value_blob(argv[0])) == NULL ||
+	    sqlite3_value_bytes(argv[0]) < (int)(2 * sizeof(*mi))) {
+		sqlite3_result_error(ctx, "Invalid matchinfo\n", -1);
+		return;
+	}
 
-static void
-pkgdb_pkggt(sqlite3_context *ctx, int argc, sqlite3_value **argv)
-{
-	pkgdb_pkgcmp(ctx, argc, argv, 1);
+	nphrases = mi[0];
+	ncols = mi[1];
+	if (ncols > 3 || sqlite3_value_bytes(argv[0]) !=
+	    (int)((2 + 3 * nphrases * ncols) * sizeof(*mi))) {
+		sqlite3_result_error(ctx, "Invalid matchinfo\n", -1);
+		return;
+	}
+
+	for (i = 0; i < nphrases; i++) {
+		for (j = 0; j < ncols; j++) {
+			hits = &mi[2 + 3 * (i * ncols + j)];
+			if (hits[1] > 0)
+				rank += weights[j] * hits[0] / hits[1];
+		}
+	}
+
+	sqlite3_result_double(ctx, rank);
 }
 
 static int
@@ -323,7 +562,8 @@ pkgdb_init(sqlite3 *sdb)
 		"flatsize INTEGER NOT NULL,"
 		"automatic INTEGER NOT NULL,"
 		"licenselogic INTEGER NOT NULL,"
-		"pkg_format_version INTEGER"
+		"pkg_format_version INTEGER,"
+		"vkey BLOB" /* pkg_version_key() of the version */
 	");"
 	"CREATE TABLE mtree ("
 		"id INTEGER PRIMARY KEY,"
@@ -413,8 +653,16 @@ pkgdb_init(sqlite3 *sdb)
 			" ON UPDATE RESTRICT,"
 		"UNIQUE(package_id, group_id)"
 	");"
-	"CREATE INDEX deporigini on deps(origin);"
-	"PRAGMA user_version = 8;"
+	"CREATE INDEX files_package ON files(package_id, path, sha256);"
+	"CREATE INDEX deps_origin ON deps(origin, package_id);"
+	"CREATE INDEX pkg_directories_directory ON pkg_directories(directory_id);"
+	"CREATE INDEX pkg_categories_category ON pkg_categories(category_id);"
+	"CREATE INDEX pkg_licenses_license ON pkg_licenses(license_id);"
+	"CREATE INDEX pkg_users_user ON pkg_users(user_id);"
+	"CREATE INDEX pkg_groups_group ON pkg_groups(group_id);"
+	"CREATE INDEX packages_mtree ON packages(mtree_id);"
+	"CREATE INDEX packages_vkey ON packages(origin, vkey);"
+	"PRAGMA user_version = 10;"
 	"COMMIT;"
 	;
 
@@ -448,6 +696,7 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	}
 
 	db->type = type;
+	TAILQ_INIT(&db->repos);
 
 	snprintf(localpath, sizeof(localpath), "%s/local.sqlite", dbdir);
 
@@ -483,19 +732,20 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	if (eaccess(localpath, W_OK) == 0)
 		db->writable = 1;
 
-	if (pkgdb_upgrade(db) != EPKG_OK) {
-		pkgdb_close(db);
-		return (EPKG_FATAL);
-	}
-
 	sqlite3_create_function(db->sqlite, "regexp", 2, SQLITE_ANY, NULL,
 							pkgdb_regex_basic, NULL, NULL);
 	sqlite3_create_function(db->sqlite, "eregexp", 2, SQLITE_ANY, NULL,
 							pkgdb_regex_extended, NULL, NULL);
-	sqlite3_create_function(db->sqlite, "pkglt", 2, SQLITE_ANY, NULL,
-			pkgdb_pkglt, NULL, NULL);
-	sqlite3_create_function(db->sqlite, "pkggt", 2, SQLITE_ANY, NULL,
-			pkgdb_pkggt, NULL, NULL);
+	/* needed by the upgrade to version 10 */
+	sqlite3_create_function(db->sqlite, "version_key", 1, SQLITE_ANY, NULL,
+			pkgdb_version_key, NULL, NULL);
+	sqlite3_create_function(db->sqlite, "fts_rank", 1, SQLITE_ANY, NULL,
+			pkgdb_fts_rank, NULL, NULL);
+
+	if (pkgdb_upgrade(db) != EPKG_OK) {
+		pkgdb_close(db);
+		return (EPKG_FATAL);
+	}
 
 	/*
 	 * allow foreign key option which will allow to have clean support for
@@ -506,6 +756,11 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 		return (EPKG_FATAL);
 	}
 
+	if (pkgdb_set_profile(db) != EPKG_OK) {
+		pkgdb_close(db);
+		return (EPKG_FATAL);
+	}
+
 	if (type == PKGDB_REMOTE) {
 		pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
@@ -515,42 +770,18 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 			fprintf(stderr, "\t/!\\  THIS FEATURE IS STILL CONSIDERED EXPERIMENTAL	/!\\\n");
 			fprintf(stderr, "\t/!\\		     YOU HAVE BEEN WARNED		/!\\\n\n");
 
+			/* the catalogues are attached on first use */
 			while (pkg_config_list(PKG_CONFIG_REPOS, &repokv) == EPKG_OK) {
 				repo_name = pkg_config_kv_get(repokv, PKG_CONFIG_KV_KEY);
+				if (strcmp(repo_name, "default") == 0)
+					break;
+			}
 
-				/* is it a reserved name? */
-				if ((strcmp(repo_name, "repo") == 0) ||
-				    (strcmp(repo_name, "main") == 0) ||
-				    (strcmp(repo_name, "temp") == 0) ||
-				    (strcmp(repo_name, "local") == 0))
-					continue;
-
-				/* is it already attached? */
-				if (is_attached(db->sqlite, repo_name)) {
-					pkg_emit_error("repository '%s' is already listed, ignoring", repo_name);
-					continue;
-				}
-
-				snprintf(remotepath, sizeof(remotepath), "%s/%s.sqlite",
-						dbdir, repo_name);
-
-				if (access(remotepath, R_OK) != 0) {
-					pkg_emit_errno("access", remotepath);
-					pkgdb_close(db);
-					return (EPKG_FATAL);
-				}
-				
-				if (sql_exec(db->sqlite, "ATTACH '%q' AS '%q';", remotepath, repo_name) != EPKG_OK) {
-					pkgdb_close(db);
-					return (EPKG_FATAL);
-				}
-
-				/* check if default repository exists */
-				if (!is_attached(db->sqlite, "default")) {
-					pkg_emit_error("no default repository defined");
-					pkgdb_close(db);
-					return (EPKG_FATAL);
-				}
+			/* check if default repository exists */
+			if (repokv == NULL) {
+				pkg_emit_error("no default repository defined");
+				pkgdb_close(db);
+				return (EPKG_FATAL);
 			}
 		} else {
 			/*
@@ -565,7 +796,8 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 				return (EPKG_FATAL);
 			}
 			
-			if (sql_exec(db->sqlite, "ATTACH '%q' AS 'remote';", remotepath) != EPKG_OK) {
+			if (sql_exec(db->sqlite, "ATTACH '%q' AS 'remote';", remotepath) != EPKG_OK ||
+			    pkgdb_repo_add(db, "remote") != EPKG_OK) {
 				pkgdb_close(db);
 				return (EPKG_FATAL);
 			}
@@ -576,13 +808,92 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	return (EPKG_OK);
 }
 
+/*
+ * Switch the journal mode only when it differs: the switch needs the
+ * database to itself, so while another process reads it the current mode
+ * is kept and the switch is tried again on the next open.
+ */
+static int
+pkgdb_set_journal(sqlite3 *s, const char *journal)
+{
+	sqlite3_stmt *stmt;
+	char *sql, *errmsg;
+	int ret;
+
+	if (sqlite3_prepare_v2(s, "PRAGMA main.journal_mode;", -1, &stmt,
+	    NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		return (EPKG_FATAL);
+	}
+
+	if ((ret = sqlite3_step(stmt)) != SQLITE_ROW) {
+		ERROR_SQLITE(s);
+		sqlite3_finalize(stmt);
+		return (EPKG_FATAL);
+	}
+
+	ret = strcasecmp(sqlite3_column_text(stmt, 0), journal);
+	sqlite3_finalize(stmt);
+	if (ret == 0)
+		return (EPKG_OK);
+
+	sql = sqlite3_mprintf("PRAGMA main.journal_mode = %s;", journal);
+	ret = sqlite3_exec(s, sql, NULL, NULL, &errmsg);
+	sqlite3_free(sql);
+
+	if (ret == SQLITE_OK)
+		return (EPKG_OK);
+
+	if (ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
+		pkg_emit_error("sqlite: %s", errmsg);
+		sqlite3_free(errmsg);
+		return (EPKG_FATAL);
+	}
+
+	sqlite3_free(errmsg);
+	return (EPKG_OK);
+}
+
+static int
+pkgdb_set_profile(struct pkgdb *db)
+{
+	struct db_profile *p;
+	const char *profile = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_DBPROFILE, &profile) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (p = db_profiles; p->name != NULL; p++) {
+		if (strcasecmp(p->name, profile) == 0)
+			break;
+	}
+
+	if (p->name == NULL) {
+		pkg_emit_error("unknown PKG_DBPROFILE '%s'", profile);
+		return (EPKG_FATAL);
+	}
+
+	/* the journal mode is stored in the database, only root can change it */
+	if (db->writable == 1 &&
+	    pkgdb_set_journal(db->sqlite, p->journal) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (sql_exec(db->sqlite, "PRAGMA main.synchronous = %s;"
+	    "PRAGMA main.cache_size = %d;",
+	    p->synchronous, p->cache_size));
+}
+
 void
 pkgdb_close(struct pkgdb *db)
 {
+	struct pkgdb_repo *r;
+
 	if (db == NULL)
 		return;
 
 	if (db->sqlite != NULL) {
+		pkgdb_stmt_flush(db);
+
 		if (db->type == PKGDB_REMOTE) {
 			pkgdb_detach_remotes(db->sqlite);
 		}
@@ -590,6 +901,13 @@ pkgdb_close(struct pkgdb *db)
 		sqlite3_close(db->sqlite);
 	}
 
+	while (!TAILQ_EMPTY(&db->repos)) {
+		r = TAILQ_FIRST(&db->repos);
+		TAILQ_REMOVE(&db->repos, r, next);
+		free(r->name);
+		free(r);
+	}
+
 	sqlite3_shutdown();
 	free(db);
 }
@@ -610,9 +928,176 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type)
 	it->db = db;
 	it->stmt = s;
 	it->type = type;
+	it->filter = NULL;
+	it->pattern = NULL;
+	it->prefetched = 0;
+	it->ncols = 0;
+	it->colmap = NULL;
+	memset(it->relations, 0, sizeof(it->relations));
+
+	/* not pkgdb_it_free(): the job tables belong to the caller */
+	if (map_columns(it) != EPKG_OK) {
+		sqlite3_finalize(s);
+		free(it);
+		return (NULL);
+	}
+
 	return (it);
 }
 
+static void
+load_group_gidstr(struct pkg *pkg)
+{
+	struct pkg_group *g = NULL;
+	struct group *grp = NULL;
+
+	while (pkg_groups(pkg, &g) == EPKG_OK) {
+		grp = getgrnam(pkg_group_name(g));
+		if (grp == NULL)
+			continue;
+		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
+	}
+}
+
+/*
+ * Start one ordered scan per requested relation, instead of running one
+ * query per package and per relation.
+ */
+static int
+pkgdb_it_prefetch(struct pkgdb_it *it, int flags)
+{
+	struct sbuf *sql = sbuf_new_auto();
+	struct sbuf *cond = sbuf_new_auto();
+	sqlite3_stmt *stmt;
+	int i, ret;
+
+	if (it->filter[0] != '\0')
+		sbuf_printf(cond, " AND (%s)", it->filter);
+	sbuf_finish(cond);
+
+	for (i = 0; i < PKGDB_IT_NRELATIONS; i++) {
+		if ((flags & relations[i].flag) == 0)
+			continue;
+
+		sbuf_clear(sql);
+		sbuf_printf(sql, relations[i].sql, sbuf_get(cond));
+		sbuf_finish(sql);
+
+		if (sqlite3_prepare_v2(it->db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(it->db->sqlite);
+			sbuf_delete(sql);
+			sbuf_delete(cond);
+			return (EPKG_FATAL);
+		}
+
+		if (it->pattern != NULL)
+			sqlite3_bind_text(stmt, 1, it->pattern, -1, SQLITE_STATIC);
+
+		it->prefetched |= relations[i].flag;
+
+		if ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+			it->relations[i] = stmt;
+			continue;
+		}
+
+		sqlite3_finalize(stmt);
+		if (ret != SQLITE_DONE) {
+			ERROR_SQLITE(it->db->sqlite);
+			sbuf_delete(sql);
+			sbuf_delete(cond);
+			return (EPKG_FATAL);
+		}
+	}
+
+	sbuf_delete(sql);
+	sbuf_delete(cond);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Move the rows of the prefetched relations which belong to pkg into it.
+ * A scan is finalized as soon as it is exhausted.
+ */
+static int
+pkgdb_it_merge(struct pkgdb_it *it, struct pkg *pkg, int flags)
+{
+	sqlite3_stmt *s;
+	int i, ret;
+
+	for (i = 0; i < PKGDB_IT_NRELATIONS; i++) {
+		if ((it->prefetched & relations[i].flag) == 0)
+			continue;
+
+		while ((s = it->relations[i]) != NULL &&
+		    sqlite3_column_int64(s, 0) == pkg->rowid) {
+			if (flags & relations[i].flag) {
+				switch (relations[i].flag) {
+				case PKG_LOAD_DEPS:
+					pkg_adddep(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_text(s, 2),
+					    sqlite3_column_text(s, 3));
+					break;
+				case PKG_LOAD_RDEPS:
+					pkg_addrdep(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_text(s, 2),
+					    sqlite3_column_text(s, 3));
+					break;
+				case PKG_LOAD_FILES:
+					pkg_addfile(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_text(s, 2));
+					break;
+				case PKG_LOAD_DIRS:
+					pkg_adddir(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_int(s, 2));
+					break;
+				case PKG_LOAD_SCRIPTS:
+					pkg_addscript(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_int(s, 2));
+					break;
+				case PKG_LOAD_OPTIONS:
+					pkg_addoption(pkg, sqlite3_column_text(s, 1),
+					    sqlite3_column_text(s, 2));
+					break;
+				case PKG_LOAD_MTREE:
+					pkg_set_mtree(pkg, sqlite3_column_text(s, 1));
+					break;
+				case PKG_LOAD_CATEGORIES:
+					pkg_addcategory(pkg, sqlite3_column_text(s, 1));
+					break;
+				case PKG_LOAD_LICENSES:
+					pkg_addlicense(pkg, sqlite3_column_text(s, 1));
+					break;
+				case PKG_LOAD_USERS:
+					pkg_adduser(pkg, sqlite3_column_text(s, 1));
+					break;
+				case PKG_LOAD_GROUPS:
+					pkg_addgroup(pkg, sqlite3_column_text(s, 1));
+					break;
+				}
+			}
+
+			if ((ret = sqlite3_step(s)) == SQLITE_ROW)
+				continue;
+
+			sqlite3_finalize(s);
+			it->relations[i] = NULL;
+			if (ret != SQLITE_DONE) {
+				ERROR_SQLITE(it->db->sqlite);
+				return (EPKG_FATAL);
+			}
+		}
+
+		if (flags & relations[i].flag) {
+			if (relations[i].flag == PKG_LOAD_GROUPS)
+				load_group_gidstr(pkg);
+			pkg->flags |= relations[i].flag;
+		}
+	}
+
+	return (EPKG_OK);
+}
+
 
 int
 pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
@@ -630,7 +1115,16 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 			pkg_reset(*pkg_p, it->type);
 		pkg = *pkg_p;
 
-		populate_pkg(it->stmt, pkg);
+		populate_pkg(it, pkg);
+
+		if (it->filter != NULL && it->prefetched == 0 &&
+		    flags != PKG_LOAD_BASIC)
+			if ((ret = pkgdb_it_prefetch(it, flags)) != EPKG_OK)
+				return (ret);
+
+		if (it->prefetched != 0)
+			if ((ret = pkgdb_it_merge(it, pkg, flags)) != EPKG_OK)
+				return (ret);
 
 		if (flags & PKG_LOAD_DEPS)
 			if ((ret = pkgdb_load_deps(it->db, pkg)) != EPKG_OK)
@@ -688,16 +1182,25 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 void
 pkgdb_it_free(struct pkgdb_it *it)
 {
+	int i;
+
 	if (it == NULL)
 		return;
 
+	sqlite3_finalize(it->stmt);
+	for (i = 0; i < PKGDB_IT_NRELATIONS; i++) {
+		if (it->relations[i] != NULL)
+			sqlite3_finalize(it->relations[i]);
+	}
+
 	if (it->db->writable == 1) {
 		sql_exec(it->db->sqlite, "DROP TABLE IF EXISTS autoremove; "
 			"DROP TABLE IF EXISTS delete_job; "
 			"DROP TABLE IF EXISTS pkgjobs");
 	}
-
-	sqlite3_finalize(it->stmt);
+	free(it->colmap);
+	free(it->filter);
+	free(it->pattern);
 	free(it);
 }
 
@@ -706,6 +1209,7 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 {
 	char sql[BUFSIZ];
 	sqlite3_stmt *stmt;
+	struct pkgdb_it *it;
 	const char *comp = NULL;
 	char *checkorigin = NULL;
 
@@ -721,31 +1225,31 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 		break;
 	case MATCH_EXACT:
 		if (checkorigin == NULL)
-			comp = " WHERE name = ?1 "
-				"OR name || \"-\" || version = ?1";
+			comp = "p.name = ?1 "
+				"OR p.name || \"-\" || p.version = ?1";
 		else
-			comp = " WHERE origin = ?1";
+			comp = "p.origin = ?1";
 		break;
 	case MATCH_GLOB:
 		if (checkorigin == NULL)
-			comp = " WHERE name GLOB ?1 "
-				"OR name || \"-\" || version GLOB ?1";
+			comp = "p.name GLOB ?1 "
+				"OR p.name || \"-\" || p.version GLOB ?1";
 		else
-			comp = " WHERE origin GLOB ?1";
+			comp = "p.origin GLOB ?1";
 		break;
 	case MATCH_REGEX:
 		if (checkorigin == NULL)
-			comp = " WHERE name REGEXP ?1 "
-				"OR name || \"-\" || version REGEXP ?1";
+			comp = "p.name REGEXP ?1 "
+				"OR p.name || \"-\" || p.version REGEXP ?1";
 		else
-			comp = " WHERE origin REGEXP ?1";
+			comp = "p.origin REGEXP ?1";
 		break;
 	case MATCH_EREGEX:
 		if (checkorigin == NULL)
-			comp = " WHERE EREGEXP(?1, name) "
-				"OR EREGEXP(?1, name || \"-\" || version)";
+			comp = "EREGEXP(?1, p.name) "
+				"OR EREGEXP(?1, p.name || \"-\" || p.version)";
 		else
-			comp = " WHERE EREGEXP(?1, origin)";
+			comp = "EREGEXP(?1, p.origin)";
 		break;
 	}
 
@@ -753,8 +1257,9 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 			"SELECT id, origin, name, version, comment, desc, "
 				"message, arch, osversion, maintainer, www, "
 				"prefix, flatsize, licenselogic, automatic "
-			"FROM packages AS p%s "
-			"ORDER BY p.name;", comp);
+			"FROM packages AS p%s%s "
+			"ORDER BY p.name, p.id;",
+			comp[0] != '\0' ? " WHERE " : "", comp);
 
 	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -764,7 +1269,15 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 	if (match != MATCH_ALL)
 		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
 
-	return (pkgdb_it_new(db, stmt, PKG_INSTALLED));
+	if ((it = pkgdb_it_new(db, stmt, PKG_INSTALLED)) == NULL)
+		return (NULL);
+
+	/* keep the filter around to prefetch the relations */
+	it->filter = strdup(comp);
+	if (match != MATCH_ALL)
+		it->pattern = strdup(pattern);
+
+	return (it);
 }
 
 struct pkgdb_it *
@@ -803,10 +1316,8 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 
 	assert(db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_TRANSIENT);
 
@@ -815,7 +1326,7 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	if (ret == SQLITE_ROW)
 		*res = sqlite3_column_int64(stmt, 0);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_ROW) {
 		ERROR_SQLITE(db->sqlite);
@@ -843,18 +1354,18 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 
 	pkg_get(pkg, PKG_REPONAME, &reponame);
 
-	if (pkg->type == PKG_REMOTE)
-		snprintf(sql, sizeof(sql), basesql, reponame);
-	else
-		snprintf(sql, sizeof(sql), basesql, "main");
-
 	if (pkg->flags & PKG_LOAD_DEPS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if (pkg->type == PKG_REMOTE) {
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (EPKG_FATAL);
+		snprintf(sql, sizeof(sql), basesql, reponame);
+	} else
+		snprintf(sql, sizeof(sql), basesql, "main");
+
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -862,7 +1373,7 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 		pkg_adddep(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
 				   sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
@@ -892,10 +1403,8 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_RDEPS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ORIGIN, &origin);
 	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
@@ -904,7 +1413,7 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 		pkg_addrdep(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
 				   sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -933,17 +1442,15 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_FILES)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
 		pkg_addfile(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -972,10 +1479,8 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_DIRS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -983,7 +1488,7 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		pkg_adddir(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
 	}
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(db->sqlite);
@@ -1011,11 +1516,13 @@ pkgdb_load_license(struct pkgdb *db, struct pkg *pkg)
 
 	if (pkg->type == PKG_REMOTE) {
 		pkg_get(pkg, PKG_REPONAME, &reponame);
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (EPKG_FATAL);
 		snprintf(sql, sizeof(sql), basesql, reponame, reponame);
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_LICENSES, pkg_addlicense, PKG_LICENSES));
+	return (load_val(db, pkg, sql, PKG_LOAD_LICENSES, pkg_addlicense, PKG_LICENSES));
 }
 
 int
@@ -1034,11 +1541,13 @@ pkgdb_load_category(struct pkgdb *db, struct pkg *pkg)
 
 	if (pkg->type == PKG_REMOTE) {
 		pkg_get(pkg, PKG_REPONAME, &reponame);
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (EPKG_FATAL);
 		snprintf(sql, sizeof(sql), basesql, reponame, reponame);
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CATEGORIES, pkg_addcategory, PKG_CATEGORIES));
+	return (load_val(db, pkg, sql, PKG_LOAD_CATEGORIES, pkg_addcategory, PKG_CATEGORIES));
 }
 
 int
@@ -1057,7 +1566,7 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 
 	assert(db != NULL && pkg != NULL);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_USERS, pkg_adduser, PKG_USERS);
+	ret = load_val(db, pkg, sql, PKG_LOAD_USERS, pkg_adduser, PKG_USERS);
 
 	/* TODO get user uidstr from local database */
 /*	while (pkg_users(pkg, &u) == EPKG_OK) {
@@ -1073,8 +1582,6 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 int
 pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 {
-	struct pkg_group *g = NULL;
-	struct group * grp = NULL;
 	int ret;
 
 	const char sql[] = ""
@@ -1086,14 +1593,8 @@ pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 
 	assert(db != NULL && pkg != NULL);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_GROUPS, pkg_addgroup, PKG_GROUPS);
-
-	while (pkg_groups(pkg, &g) == EPKG_OK) {
-		grp = getgrnam(pkg_group_name(g));
-		if (grp == NULL)
-			continue;
-		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
-	}
+	ret = load_val(db, pkg, sql, PKG_LOAD_GROUPS, pkg_addgroup, PKG_GROUPS);
+	load_group_gidstr(pkg);
 
 	return (ret);
 }
@@ -1114,17 +1615,15 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_SCRIPTS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_SCRIPTS);
@@ -1155,15 +1654,15 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 
 	if (pkg->type == PKG_REMOTE) {
 		pkg_get(pkg, PKG_REPONAME, &reponame);
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (EPKG_FATAL);
 		snprintf(sql, sizeof(sql), basesql, reponame);
 	} else {
 		snprintf(sql, sizeof(sql), basesql, "main");
 	}
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1171,7 +1670,7 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		pkg_addoption(pkg, sqlite3_column_text(stmt, 0),
 					  sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_OPTIONS);
@@ -1195,7 +1694,7 @@ pkgdb_load_mtree(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
+	return (load_val(db, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
 }
 
 int
@@ -1242,9 +1741,9 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 		"INSERT OR REPLACE INTO packages( "
 			"origin, name, version, comment, desc, message, arch, "
 			"osversion, maintainer, www, prefix, flatsize, automatic, licenselogic, "
-			"mtree_id) "
+			"mtree_id, vkey) "
 		"VALUES( ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, "
-		"(SELECT id from mtree where content = ?15));";
+		"(SELECT id from mtree where content = ?15), version_key(?3));";
 	const char sql_dep[] = ""
 		"INSERT OR ROLLBACK INTO deps (origin, name, version, package_id) "
 		"VALUES (?1, ?2, ?3, ?4);";
@@ -1294,10 +1793,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 		return (EPKG_FATAL);
 
 	/* insert mtree record if any */
-	if (sqlite3_prepare_v2(s, sql_mtree, -1, &stmt_mtree, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_mtree = pkgdb_stmt_get(db, sql_mtree)) == NULL)
 		goto cleanup;
-	}
 
 	pkg_get(pkg, PKG_MTREE, &mtree, PKG_ORIGIN, &origin, PKG_VERSION, &version,
 	    PKG_COMMENT, &comment, PKG_DESC, &desc, PKG_MESSAGE, &message,
@@ -1314,10 +1811,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	}
 
 	/* Insert package record */
-	if (sqlite3_prepare_v2(s, sql_pkg, -1, &stmt_pkg, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_pkg = pkgdb_stmt_get(db, sql_pkg)) == NULL)
 		goto cleanup;
-	}
 	sqlite3_bind_text(stmt_pkg, 1, origin, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt_pkg, 2, name, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt_pkg, 3, version, -1, SQLITE_STATIC);
@@ -1345,11 +1840,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert dependencies list
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_dep, -1, &stmt_dep, NULL) != SQLITE_OK) {
-
-		ERROR_SQLITE(s);
+	if ((stmt_dep = pkgdb_stmt_get(db, sql_dep)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_deps(pkg, &dep) == EPKG_OK) {
 		sqlite3_bind_text(stmt_dep, 1, pkg_dep_get(dep, PKG_DEP_ORIGIN), -1, SQLITE_STATIC);
@@ -1368,10 +1860,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert files.
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_file, -1, &stmt_file, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_file = pkgdb_stmt_get(db, sql_file)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_files(pkg, &file) == EPKG_OK) {
 		sqlite3_bind_text(stmt_file, 1, pkg_file_get(file, PKG_FILE_PATH), -1, SQLITE_STATIC);
@@ -1407,15 +1897,11 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert dirs.
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_dirs, -1, &stmt_dirs, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_dirs = pkgdb_stmt_get(db, sql_dirs)) == NULL)
 		goto cleanup;
-	}
 
-	if (sqlite3_prepare_v2(s, sql_dir, -1, &stmt_dir, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_dir = pkgdb_stmt_get(db, sql_dir)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_dirs(pkg, &dir) == EPKG_OK) {
 		sqlite3_bind_text(stmt_dirs, 1, pkg_dir_path(dir), -1, SQLITE_STATIC);
@@ -1443,14 +1929,10 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert categories
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_category, -1, &stmt_cat, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_cat = pkgdb_stmt_get(db, sql_category)) == NULL)
 		goto cleanup;
-	}
-	if (sqlite3_prepare_v2(s, sql_cat, -1, &stmt_categories, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_categories = pkgdb_stmt_get(db, sql_cat)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_categories(pkg, &category) == EPKG_OK) {
 		sqlite3_bind_text(stmt_categories, 1, pkg_category_name(category), -1, SQLITE_STATIC);
@@ -1476,14 +1958,10 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	/*
 	 * Insert licenses
 	 */
-	if (sqlite3_prepare_v2(s, sql_lic, -1, &stmt_licenses, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_licenses = pkgdb_stmt_get(db, sql_lic)) == NULL)
 		goto cleanup;
-	}
-	if (sqlite3_prepare_v2(s, sql_license, -1, &stmt_lic, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_lic = pkgdb_stmt_get(db, sql_license)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_licenses(pkg, &license) == EPKG_OK) {
 		sqlite3_bind_text(stmt_licenses, 1, pkg_license_name(license), -1, SQLITE_STATIC);
@@ -1509,14 +1987,10 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	/*
 	 * Insert users
 	 */
-	if (sqlite3_prepare_v2(s, sql_user, -1, &stmt_user, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_user = pkgdb_stmt_get(db, sql_user)) == NULL)
 		goto cleanup;
-	}
-	if (sqlite3_prepare_v2(s, sql_users, -1, &stmt_users, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_users = pkgdb_stmt_get(db, sql_users)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_users(pkg, &user) == EPKG_OK) {
 		sqlite3_bind_text(stmt_user, 1, pkg_user_name(user), -1, SQLITE_STATIC);
@@ -1542,14 +2016,10 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	/*
 	 * Insert groups
 	 */
-	if (sqlite3_prepare_v2(s, sql_group, -1, &stmt_group, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_group = pkgdb_stmt_get(db, sql_group)) == NULL)
 		goto cleanup;
-	}
-	if (sqlite3_prepare_v2(s, sql_groups, -1, &stmt_groups, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_groups = pkgdb_stmt_get(db, sql_groups)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_groups(pkg, &group) == EPKG_OK) {
 		sqlite3_bind_text(stmt_group, 1, pkg_group_name(group), -1, SQLITE_STATIC);
@@ -1576,10 +2046,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert scripts
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_script, -1, &stmt_script, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_script = pkgdb_stmt_get(db, sql_script)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_scripts(pkg, &script) == EPKG_OK) {
 		sqlite3_bind_text(stmt_script, 1, pkg_script_data(script), -1, SQLITE_STATIC);
@@ -1597,10 +2065,8 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	 * Insert options
 	 */
 
-	if (sqlite3_prepare_v2(s, sql_option, -1, &stmt_option, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
+	if ((stmt_option = pkgdb_stmt_get(db, sql_option)) == NULL)
 		goto cleanup;
-	}
 
 	while (pkg_options(pkg, &option) == EPKG_OK) {
 		sqlite3_bind_text(stmt_option, 1, pkg_option_opt(option), -1, SQLITE_STATIC);
@@ -1619,46 +2085,52 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	cleanup:
 
 	if (stmt_mtree != NULL)
-		sqlite3_finalize(stmt_mtree);
+		sqlite3_reset(stmt_mtree);
 
 	if (stmt_pkg != NULL)
-		sqlite3_finalize(stmt_pkg);
+		sqlite3_reset(stmt_pkg);
 
 	if (stmt_dep != NULL)
-		sqlite3_finalize(stmt_dep);
+		sqlite3_reset(stmt_dep);
 
 	if (stmt_file != NULL)
-		sqlite3_finalize(stmt_file);
+		sqlite3_reset(stmt_file);
 
 	if (stmt_script != NULL)
-		sqlite3_finalize(stmt_script);
+		sqlite3_reset(stmt_script);
 
 	if (stmt_option != NULL)
-		sqlite3_finalize(stmt_option);
-	
+		sqlite3_reset(stmt_option);
+
 	if (stmt_dirs != NULL)
-		sqlite3_finalize(stmt_dirs);
+		sqlite3_reset(stmt_dirs);
 
 	if (stmt_dir != NULL)
-		sqlite3_finalize(stmt_dir);
+		sqlite3_reset(stmt_dir);
 
 	if (stmt_cat != NULL)
-		sqlite3_finalize(stmt_cat);
+		sqlite3_reset(stmt_cat);
 
 	if (stmt_categories != NULL)
-		sqlite3_finalize(stmt_categories);
+		sqlite3_reset(stmt_categories);
 
 	if (stmt_lic != NULL)
-		sqlite3_finalize(stmt_lic);
+		sqlite3_reset(stmt_lic);
 
 	if (stmt_licenses != NULL)
-		sqlite3_finalize(stmt_licenses);
+		sqlite3_reset(stmt_licenses);
 
-	if (stmt_groups != NULL)
-		sqlite3_finalize(stmt_groups);
+	if (stmt_user != NULL)
+		sqlite3_reset(stmt_user);
 
 	if (stmt_users != NULL)
-		sqlite3_finalize(stmt_users);
+		sqlite3_reset(stmt_users);
+
+	if (stmt_group != NULL)
+		sqlite3_reset(stmt_group);
+
+	if (stmt_groups != NULL)
+		sqlite3_reset(stmt_groups);
 
 	return (retcode);
 }
@@ -1687,15 +2159,13 @@ pkgdb_unregister_pkg(struct pkgdb *db, const char *origin)
 	assert(db != NULL);
 	assert(origin != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt_del, NULL) != SQLITE_OK){
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt_del = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt_del, 1, origin, -1, SQLITE_STATIC);
 
 	ret = sqlite3_step(stmt_del);
-	sqlite3_finalize(stmt_del);
+	sqlite3_reset(stmt_del);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
@@ -1755,37 +2225,140 @@ sql_exec(sqlite3 *s, const char *sql, ...)
 
 	ret = EPKG_OK;
 
-	cleanup:
-	if (sqlbuf != NULL)
-		free(sqlbuf);
+	cleanup:
+	if (sqlbuf != NULL)
+		free(sqlbuf);
+
+	return (ret);
+}
+
+static bool
+is_reserved_repo(const char *name)
+{
+	return (strcmp(name, "repo") == 0 ||
+	    strcmp(name, "main") == 0 ||
+	    strcmp(name, "temp") == 0 ||
+	    strcmp(name, "local") == 0);
+}
+
+static int
+pkgdb_repo_add(struct pkgdb *db, const char *name)
+{
+	struct pkgdb_repo *r;
+
+	if ((r = calloc(1, sizeof(struct pkgdb_repo))) == NULL ||
+	    (r->name = strdup(name)) == NULL) {
+		free(r);
+		pkg_emit_errno("malloc", "pkgdb_repo");
+		return (EPKG_FATAL);
+	}
+
+	TAILQ_INSERT_HEAD(&db->repos, r, next);
+	db->nrepos++;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Attach the catalogue of a repository on first use.  When too many are
+ * attached, the least recently used one which is not being read is
+ * detached.
+ */
+int
+pkgdb_repo_attach(struct pkgdb *db, const char *name)
+{
+	struct pkgdb_repo *r;
+	struct pkg_config_kv *repokv = NULL;
+	struct sbuf *sql;
+	char remotepath[MAXPATHLEN + 1];
+	const char *dbdir = NULL;
+
+	assert(db != NULL && name != NULL);
+
+	TAILQ_FOREACH(r, &db->repos, next) {
+		if (strcmp(r->name, name) == 0) {
+			TAILQ_REMOVE(&db->repos, r, next);
+			TAILQ_INSERT_HEAD(&db->repos, r, next);
+			return (EPKG_OK);
+		}
+	}
+
+	while (pkg_config_list(PKG_CONFIG_REPOS, &repokv) == EPKG_OK) {
+		if (strcmp(name, pkg_config_kv_get(repokv, PKG_CONFIG_KV_KEY)) == 0)
+			break;
+	}
+
+	if (repokv == NULL || is_reserved_repo(name)) {
+		pkg_emit_error("repository '%s' does not exists", name);
+		return (EPKG_FATAL);
+	}
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(remotepath, sizeof(remotepath), "%s/%s.sqlite", dbdir, name);
+
+	if (access(remotepath, R_OK) != 0) {
+		pkg_emit_errno("access", remotepath);
+		return (EPKG_FATAL);
+	}
+
+	/* past the limit of sqlite, the least recently used one makes room */
+	if (db->nrepos >= sqlite3_limit(db->sqlite, SQLITE_LIMIT_ATTACHED, -1)) {
+		sql = sbuf_new_auto();
+		TAILQ_FOREACH_REVERSE(r, &db->repos, pkgdb_repos, next) {
+			sbuf_clear(sql);
+			sbuf_printf(sql, "DETACH '%s';", r->name);
+			sbuf_finish(sql);
+			/* fails if a statement still reads it */
+			if (sqlite3_exec(db->sqlite, sbuf_get(sql), NULL, NULL,
+			    NULL) == SQLITE_OK)
+				break;
+		}
+		sbuf_delete(sql);
+
+		if (r == NULL) {
+			pkg_emit_error("too many repositories in use to attach '%s'",
+			    name);
+			return (EPKG_FATAL);
+		}
+
+		TAILQ_REMOVE(&db->repos, r, next);
+		db->nrepos--;
+		free(r->name);
+		free(r);
+	}
+
+	if (sql_exec(db->sqlite, "ATTACH '%q' AS '%q';", remotepath, name) != EPKG_OK)
+		return (EPKG_FATAL);
 
-	return (ret);
+	return (pkgdb_repo_add(db, name));
 }
 
-static bool
-is_attached(sqlite3 *s, const char *name)
+static int
+pkgdb_repo_attach_all(struct pkgdb *db)
 {
-	sqlite3_stmt *stmt;
-	const char *dbname;
-
-	assert(s != NULL);
+	struct pkg_config_kv *repokv = NULL;
+	const char *name;
+	int nrepos = 0, max;
 
-	if (sqlite3_prepare_v2(s, "PRAGMA database_list;", -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(s);
-		return false;
-	}
+	max = sqlite3_limit(db->sqlite, SQLITE_LIMIT_ATTACHED, -1);
+	while (pkg_config_list(PKG_CONFIG_REPOS, &repokv) == EPKG_OK) {
+		name = pkg_config_kv_get(repokv, PKG_CONFIG_KV_KEY);
+		if (is_reserved_repo(name))
+			continue;
 
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		dbname = sqlite3_column_text(stmt, 1);
-		if (!strcmp(dbname, name)) {
-			sqlite3_finalize(stmt);
-			return (true);
+		if (++nrepos > max) {
+			pkg_emit_error("more than %d repositories, choose one",
+			    max);
+			return (EPKG_FATAL);
 		}
-	}
 
-	sqlite3_finalize(stmt);
+		if (pkgdb_repo_attach(db, name) != EPKG_OK)
+			return (EPKG_FATAL);
+	}
 
-	return (false);
+	return (EPKG_OK);
 }
 
 static int
@@ -1918,7 +2491,234 @@ create_temporary_pkgjobs(sqlite3 *s)
 			"arch TEXT, osversion TEXT, maintainer TEXT, "
 			"www TEXT, prefix TEXT, flatsize INTEGER, newversion TEXT, "
 			"newflatsize INTEGER, pkgsize INTEGER, cksum TEXT, repopath TEXT, automatic INTEGER, "
-			"dbname TEXT);");
+			"dbname TEXT, vkey BLOB);");
+
+	return (ret);
+}
+
+static int64_t
+pkgdb_repo_version(struct pkgdb *db, const char *reponame)
+{
+	struct sbuf *sql = sbuf_new_auto();
+	int64_t version = 0;
+
+	sbuf_printf(sql, "PRAGMA '%s'.user_version;", reponame);
+	sbuf_finish(sql);
+	get_pragma(db->sqlite, sbuf_get(sql), &version);
+	sbuf_delete(sql);
+
+	return (version);
+}
+
+/*
+ * Repository catalogues store the version keys since their version 3,
+ * compute them for the older ones.  The packages table is aliased r.
+ */
+static const char *
+pkgdb_repo_vkey(struct pkgdb *db, const char *reponame)
+{
+	return (pkgdb_repo_version(db, reponame) >= 3 ?
+	    "r.vkey" : "version_key(r.version)");
+}
+
+/*
+ * A repository package in the dependency graph; the dependencies of
+ * nodes[i] are edges[nodes[i].edges] up to edges[nodes[i + 1].edges].
+ */
+struct closure_node {
+	int64_t id;
+	int edges;
+	bool skip;	/* same version already installed */
+	bool queued;
+};
+
+static int
+closure_node_cmp(const void *key, const void *node)
+{
+	int64_t id = *(const int64_t *)key;
+	const struct closure_node *n = node;
+
+	return ((id > n->id) - (id < n->id));
+}
+
+static struct closure_node *
+closure_node_find(struct closure_node *nodes, int nnodes, int64_t id)
+{
+	return (bsearch(&id, nodes, nnodes, sizeof(struct closure_node),
+	    closure_node_cmp));
+}
+
+/*
+ * Add to pkgjobs every package of the repository needed by the packages
+ * already in it.  The dependency graph of the repository is loaded once
+ * into adjacency arrays and walked breadth first; packages installed in
+ * the same version are neither added nor followed.
+ */
+static int
+pkgdb_jobs_closure(struct pkgdb *db, const char *reponame)
+{
+	struct closure_node *nodes = NULL, *n;
+	sqlite3_stmt *stmt = NULL;
+	struct sbuf *sql = sbuf_new_auto();
+	int64_t npkgs = 0, ndeps = 0, id;
+	int *edges = NULL, *queue = NULL;
+	int nnodes = 0, nedges = 0, src = 0;
+	int head, tail, nseeds, i;
+	int ret = EPKG_FATAL, sret;
+
+	const char nodes_sql[] = ""
+		"SELECT r.id, l.id IS NOT NULL FROM '%s'.packages AS r "
+		"LEFT JOIN main.packages AS l "
+			"ON l.origin = r.origin AND l.version = r.version "
+		"ORDER BY r.id;";
+	const char edges_sql[] = ""
+		"SELECT d.package_id, r.id FROM '%s'.deps AS d, '%s'.packages AS r "
+		"WHERE r.origin = d.origin ORDER BY d.package_id;";
+	const char insert_sql[] = ""
+		"INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, "
+			"comment, desc, arch, osversion, maintainer, www, prefix, "
+			"flatsize, pkgsize, cksum, repopath, automatic, vkey) "
+		"SELECT id, origin, name, version, comment, desc, arch, "
+			"osversion, maintainer, www, prefix, flatsize, pkgsize, "
+			"cksum, path, 1, %s FROM '%s'.packages AS r WHERE id = ?1;";
+
+	sbuf_printf(sql, "SELECT count(*) FROM '%s'.packages;", reponame);
+	sbuf_finish(sql);
+	if (get_pragma(db->sqlite, sbuf_get(sql), &npkgs) != EPKG_OK)
+		goto cleanup;
+
+	if ((nodes = calloc(npkgs + 1, sizeof(struct closure_node))) == NULL ||
+	    (queue = calloc(npkgs + 1, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_jobs_closure");
+		goto cleanup;
+	}
+
+	sbuf_reset(sql);
+	sbuf_printf(sql, "SELECT count(*) FROM '%s'.deps;", reponame);
+	sbuf_finish(sql);
+	if (get_pragma(db->sqlite, sbuf_get(sql), &ndeps) != EPKG_OK)
+		goto cleanup;
+
+	if ((edges = calloc(ndeps + 1, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_jobs_closure");
+		goto cleanup;
+	}
+
+	/* nodes, sorted by id */
+	sbuf_reset(sql);
+	sbuf_printf(sql, nodes_sql, reponame);
+	sbuf_finish(sql);
+	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	while ((sret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (nnodes == npkgs)
+			continue;
+		nodes[nnodes].id = sqlite3_column_int64(stmt, 0);
+		nodes[nnodes].skip = sqlite3_column_int(stmt, 1);
+		nnodes++;
+	}
+	sqlite3_finalize(stmt);
+	if (sret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	/* edges, grouped by the depending package */
+	sbuf_reset(sql);
+	sbuf_printf(sql, edges_sql, reponame, reponame);
+	sbuf_finish(sql);
+	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	while ((sret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (nedges == ndeps)
+			continue;
+		id = sqlite3_column_int64(stmt, 0);
+		while (src < nnodes && nodes[src].id <= id)
+			nodes[src++].edges = nedges;
+		if ((n = closure_node_find(nodes, nnodes,
+		    sqlite3_column_int64(stmt, 1))) == NULL)
+			continue;
+		edges[nedges++] = n - nodes;
+	}
+	sqlite3_finalize(stmt);
+	if (sret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	while (src <= nnodes)
+		nodes[src++].edges = nedges;
+
+	/* the packages already requested are the roots of the walk */
+	tail = 0;
+	if (sqlite3_prepare_v2(db->sqlite, "SELECT pkgid FROM pkgjobs;", -1,
+	    &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	while ((sret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		n = closure_node_find(nodes, nnodes, sqlite3_column_int64(stmt, 0));
+		if (n == NULL || n->queued)
+			continue;
+		n->queued = true;
+		queue[tail++] = n - nodes;
+	}
+	sqlite3_finalize(stmt);
+	if (sret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	nseeds = tail;
+
+	for (head = 0; head < tail; head++) {
+		n = &nodes[queue[head]];
+		for (i = n->edges; i < (n + 1)->edges; i++) {
+			if (nodes[edges[i]].queued || nodes[edges[i]].skip)
+				continue;
+			nodes[edges[i]].queued = true;
+			queue[tail++] = edges[i];
+		}
+	}
+
+	/* insert the new packages in one go */
+	sbuf_reset(sql);
+	sbuf_printf(sql, insert_sql, pkgdb_repo_vkey(db, reponame), reponame);
+	sbuf_finish(sql);
+	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	if (sql_exec(db->sqlite, "SAVEPOINT closure;") != EPKG_OK) {
+		sqlite3_finalize(stmt);
+		goto cleanup;
+	}
+
+	for (i = nseeds; i < tail; i++) {
+		sqlite3_bind_int64(stmt, 1, nodes[queue[i]].id);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			ERROR_SQLITE(db->sqlite);
+			break;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	if (i == tail) {
+		ret = sql_exec(db->sqlite, "RELEASE closure;");
+	} else {
+		sql_exec(db->sqlite, "ROLLBACK TO closure;");
+		sql_exec(db->sqlite, "RELEASE closure;");
+	}
+
+	cleanup:
+	sbuf_delete(sql);
+	free(nodes);
+	free(edges);
+	free(queue);
 
 	return (ret);
 }
@@ -1936,25 +2736,15 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 	const char finalsql[] = "SELECT pkgid AS id, origin, name, version, "
 		"comment, desc, message, arch, osversion, maintainer, "
 		"www, prefix, flatsize, newversion, newflatsize, pkgsize, "
-		"cksum, repopath, automatic, (select count(*) FROM '%s'.deps as d WHERE d.origin = pkgjobs.origin) as weight, "
-		"'%s' AS dbname FROM pkgjobs ORDER BY weight DESC;";
+		"cksum, repopath, automatic, "
+		"'%s' AS dbname FROM pkgjobs ORDER BY name;";
        
 	const char main_sql[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 			"osversion, maintainer, www, prefix, flatsize, pkgsize, "
-			"cksum, repopath, automatic) "
+			"cksum, repopath, automatic, vkey) "
 			"SELECT id, origin, name, version, comment, desc, "
 			"arch, osversion, maintainer, www, prefix, flatsize, pkgsize, "
-			"cksum, path, 0 FROM '%s'.packages WHERE ";
-
-	const char deps_sql[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
-				"osversion, maintainer, www, prefix, flatsize, pkgsize, "
-				"cksum, repopath, automatic) "
-				"SELECT DISTINCT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
-				"r.arch, r.osversion, r.maintainer, r.www, r.prefix, r.flatsize, r.pkgsize, "
-				"r.cksum, r.path, 1 "
-				"FROM '%s'.packages AS r where r.origin IN "
-				"(SELECT d.origin FROM '%s'.deps AS d, pkgjobs AS j WHERE d.package_id = j.pkgid) "
-				"AND (SELECT origin FROM main.packages WHERE origin=r.origin AND version=r.version) IS NULL;";
+			"cksum, path, 0, %s FROM '%s'.packages AS r WHERE ";
 
 	assert(db != NULL);
 
@@ -1967,23 +2757,17 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
 	if (multirepos_enabled) {
-		if (repo != NULL) {
-			if (!is_attached(db->sqlite, repo)) {
-				pkg_emit_error("repository '%s' does not exists", repo);
-				return (NULL);
-			}
+		/* default repository in multi-repos is 'default' */
+		reponame = (repo != NULL) ? repo : "default";
 
-			reponame = repo;
-		} else {
-			/* default repository in multi-repos is 'default' */
-			reponame = "default";
-		}
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (NULL);
 	} else {
 		/* default repository in single-repo is 'remote' */
 		reponame = "remote";
 	}
 
-	sbuf_printf(sql, main_sql, reponame);
+	sbuf_printf(sql, main_sql, pkgdb_repo_vkey(db, reponame), reponame);
 
 	switch (match) {
 		case MATCH_ALL:
@@ -2028,13 +2812,10 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 	sql_exec(db->sqlite, "DELETE from pkgjobs where (select p.origin from main.packages as p where p.origin=pkgjobs.origin and version=pkgjobs.version) IS NOT NULL;");
 
 	/* Append dependencies */
-	sbuf_reset(sql);
-	sbuf_printf(sql, deps_sql, reponame, reponame);
-
-	do {
-		sql_exec(db->sqlite, sbuf_get(sql));
-	} while (sqlite3_changes(db->sqlite) != 0);
-
+	if (pkgdb_jobs_closure(db, reponame) != EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
+	}
 
 	/* Determine if there is an upgrade needed */
 	sql_exec(db->sqlite, "INSERT OR REPLACE INTO pkgjobs (pkgid, origin, name, version, comment, desc, message, arch, "
@@ -2044,10 +2825,10 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 			"l.osversion, l.maintainer, l.www, l.prefix, l.flatsize, r.version AS newversion, "
 			"r.flatsize AS newflatsize, r.pkgsize, r.cksum, r.repopath, r.automatic "
 			"FROM main.packages AS l, pkgjobs AS r WHERE l.origin = r.origin "
-			"AND (PKGLT(l.version, r.version) OR (l.name != r.name))");
+			"AND (l.vkey < r.vkey OR (l.name != r.name))");
 
 	sbuf_reset(sql);
-	sbuf_printf(sql, finalsql, reponame, reponame);
+	sbuf_printf(sql, finalsql, reponame);
 
 	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -2078,25 +2859,15 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo)
 	const char finalsql[] = "select pkgid as id, origin, name, version, "
 		"comment, desc, message, arch, osversion, maintainer, "
 		"www, prefix, flatsize, newversion, newflatsize, pkgsize, "
-		"cksum, repopath, automatic, (select count(*) from '%s'.deps as d where d.origin = pkgjobs.origin) as weight, "
-		"'%s' AS dbname FROM pkgjobs order by weight DESC;";
+		"cksum, repopath, automatic, "
+		"'%s' AS dbname FROM pkgjobs ORDER BY name;";
 		
 	const char pkgjobs_sql_1[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 			"osversion, maintainer, www, prefix, flatsize, pkgsize, "
-			"cksum, repopath, automatic) "
+			"cksum, repopath, automatic, vkey) "
 			"SELECT id, origin, name, version, comment, desc, "
 			"arch, osversion, maintainer, www, prefix, flatsize, pkgsize, "
-			"cksum, path, 0 FROM '%s'.packages WHERE origin IN (select origin from main.packages)";
-
-	const char pkgjobs_sql_2[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
-				"osversion, maintainer, www, prefix, flatsize, pkgsize, "
-				"cksum, repopath, automatic) "
-				"SELECT DISTINCT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
-				"r.arch, r.osversion, r.maintainer, r.www, r.prefix, r.flatsize, r.pkgsize, "
-				"r.cksum, r.path, 1 "
-				"FROM '%s'.packages AS r where r.origin IN "
-				"(SELECT d.origin from '%s'.deps AS d, pkgjobs as j WHERE d.package_id = j.pkgid) "
-				"AND (SELECT p.origin from main.packages as p WHERE p.origin=r.origin AND version=r.version) IS NULL;";
+			"cksum, path, 0, %s FROM '%s'.packages AS r WHERE origin IN (select origin from main.packages)";
 
 	const char pkgjobs_sql_3[] = "INSERT OR REPLACE INTO pkgjobs (pkgid, origin, name, version, comment, desc, message, arch, "
 			"osversion, maintainer, www, prefix, flatsize, newversion, newflatsize, pkgsize, "
@@ -2105,23 +2876,17 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo)
 			"l.osversion, l.maintainer, l.www, l.prefix, l.flatsize, r.version AS newversion, "
 			"r.flatsize AS newflatsize, r.pkgsize, r.cksum, r.repopath, r.automatic "
 			"FROM main.packages AS l, pkgjobs AS r WHERE l.origin = r.origin "
-			"AND (PKGLT(l.version, r.version) OR (l.name != r.name))";
+			"AND (l.vkey < r.vkey OR (l.name != r.name))";
 
 	/* Working on multiple repositories */
 	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
 	if (multirepos_enabled) {
-		if (repo != NULL) {
-			if (!is_attached(db->sqlite, repo)) {
-				pkg_emit_error("repository '%s' does not exists", repo);
-				return (NULL);
-			}
+		/* default repository in multi-repos is 'default' */
+		reponame = (repo != NULL) ? repo : "default";
 
-			reponame = repo;
-		} else {
-			/* default repository in multi-repos is 'default' */
-			reponame = "default";
-		}
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (NULL);
 	} else {
 		/* default repository in single-repo is 'remote' */
 		reponame = "remote";
@@ -2129,24 +2894,23 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo)
 
 	create_temporary_pkgjobs(db->sqlite);
 
-	sbuf_printf(sql, pkgjobs_sql_1, reponame);
+	sbuf_printf(sql, pkgjobs_sql_1, pkgdb_repo_vkey(db, reponame), reponame);
 	sql_exec(db->sqlite, sbuf_get(sql));
 
 	/* Remove packages already installed and in the latest version */
 	sql_exec(db->sqlite, "DELETE from pkgjobs where (select p.origin from main.packages as p where p.origin=pkgjobs.origin and version=pkgjobs.version) IS NOT NULL;");
 
-	sbuf_reset(sql);
-	sbuf_printf(sql, pkgjobs_sql_2, reponame, reponame);
-
-	do {
-		sql_exec(db->sqlite, sbuf_get(sql));
-	} while (sqlite3_changes(db->sqlite) != 0);
+	/* Append dependencies */
+	if (pkgdb_jobs_closure(db, reponame) != EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
+	}
 
 	/* Determine if there is an upgrade needed */
 	sql_exec(db->sqlite, pkgjobs_sql_3);
 
 	sbuf_reset(sql);
-	sbuf_printf(sql, finalsql, reponame, reponame);
+	sbuf_printf(sql, finalsql, reponame);
 
 	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -2182,29 +2946,24 @@ pkgdb_query_downgrades(struct pkgdb *db, const char *repo)
 		"FROM main.packages AS l, "
 		"'%s'.packages AS r "
 		"WHERE l.origin = r.origin "
-		"AND PKGGT(l.version, r.version)";
+		"AND l.vkey > %s";
 
 	/* Working on multiple repositories */
 	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
 	if (multirepos_enabled) {
-		if (repo != NULL) {
-			if (!is_attached(db->sqlite, repo)) {
-				pkg_emit_error("repository '%s' does not exists", repo);
-				return (NULL);
-			}
+		/* default repository in multi-repos is 'default' */
+		reponame = (repo != NULL) ? repo : "default";
 
-			reponame = repo;
-		} else {
-			/* default repository in multi-repos is 'default' */
-			reponame = "default";
-		}
+		if (pkgdb_repo_attach(db, reponame) != EPKG_OK)
+			return (NULL);
 	} else {
 		/* default repository in single-repo is 'remote' */
 		reponame = "remote";
 	}
 
-	sbuf_printf(sql, finalsql, reponame, reponame);
+	sbuf_printf(sql, finalsql, reponame, reponame,
+	    pkgdb_repo_vkey(db, reponame));
 	sbuf_finish(sql);
 
 	if (sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL) != SQLITE_OK) {
@@ -2382,6 +3141,9 @@ pkgdb_rquery_build_search_query(struct sbuf *sql, match_t match, unsigned int fi
 		case FIELD_DESC:
 			what = "desc";
 			break;
+		case FIELD_CKSUM:
+			what = "cksum";
+			break;
 	}
 
 	if (what != NULL && how != NULL)
@@ -2390,12 +3152,86 @@ pkgdb_rquery_build_search_query(struct sbuf *sql, match_t match, unsigned int fi
 	return (EPKG_OK);
 }
 
+/*
+ * Turn a search pattern into a full text query: each word becomes a quoted
+ * phrase, so that the operators of the query syntax are taken literally,
+ * and all of them must match.  Quotes are dropped; a word ending with '*'
+ * stays a prefix search.
+ */
+static void
+pkgdb_fts_query(const char *pattern, struct sbuf *query)
+{
+	const char *p;
+	bool inword = false;
+
+	for (p = pattern; *p != '\0'; p++) {
+		if (isspace((unsigned char)*p)) {
+			if (inword)
+				sbuf_putc(query, '"');
+			inword = false;
+			continue;
+		}
+
+		if (!inword) {
+			if (sbuf_len(query) > 0)
+				sbuf_putc(query, ' ');
+			sbuf_putc(query, '"');
+			inword = true;
+		}
+
+		if (*p != '"')
+			sbuf_putc(query, *p);
+	}
+
+	if (inword)
+		sbuf_putc(query, '"');
+	sbuf_finish(query);
+}
+
+/*
+ * Append the search of the words of the pattern in the comments or the
+ * descriptions of a repository.  The catalogues older than version 4 have
+ * no full text index, their rows are matched exactly as before.
+ */
+static void
+pkgdb_rquery_fts(struct pkgdb *db, struct sbuf *sql, const char *reponame,
+    unsigned int field)
+{
+	const char *ftssql = ""
+				"SELECT p.id AS id, p.origin AS origin, p.name AS name, "
+					"p.version AS version, p.comment AS comment, "
+					"p.prefix AS prefix, p.desc AS desc, p.arch AS arch, "
+					"p.osversion AS osversion, p.maintainer AS maintainer, "
+					"p.www AS www, p.licenselogic AS licenselogic, "
+					"p.flatsize AS flatsize, p.pkgsize AS pkgsize, "
+					"p.cksum AS cksum, p.path AS path, '%s' AS dbname, "
+					"FTS_RANK(matchinfo(f.packages_fts)) AS rank "
+					"FROM '%s'.packages_fts AS f, '%s'.packages AS p "
+					"WHERE f.%s MATCH ?2 AND p.id = f.docid";
+	const char *scansql = ""
+				"SELECT id, origin, name, version, comment, "
+					"prefix, desc, arch, osversion, maintainer, www, "
+					"licenselogic, flatsize, pkgsize, "
+					"cksum, path, '%s' AS dbname, 0 AS rank "
+					"FROM '%s'.packages WHERE %s = ?1";
+
+	if (pkgdb_repo_version(db, reponame) >= 4)
+		sbuf_printf(sql, ftssql, reponame, reponame, reponame,
+		    field == FIELD_COMMENT ? "comment" : "desc");
+	else
+		sbuf_printf(sql, scansql, reponame, reponame,
+		    field == FIELD_COMMENT ? "comment" : "desc");
+}
+
 struct pkgdb_it *
 pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match, unsigned int field, const char *reponame)
 {
 	sqlite3_stmt *stmt = NULL;
 	struct sbuf *sql = NULL;
+	struct sbuf *query = NULL;
+	struct pkgdb_repo *r;
 	bool multirepos_enabled = false;
+	int64_t limit;
 	const char *basesql = ""
 				"SELECT id, origin, name, version, comment, "
 					"prefix, desc, arch, osversion, maintainer, www, "
@@ -2420,7 +3256,42 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match, unsigned int
 
 	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
-	if (multirepos_enabled) {
+	if (match == MATCH_EXACT &&
+	    (field == FIELD_COMMENT || field == FIELD_DESC)) {
+		/*
+		 * Words in the descriptions, ranked with the full text index
+		 */
+
+		sbuf_cat(sql, ", dbname FROM (");
+
+		if (!multirepos_enabled) {
+			pkgdb_rquery_fts(db, sql, "remote", field);
+		} else if (reponame != NULL) {
+			if (pkgdb_repo_attach(db, reponame) != EPKG_OK) {
+				pkg_emit_error("Repository %s can't be loaded", reponame);
+				return (NULL);
+			}
+			pkgdb_rquery_fts(db, sql, reponame, field);
+		} else {
+			if (pkgdb_repo_attach_all(db) != EPKG_OK)
+				return (NULL);
+			TAILQ_FOREACH(r, &db->repos, next) {
+				if (r != TAILQ_FIRST(&db->repos))
+					sbuf_cat(sql, " UNION ALL ");
+				pkgdb_rquery_fts(db, sql, r->name, field);
+			}
+		}
+
+		sbuf_cat(sql, ") ORDER BY rank DESC, name");
+		if (pkg_config_int64(PKG_CONFIG_SEARCH_LIMIT, &limit) == EPKG_OK &&
+		    limit > 0)
+			sbuf_printf(sql, " LIMIT %" PRId64, limit);
+		sbuf_cat(sql, ";");
+		sbuf_finish(sql);
+
+		query = sbuf_new_auto();
+		pkgdb_fts_query(pattern, query);
+	} else if (multirepos_enabled) {
 		/*
 		 * Working on multiple remote repositories
 		 */
@@ -2429,15 +3300,16 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match, unsigned int
 		sbuf_cat(sql, ", dbname FROM (");
 
 		if (reponame != NULL) {
-			if (is_attached(db->sqlite, reponame)) {
+			if (pkgdb_repo_attach(db, reponame) == EPKG_OK) {
 				sbuf_printf(sql, multireposql, reponame, reponame);
 			} else {
 				pkg_emit_error("Repository %s can't be loaded", reponame);
 				return (NULL);
 			}
 		} else {
-			/* test on all the attached databases */
-			if (sql_on_all_attached_db(db->sqlite, sql, multireposql) != EPKG_OK)
+			/* test on all the repositories */
+			if (pkgdb_repo_attach_all(db) != EPKG_OK ||
+			    sql_on_all_attached_db(db->sqlite, sql, multireposql) != EPKG_OK)
 				return (NULL);
 		}
 
@@ -2464,6 +3336,10 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match, unsigned int
 	sbuf_delete(sql);
 
 	sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+	if (query != NULL) {
+		sqlite3_bind_text(stmt, 2, sbuf_get(query), -1, SQLITE_TRANSIENT);
+		sbuf_delete(query);
+	}
 
 	return (pkgdb_it_new(db, stmt, PKG_REMOTE));
 }
@@ -2491,8 +3367,8 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 			"path TEXT UNIQUE);"
 		);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL) {
+		sbuf_delete(conflictmsg);
 		return (EPKG_FATAL);
 	}
 	while (pkg_files(p, &file) == EPKG_OK) {
@@ -2510,9 +3386,8 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 			    name, version,
 			    pkg_file_get(file, PKG_FILE_PATH));
 
-			if (sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite);
-				sqlite3_finalize(stmt);
+			if ((stmt_conflicts = pkgdb_stmt_get(db, sql_conflicts)) == NULL) {
+				sqlite3_reset(stmt);
 				sbuf_delete(conflictmsg);
 				return (EPKG_FATAL);
 			}
@@ -2524,14 +3399,14 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 						sqlite3_column_text(stmt_conflicts, 0),
 						sqlite3_column_text(stmt_conflicts, 1));
 			}
-			sqlite3_finalize(stmt_conflicts);
+			sqlite3_reset(stmt_conflicts);
 			sbuf_finish(conflictmsg);
 			pkg_emit_error(sbuf_get(conflictmsg));
 			ret = EPKG_FATAL;
 		}
 		sqlite3_reset(stmt);
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	sbuf_delete(conflictmsg);
 
 	return (ret);
@@ -2611,6 +3486,79 @@ pkgdb_integrity_check(struct pkgdb *db)
 	return (ret);
 }
 
+/*
+ * Record that the installed package of this origin, if any, is replaced by
+ * the packages being checked: its files are not conflicts.
+ */
+int
+pkgdb_integrity_replace(struct pkgdb *db, const char *origin)
+{
+	sqlite3_stmt *stmt;
+	const char sql[] = "INSERT OR IGNORE INTO integrityreplace (origin) "
+		"VALUES (?1);";
+
+	assert(db != NULL && origin != NULL);
+
+	sql_exec(db->sqlite, "CREATE TEMP TABLE IF NOT EXISTS integrityreplace ("
+			"origin TEXT PRIMARY KEY);");
+
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
+		return (EPKG_FATAL);
+
+	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		sqlite3_reset(stmt);
+		return (EPKG_FATAL);
+	}
+	sqlite3_reset(stmt);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Check the files of a single package against the installed packages which
+ * are not replaced, so that it can be installed before the manifests of
+ * the other packages are known. Conflicts between the packages themselves
+ * are found by pkgdb_integrity_append().
+ */
+int
+pkgdb_integrity_check_pkg(struct pkgdb *db, struct pkg *p)
+{
+	int ret = EPKG_OK;
+	sqlite3_stmt *stmt;
+	struct pkg_file *file = NULL;
+	const char *name, *version, *path;
+	const char sql[] = "SELECT p.name, p.version "
+		"FROM main.files AS f, main.packages AS p "
+		"WHERE f.path = ?1 AND p.id = f.package_id "
+		"AND p.origin NOT IN (SELECT origin FROM integrityreplace);";
+
+	assert(db != NULL && p != NULL);
+
+	sql_exec(db->sqlite, "CREATE TEMP TABLE IF NOT EXISTS integrityreplace ("
+			"origin TEXT PRIMARY KEY);");
+
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
+		return (EPKG_FATAL);
+
+	pkg_get(p, PKG_NAME, &name, PKG_VERSION, &version);
+	while (pkg_files(p, &file) == EPKG_OK) {
+		path = pkg_file_get(file, PKG_FILE_PATH);
+		sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			pkg_emit_error("WARNING: locally installed %s-%s "
+			    "conflicts on %s with:\n\t- %s-%s\n",
+			    sqlite3_column_text(stmt, 0),
+			    sqlite3_column_text(stmt, 1), path, name, version);
+			ret = EPKG_FATAL;
+		}
+		sqlite3_reset(stmt);
+	}
+
+	return (ret);
+}
+
 struct pkgdb_it *
 pkgdb_integrity_conflict_local(struct pkgdb *db, const char *origin)
 {
@@ -1,20 +1,51 @@
 #ifndef _PKGDB_H
 #define _PKGDB_H
 
+#include <sys/queue.h>
+
 #include "pkg.h"
 
 #include "sqlite3.h"
 
+#define PKGDB_STMT_BUCKETS 64
+
+struct pkgdb_stmt {
+	char *sql;
+	sqlite3_stmt *stmt;
+	LIST_ENTRY(pkgdb_stmt) next;
+};
+
+struct pkgdb_repo {
+	char *name;
+	TAILQ_ENTRY(pkgdb_repo) next;
+};
+
 struct pkgdb {
 	sqlite3 *sqlite;
 	pkgdb_t type;
 	unsigned int writable :1;
+	LIST_HEAD(, pkgdb_stmt) stmts[PKGDB_STMT_BUCKETS];
+	int64_t stmt_hits;
+	int64_t stmt_misses;
+	TAILQ_HEAD(pkgdb_repos, pkgdb_repo) repos; /* most recently used first */
+	int nrepos;
 };
 
+sqlite3_stmt *pkgdb_stmt_get(struct pkgdb *db, const char *sql);
+int pkgdb_repo_attach(struct pkgdb *db, const char *name);
+
+#define PKGDB_IT_NRELATIONS 11
+
 struct pkgdb_it {
 	struct pkgdb *db;
 	sqlite3_stmt *stmt;
 	int type;
+	int ncols;
+	int *colmap;	/* index in the column mapping of each column */
+	char *filter;	/* condition on "packages AS p", NULL if no prefetch */
+	char *pattern;
+	int prefetched;	/* PKG_LOAD_* flags loaded by ordered scans */
+	sqlite3_stmt *relations[PKGDB_IT_NRELATIONS];
 };
 
 #endif
@@ -0,0 +1,774 @@
+#include <sys/param.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "pkg_event.h"
+#include "pkg_private.h"
+
+/*
+ * What is known about the local copy of a repository database, kept in
+ * <dbdir>/<name>.meta: the checksum of the database as published, and the
+ * validators of the last repo.txz or repo.tzst and repo.delta.txz it was
+ * updated from.
+ */
+struct update_meta {
+	char digest[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct fetch_cond full;
+	struct fetch_cond zstd;
+	struct fetch_cond delta;
+};
+
+/* OpenSSL is not set up for threads, the signatures are checked in turn */
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+update_verify(const char *path, unsigned char *sig, int siglen)
+{
+	int ret;
+
+	pthread_mutex_lock(&verify_lock);
+	ret = pkg_repo_verify(path, sig, siglen - 1);
+	pthread_mutex_unlock(&verify_lock);
+
+	return (ret);
+}
+
+static void
+update_meta_load(const char *path, const char *repofile, struct update_meta *m)
+{
+	FILE *fp;
+	char line[BUFSIZ];
+	char key[32];
+	char value[sizeof(m->full.etag)];
+	intmax_t mtime;
+	struct fetch_cond *cond;
+	int n;
+
+	memset(m, 0, sizeof(struct update_meta));
+
+	/* the validators are worthless without the database */
+	if (access(repofile, F_OK) == -1 || (fp = fopen(path, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "digest %64s", m->digest) == 1)
+			continue;
+		if ((n = sscanf(line, "%31s %jd %127s", key, &mtime, value)) < 2)
+			continue;
+		if (strcmp(key, "repo.txz") == 0)
+			cond = &m->full;
+		else if (strcmp(key, "repo.tzst") == 0)
+			cond = &m->zstd;
+		else if (strcmp(key, "repo.delta.txz") == 0)
+			cond = &m->delta;
+		else
+			continue;
+		cond->mtime = mtime;
+		if (n == 3 && strcmp(value, "-") != 0)
+			strlcpy(cond->etag, value, sizeof(cond->etag));
+	}
+
+	fclose(fp);
+}
+
+static int
+update_meta_save(const char *path, struct update_meta *m)
+{
+	FILE *fp;
+	char tmp[MAXPATHLEN + 1];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		pkg_emit_errno("fopen", tmp);
+		return (EPKG_FATAL);
+	}
+
+	fprintf(fp, "digest %s\n", m->digest);
+	fprintf(fp, "repo.txz %jd %s\n", (intmax_t)m->full.mtime,
+	    m->full.etag[0] != '\0' ? m->full.etag : "-");
+	fprintf(fp, "repo.tzst %jd %s\n", (intmax_t)m->zstd.mtime,
+	    m->zstd.etag[0] != '\0' ? m->zstd.etag : "-");
+	fprintf(fp, "repo.delta.txz %jd %s\n", (intmax_t)m->delta.mtime,
+	    m->delta.etag[0] != '\0' ? m->delta.etag : "-");
+
+	if (fclose(fp) != 0) {
+		pkg_emit_errno("fclose", tmp);
+		unlink(tmp);
+		return (EPKG_FATAL);
+	}
+
+	if (rename(tmp, path) == -1) {
+		pkg_emit_errno("rename", path);
+		unlink(tmp);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/* the tables of the catalogue a delta inserts into and deletes from */
+static const char * const delta_tables[] = {
+	"packages",
+	"packages_fts",
+	"deps",
+	"categories",
+	"pkg_categories",
+	"licenses",
+	"pkg_licenses",
+	"options",
+	NULL
+};
+
+static bool
+update_delta_table(const char *table)
+{
+	const char * const *t;
+
+	if (table == NULL)
+		return (false);
+
+	for (t = delta_tables; *t != NULL; t++) {
+		if (strcmp(table, *t) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * A delta is a script from the network, run with the rights of pkg: it may
+ * only change the packages of the catalogue and use its own temporary
+ * delta_* tables. ATTACH, PRAGMA and anything else are denied.
+ */
+static int
+update_delta_auth(__unused void *data, int action, const char *arg1,
+    const char *arg2, const char *dbname, __unused const char *trigger)
+{
+	bool inmain = (dbname != NULL && strcmp(dbname, "main") == 0);
+	bool intemp = (dbname != NULL && strcmp(dbname, "temp") == 0);
+	bool fts = (arg1 != NULL && strncmp(arg1, "packages_fts_", 13) == 0);
+	bool delta = (arg1 != NULL && strncmp(arg1, "delta_", 6) == 0);
+	/* creating and dropping a temporary table writes its schema */
+	bool schema = (arg1 != NULL &&
+	    strcmp(arg1, "sqlite_temp_master") == 0);
+
+	switch (action) {
+	case SQLITE_SELECT:
+		return (SQLITE_OK);
+	case SQLITE_PRAGMA:
+		/* the full text index reads it when it is opened */
+		if (strcmp(arg1, "page_size") == 0 && arg2 == NULL)
+			return (SQLITE_OK);
+		break;
+	case SQLITE_READ:
+		if (inmain || intemp)
+			return (SQLITE_OK);
+		break;
+	case SQLITE_FUNCTION:
+		if (arg2 != NULL && strcmp(arg2, "load_extension") != 0)
+			return (SQLITE_OK);
+		break;
+	case SQLITE_INSERT:
+	case SQLITE_DELETE:
+		/* the full text index keeps its data in its own tables */
+		if (inmain && (update_delta_table(arg1) || fts))
+			return (SQLITE_OK);
+		if (intemp && (delta || schema))
+			return (SQLITE_OK);
+		break;
+	case SQLITE_UPDATE:
+		if ((inmain && fts) || (intemp && (delta || schema)))
+			return (SQLITE_OK);
+		/*
+		 * sqlite checks it while it opens the full text index; the
+		 * table itself cannot be written without a PRAGMA.
+		 */
+		if (inmain && arg1 != NULL &&
+		    strcmp(arg1, "sqlite_master") == 0)
+			return (SQLITE_OK);
+		break;
+	case SQLITE_CREATE_TEMP_TABLE:
+	case SQLITE_DROP_TEMP_TABLE:
+		if (delta)
+			return (SQLITE_OK);
+		break;
+	case SQLITE_CREATE_TEMP_INDEX:
+	case SQLITE_DROP_TEMP_INDEX:
+		if (arg2 != NULL && strncmp(arg2, "delta_", 6) == 0)
+			return (SQLITE_OK);
+		break;
+	}
+
+	return (SQLITE_DENY);
+}
+
+/*
+ * Create dest for writing, never through a link left in its place.
+ */
+static int
+update_create(const char *dest)
+{
+	int fd;
+
+	if ((unlink(dest) == -1 && errno != ENOENT) ||
+	    (fd = open(dest, O_WRONLY|O_CREAT|O_EXCL, 0644)) == -1) {
+		pkg_emit_errno("open", dest);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * A temporary file next to the repository database, out of reach of the
+ * other users unlike /tmp.
+ */
+static int
+update_tmpfile(char *path, size_t len, const char *repofile, const char *what)
+{
+	int fd;
+
+	snprintf(path, len, "%s.%s.XXXXXX", repofile, what);
+	if ((fd = mkstemp(path)) == -1) {
+		pkg_emit_errno("mkstemp", path);
+		path[0] = '\0';
+	}
+
+	return (fd);
+}
+
+/*
+ * Extract the given entry of a repository archive to fd, along with the
+ * signature if there is one.
+ */
+static int
+update_extract(const char *archive, const char *entry, int fd,
+    unsigned char **sig, int *siglen)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	const char *name;
+	int retcode = EPKG_FATAL;
+
+	*sig = NULL;
+	*siglen = 0;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_filename(a, archive, 4096) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open_filename(%s): %s", archive,
+					   archive_error_string(a));
+		goto cleanup;
+	}
+
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		name = archive_entry_pathname(ae);
+		if (strcmp(name, entry) == 0 && retcode != EPKG_OK) {
+			if (archive_read_data_into_fd(a, fd) != ARCHIVE_OK) {
+				pkg_emit_error("%s: %s", archive, archive_error_string(a));
+				goto cleanup;
+			}
+			retcode = EPKG_OK;
+		} else if (strcmp(name, "signature") == 0 && *sig == NULL) {
+			*siglen = archive_entry_size(ae);
+			if ((*sig = malloc(*siglen)) == NULL) {
+				pkg_emit_errno("malloc", "signature");
+				goto cleanup;
+			}
+			archive_read_data(a, *sig, *siglen);
+		}
+	}
+
+	if (retcode != EPKG_OK)
+		pkg_emit_error("%s: no %s in the archive", archive, entry);
+
+	cleanup:
+	archive_read_finish(a);
+
+	if (retcode != EPKG_OK) {
+		free(*sig);
+		*sig = NULL;
+	}
+
+	return (retcode);
+}
+
+static int
+update_copy(const char *src, const char *dest)
+{
+	char buf[BUFSIZ];
+	ssize_t r;
+	int in, out;
+	int retcode = EPKG_OK;
+
+	if ((in = open(src, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", src);
+		return (EPKG_FATAL);
+	}
+
+	if ((out = update_create(dest)) == -1) {
+		close(in);
+		return (EPKG_FATAL);
+	}
+
+	while ((r = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, r) != r) {
+			pkg_emit_errno("write", dest);
+			retcode = EPKG_FATAL;
+			break;
+		}
+	}
+
+	if (r == -1) {
+		pkg_emit_errno("read", src);
+		retcode = EPKG_FATAL;
+	}
+
+	close(in);
+	close(out);
+
+	return (retcode);
+}
+
+/*
+ * Apply the delta published with the current database of the repository,
+ * when it was made from the local copy.
+ * @return EPKG_OK, EPKG_UPTODATE, EPKG_END when the delta does not apply or
+ * an error code
+ */
+static int
+update_delta(const char *site, struct update_meta *m, const char *repofile,
+    const char *unchecked, fetch_cb cb, void *data)
+{
+	FILE *fp;
+	sqlite3 *sqlite = NULL;
+	char url[MAXPATHLEN + 1];
+	char tmp[MAXPATHLEN + 1];
+	char sqlfile[MAXPATHLEN + 1] = "";
+	char line[BUFSIZ];
+	char from[SHA256_DIGEST_LENGTH * 2 + 1];
+	char to[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *sql = NULL;
+	char *errmsg = NULL;
+	const char *repokey = NULL;
+	off_t sz;
+	unsigned char *sig = NULL;
+	int siglen = 0;
+	int fd, ret;
+	int retcode;
+
+	if ((fd = update_tmpfile(tmp, sizeof(tmp), repofile, "delta")) == -1)
+		return (EPKG_FATAL);
+	close(fd);
+
+	snprintf(url, sizeof(url), "%s/repo.delta.txz", site);
+	m->delta.optional = true;
+	if ((retcode = pkg_fetch_file_cond(url, tmp, &m->delta, cb, data)) != EPKG_OK)
+		goto cleanup;
+
+	if ((fd = update_tmpfile(sqlfile, sizeof(sqlfile), repofile, "sql")) == -1) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+	retcode = update_extract(tmp, "delta.sql", fd, &sig, &siglen);
+	close(fd);
+	if (retcode != EPKG_OK)
+		goto cleanup;
+
+	retcode = EPKG_END;
+	if ((fp = fopen(sqlfile, "r")) == NULL) {
+		pkg_emit_errno("fopen", sqlfile);
+		goto cleanup;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL ||
+	    sscanf(line, "-- pkg delta %64s %64s", from, to) != 2) {
+		pkg_emit_error("%s: not a delta", url);
+		fclose(fp);
+		goto cleanup;
+	}
+	fclose(fp);
+
+	if (strcmp(to, m->digest) == 0) {
+		retcode = EPKG_UPTODATE;
+		goto cleanup;
+	}
+
+	if (strcmp(from, m->digest) != 0)
+		goto cleanup;
+
+	if (sig != NULL && update_verify(sqlfile, sig, siglen) != EPKG_OK) {
+		pkg_emit_error("%s: invalid signature", url);
+		goto cleanup;
+	}
+
+	/* with a key to check them, only signed deltas are applied */
+	if (sig == NULL && pkg_config_string(PKG_CONFIG_REPOKEY, &repokey) ==
+	    EPKG_OK && repokey != NULL && access(repokey, F_OK) == 0) {
+		pkg_emit_error("%s: not signed, updating from the catalogue",
+		    url);
+		goto cleanup;
+	}
+
+	if (update_copy(repofile, unchecked) != EPKG_OK ||
+	    file_to_buffer(sqlfile, &sql, &sz) != EPKG_OK)
+		goto cleanup;
+
+	if (sqlite3_open(unchecked, &sqlite) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		goto cleanup;
+	}
+
+	if (sql_exec(sqlite, "BEGIN;") != EPKG_OK)
+		goto cleanup;
+	/* not through sql_exec(), the descriptions may hold a '%' */
+	sqlite3_set_authorizer(sqlite, update_delta_auth, NULL);
+	ret = sqlite3_exec(sqlite, sql, NULL, NULL, &errmsg);
+	sqlite3_set_authorizer(sqlite, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		pkg_emit_error("%s: %s", url, errmsg);
+		sqlite3_free(errmsg);
+		sql_exec(sqlite, "ROLLBACK;");
+		goto cleanup;
+	}
+	if (sql_exec(sqlite, "COMMIT;") != EPKG_OK)
+		goto cleanup;
+
+	sqlite3_close(sqlite);
+	sqlite = NULL;
+
+	if (rename(unchecked, repofile) == -1) {
+		pkg_emit_errno("rename", repofile);
+		goto cleanup;
+	}
+
+	/* the database no longer comes from the last repo.txz */
+	strlcpy(m->digest, to, sizeof(m->digest));
+	memset(&m->full, 0, sizeof(m->full));
+	memset(&m->zstd, 0, sizeof(m->zstd));
+	retcode = EPKG_OK;
+
+	cleanup:
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+
+	if (retcode != EPKG_OK && retcode != EPKG_UPTODATE)
+		unlink(unchecked);
+
+	free(sql);
+	free(sig);
+	if (sqlfile[0] != '\0')
+		unlink(sqlfile);
+	unlink(tmp);
+
+	return (retcode);
+}
+
+/*
+ * Fetch the whole database of the repository, unless it did not change.
+ */
+static int
+update_full(const char *site, struct update_meta *m, const char *repofile,
+    const char *unchecked, fetch_cb cb, void *data)
+{
+	char url[MAXPATHLEN + 1];
+	char tmp[MAXPATHLEN + 1];
+	unsigned char *sig = NULL;
+	int siglen = 0;
+	int fd;
+	int retcode = EPKG_END;
+
+	if ((fd = update_tmpfile(tmp, sizeof(tmp), repofile, "full")) == -1)
+		return (EPKG_FATAL);
+	close(fd);
+
+	/* repo.tzst is quicker to decompress, when the repository has one */
+	if (packing_format_supported(TZST)) {
+		snprintf(url, sizeof(url), "%s/repo.tzst", site);
+		m->zstd.optional = true;
+		retcode = pkg_fetch_file_cond(url, tmp, &m->zstd, cb, data);
+	}
+
+	if (retcode == EPKG_END) {
+		memset(&m->zstd, 0, sizeof(m->zstd));
+		snprintf(url, sizeof(url), "%s/repo.txz", site);
+		retcode = pkg_fetch_file_cond(url, tmp, &m->full, cb, data);
+	} else if (retcode == EPKG_OK)
+		memset(&m->full, 0, sizeof(m->full));
+
+	if (retcode != EPKG_OK) {
+		unlink(tmp);
+		return (retcode);
+	}
+
+	if ((fd = update_create(unchecked)) == -1) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+	retcode = update_extract(tmp, "repo.sqlite", fd, &sig, &siglen);
+	close(fd);
+	if (retcode != EPKG_OK)
+		goto cleanup;
+
+	if (sig != NULL && update_verify(unchecked, sig, siglen) != EPKG_OK) {
+		pkg_emit_error("%s: invalid signature, removing repository", url);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (sha256_file(unchecked, m->digest) != EPKG_OK) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (rename(unchecked, repofile) == -1) {
+		pkg_emit_errno("rename", repofile);
+		retcode = EPKG_FATAL;
+	}
+
+	cleanup:
+	if (retcode != EPKG_OK)
+		unlink(unchecked);
+
+	free(sig);
+	unlink(tmp);
+
+	return (retcode);
+}
+
+static int
+update_repo(const char *name, const char *packagesite, fetch_cb cb, void *data)
+{
+	struct update_meta m;
+	char site[MAXPATHLEN + 1];
+	char repofile[MAXPATHLEN + 1];
+	char unchecked[MAXPATHLEN + 1];
+	char metafile[MAXPATHLEN + 1];
+	const char *dbdir = NULL;
+	size_t len;
+	int retcode = EPKG_END;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	strlcpy(site, packagesite, sizeof(site));
+	if ((len = strlen(site)) > 0 && site[len - 1] == '/')
+		site[len - 1] = '\0';
+
+	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir, name);
+	snprintf(unchecked, sizeof(unchecked), "%s.unchecked", repofile);
+	snprintf(metafile, sizeof(metafile), "%s/%s.meta", dbdir, name);
+
+	update_meta_load(metafile, repofile, &m);
+
+	/* the delta is worth trying when the local database is known */
+	if (m.digest[0] != '\0')
+		retcode = update_delta(site, &m, repofile, unchecked, cb, data);
+
+	if (retcode != EPKG_OK && retcode != EPKG_UPTODATE) {
+		memset(&m.delta, 0, sizeof(m.delta));
+		retcode = update_full(site, &m, repofile, unchecked, cb, data);
+	}
+
+	if ((retcode == EPKG_OK || retcode == EPKG_UPTODATE) &&
+	    update_meta_save(metafile, &m) != EPKG_OK)
+		retcode = EPKG_FATAL;
+
+	return (retcode);
+}
+
+int
+pkg_update(const char *name, const char *packagesite)
+{
+	return (update_repo(name, packagesite, NULL, NULL));
+}
+
+/*
+ * The repositories are handed to the workers in turn, the calling thread
+ * reports the progress of all the downloads as a whole.
+ */
+struct update_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pkg_update_repo *repos;
+	int nrepos;
+	int next;		/* next repository to hand to a worker */
+	int finished;
+	int64_t total;		/* of the downloads started so far */
+	int64_t done;
+	time_t begin;
+	char label[32];
+};
+
+struct update_job {
+	struct update_pool *pool;
+	off_t done;
+	off_t total;
+};
+
+static double
+update_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+update_pool_progress(void *data, off_t done, off_t total)
+{
+	struct update_job *uj = data;
+	struct update_pool *up = uj->pool;
+
+	/* the next download of the repository */
+	if (done < uj->done)
+		uj->done = uj->total = 0;
+
+	pthread_mutex_lock(&up->lock);
+	up->done += done - uj->done;
+	up->total += total - uj->total;
+	pthread_mutex_unlock(&up->lock);
+
+	uj->done = done;
+	uj->total = total;
+}
+
+static void *
+update_pool_worker(void *arg)
+{
+	struct update_pool *up = arg;
+	struct pkg_update_repo *r;
+	struct update_job uj;
+	double started;
+	int ret;
+
+	uj.pool = up;
+
+	pthread_mutex_lock(&up->lock);
+	while (up->next < up->nrepos) {
+		r = &up->repos[up->next++];
+		pthread_mutex_unlock(&up->lock);
+
+		uj.done = uj.total = 0;
+		started = update_time();
+		ret = update_repo(r->name, r->packagesite, update_pool_progress,
+		    &uj);
+
+		pthread_mutex_lock(&up->lock);
+		r->retcode = ret;
+		r->elapsed = update_time() - started;
+		up->finished++;
+		pthread_cond_broadcast(&up->cond);
+	}
+	pthread_mutex_unlock(&up->lock);
+
+	return (NULL);
+}
+
+int
+pkg_update_repos(struct pkg_update_repo *repos, int nrepos)
+{
+	struct update_pool up;
+	struct timespec ts;
+	pthread_t *threads;
+	int64_t workers, done, total;
+	time_t now, last = 0;
+	int i, nthreads = 0, ret;
+	int retcode = EPKG_OK;
+
+	if (pkg_config_int64(PKG_CONFIG_FETCH_WORKERS, &workers) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (workers > nrepos)
+		workers = nrepos;
+
+	if (workers <= 1) {
+		for (i = 0; i < nrepos; i++) {
+			repos[i].elapsed = update_time();
+			repos[i].retcode = pkg_update(repos[i].name,
+			    repos[i].packagesite);
+			repos[i].elapsed = update_time() - repos[i].elapsed;
+		}
+		goto status;
+	}
+
+	if ((threads = calloc(workers, sizeof(pthread_t))) == NULL) {
+		pkg_emit_errno("calloc", "update_pool");
+		return (EPKG_FATAL);
+	}
+
+	memset(&up, 0, sizeof(struct update_pool));
+	up.repos = repos;
+	up.nrepos = nrepos;
+	up.begin = time(NULL);
+	snprintf(up.label, sizeof(up.label), "%d repositories", nrepos);
+	pthread_mutex_init(&up.lock, NULL);
+	pthread_cond_init(&up.cond, NULL);
+
+	for (i = 0; i < workers; i++) {
+		ret = pthread_create(&threads[i], NULL, update_pool_worker, &up);
+		if (ret != 0) {
+			pkg_emit_error("pthread_create: %s", strerror(ret));
+			break;
+		}
+		nthreads++;
+	}
+
+	/* without any worker, the repositories are updated here */
+	if (nthreads == 0)
+		update_pool_worker(&up);
+
+	pthread_mutex_lock(&up.lock);
+	while (up.finished < nrepos) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&up.cond, &up.lock, &ts);
+
+		now = time(NULL);
+		if (now == last)
+			continue;
+		last = now;
+		done = up.done;
+		total = up.total;
+
+		pthread_mutex_unlock(&up.lock);
+		/* done == total would end the progress meter */
+		if (done > 0 && done < total)
+			pkg_emit_fetching(up.label, total, done, now - up.begin);
+		pthread_mutex_lock(&up.lock);
+	}
+	pthread_mutex_unlock(&up.lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (up.done > 0)
+		pkg_emit_fetching(up.label, up.total, up.total,
+		    time(NULL) - up.begin);
+
+	pthread_mutex_destroy(&up.lock);
+	pthread_cond_destroy(&up.cond);
+	free(threads);
+
+	status:
+	for (i = 0; i < nrepos; i++)
+		if (repos[i].retcode != EPKG_OK && repos[i].retcode != EPKG_UPTODATE)
+			retcode = EPKG_FATAL;
+
+	return (retcode);
+}
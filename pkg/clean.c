@@ -1,12 +1,10 @@
 #include <sys/types.h>
-#include <sys/stat.h>
 
 #include <err.h>
-#include <fts.h>
+#include <inttypes.h>
+#include <libutil.h>
 #include <pkg.h>
-#include <stdbool.h>
-#include <string.h>
-#include <unistd.h>
+#include <stdio.h>
 
 #include "clean.h"
 
@@ -21,91 +19,62 @@ exec_clean(int argc, char **argv)
 {
 	struct pkgdb *db = NULL;
 	struct pkgdb_it *it = NULL;
-	struct pkg *pkg = NULL;
 	struct pkg *p = NULL;
-	FTS *fts = NULL;
-	FTSENT *ent = NULL;
-	const char *cachedir;
-	char *paths[2];
-	char *repopath;
-	bool to_delete;
+	struct pkg_cache_entry *e = NULL;
+	const char *cksum, *name;
+	char size[7];
+	int64_t count, bytes;
 	int retcode = 1;
 	int ret;
 
 	(void)argc;
 	(void)argv;
 
-	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK) {
-		warnx("Cant get cachedir config entry");
-		return 1;
-	}
-
-	paths[0] = __DECONST(char*, cachedir);
-	paths[1] = NULL;
-
 	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK) {
 		goto cleanup;
 	}
 
-	if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL) {
-		warn("fts_open(%s)", cachedir);
-		goto cleanup;
-	}
-
-	while ((ent = fts_read(fts)) != NULL) {
-		const char *origin, *pkgrepopath;
-
-		if (ent->fts_info != FTS_F)
-			continue;
-
-		repopath = ent->fts_path + strlen(cachedir);
-		if (repopath[0] == '/')
-			repopath++;
-
-		if (pkg_open(&pkg, ent->fts_path, NULL) != EPKG_OK) {
-			warnx("skipping %s", ent->fts_path);
-			continue;
-		}
-
-		pkg_get(pkg, PKG_ORIGIN, &origin);
-		it = pkgdb_rquery(db, origin, MATCH_EXACT, FIELD_ORIGIN, NULL);
+	/* the cache index is enough, the packages are not opened */
+	while ((ret = pkg_cache_list(&e)) == EPKG_OK) {
+		cksum = pkg_cache_get(e, PKG_CACHE_CKSUM);
+		name = pkg_cache_get(e, PKG_CACHE_NAME);
 
+		it = pkgdb_rquery(db, cksum, MATCH_EXACT, FIELD_CKSUM, NULL);
 		if (it == NULL) {
-			warnx("skipping %s", ent->fts_path);
+			warnx("skipping %s", name);
 			continue;
 		}
 
 		ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC);
-		to_delete = false;
-		pkg_get(pkg, PKG_REPOPATH, &pkgrepopath);
+		pkgdb_it_free(it);
 		if (ret == EPKG_FATAL) {
-			warnx("skipping %s", ent->fts_path);
+			warnx("skipping %s", name);
 			continue;
 		} else if (ret == EPKG_END) {
-			to_delete = true;
-			printf("%s does not exist anymore, deleting\n", repopath);
-		} else if (strcmp(repopath, pkgrepopath)) {
-			printf("%s is out-of-date, deleting\n", repopath);
-			to_delete = true;
+			printf("%s is not in the repositories anymore, deleting\n",
+			    name);
+			if (pkg_cache_remove(cksum) != EPKG_OK)
+				warnx("cannot remove %s", name);
 		}
+	}
 
-		if (to_delete == true) {
-			if (unlink(ent->fts_path) != 0)
-				warn("unlink(%s)", ent->fts_path);
-		}
+	if (ret != EPKG_END)
+		goto cleanup;
 
-		pkgdb_it_free(it);
+	/* what the index does not know of, the packages of the older layout */
+	if (pkg_cache_prune(&count, &bytes) != EPKG_OK)
+		warnx("cannot remove all the files outside the cache layout");
+	else
+		retcode = 0;
+	if (count > 0) {
+		humanize_number(size, sizeof(size), bytes, "B", HN_AUTOSCALE, 0);
+		printf("%" PRId64 " file(s) outside the cache layout deleted, "
+		    "%s reclaimed\n", count, size);
 	}
 
-	retcode = 0;
-
 	cleanup:
-	if (pkg != NULL)
-		pkg_free(pkg);
 	if (p != NULL)
 		pkg_free(p);
-	if (fts != NULL)
-		fts_close(fts);
 	if (db != NULL)
 		pkgdb_close(db);
 
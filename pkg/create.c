@@ -137,6 +137,8 @@ exec_create(int argc, char **argv)
 	} else {
 		if (strcmp(format, "txz") == 0)
 			fmt = TXZ;
+		else if (strcmp(format, "tzst") == 0)
+			fmt = TZST;
 		else if (strcmp(format, "tbz") == 0)
 			fmt = TBZ;
 		else if (strcmp(format, "tgz") == 0)
@@ -1,6 +1,8 @@
 #include <sys/param.h>
+#include <inttypes.h>
 #include <string.h>
 #include <err.h>
+#include <libutil.h>
 #include <stdarg.h>
 
 #include "pkg.h"
@@ -17,8 +19,8 @@ event_callback(void *data, struct pkg_event *ev)
 	struct pkg_dep *dep = NULL;
 	const char *message;
 	int *debug = data;
-	(void)debug;
 	const char *name, *version, *newversion;
+	char size[7];
 
 	switch(ev->type) {
 	case PKG_EVENT_ERRNO:
@@ -56,6 +58,23 @@ event_callback(void *data, struct pkg_event *ev)
 	case PKG_EVENT_INTEGRITYCHECK_FINISHED:
 		printf(" done\n");
 		break;
+	case PKG_EVENT_STAGE_TIMES:
+		if (*debug == 0)
+			break;
+		printf("Fetched in %.2fs, verified in %.2fs, extracted in %.2fs "
+		    "(%.2fs during the downloads), total %.2fs\n",
+		    ev->e_stage_times.fetch, ev->e_stage_times.verify,
+		    ev->e_stage_times.extract, ev->e_stage_times.overlap,
+		    ev->e_stage_times.total);
+		printf("%" PRId64 " connections opened, %" PRId64 " reused\n",
+		    ev->e_stage_times.opened, ev->e_stage_times.reused);
+		break;
+	case PKG_EVENT_CACHE_EVICTED:
+		humanize_number(size, sizeof(size), ev->e_cache_evicted.bytes,
+		    "B", HN_AUTOSCALE, 0);
+		printf("Reclaimed %s from the cache, %" PRId64 " package(s) "
+		    "evicted\n", size, ev->e_cache_evicted.count);
+		break;
 	case PKG_EVENT_DEINSTALL_BEGIN:
 		pkg_get(ev->e_deinstall_begin.pkg, PKG_NAME, &name, PKG_VERSION, &version);
 		printf("Deinstalling %s-%s...", name, version);
@@ -1,8 +1,10 @@
 #include <sysexits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
 #include <readpassphrase.h>
+#include <unistd.h>
 
 #include <pkg.h>
 
@@ -13,7 +15,7 @@
 void
 usage_repo(void)
 {
-	fprintf(stderr, "usage: pkg repo <repo-path> <rsa-key>\n\n");
+	fprintf(stderr, "usage: pkg repo [-di] <repo-path> <rsa-key>\n\n");
 	fprintf(stderr, "For more information see 'pkg help repo'.\n");
 }
 
@@ -65,23 +67,42 @@ exec_repo(int argc, char **argv)
 {
 	int retcode = EPKG_OK;
 	int pos = 0;
+	int ch;
 	char *rsa_key;
+	bool delta = false;
+	bool incremental = false;
+
+	while ((ch = getopt(argc, argv, "di")) != -1) {
+		switch (ch) {
+		case 'd':
+			delta = true;
+			break;
+		case 'i':
+			incremental = true;
+			break;
+		default:
+			usage_repo();
+			return (EX_USAGE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc < 2 || argc > 3) {
+	if (argc < 1 || argc > 2) {
 		usage_repo();
 		return (EX_USAGE);
 	}
 
-	printf("Generating repo.sqlite in %s:  ", argv[1]);
-	retcode = pkg_create_repo(argv[1], progress, &pos);
+	printf("Generating repo.sqlite in %s:  ", argv[0]);
+	retcode = pkg_create_repo(argv[0], incremental, progress, &pos);
 
 	if (retcode != EPKG_OK)
 		printf("can not create repository");
 	else
 		printf("\bDone!\n");
 
-	rsa_key = (argc == 3) ? argv[2] : NULL;
-	pkg_finish_repo(argv[1], password_cb, rsa_key);
+	rsa_key = (argc == 2) ? argv[1] : NULL;
+	pkg_finish_repo(argv[0], password_cb, rsa_key, delta);
 
 	return (retcode);
 }
@@ -0,0 +1,246 @@
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "bench.h"
+
+static struct bench benches[] = {
+	{ "closure", "resolve installs against a 25000 packages catalogue", bench_closure },
+	{ "decompress", "decompress the same payload as txz and tzst", bench_decompress },
+	{ "register", "register packages under a concurrent reader", bench_register },
+	{ "rquery", "iterate a 30000 packages remote catalogue", bench_rquery },
+	{ "search", "search the comments of a 25000 packages catalogue", bench_search },
+	{ NULL, NULL, NULL },
+};
+
+double
+bench_elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+int
+bench_sql(sqlite3 *s, const char *sql)
+{
+	char *errmsg;
+
+	if (sqlite3_exec(s, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		warnx("sqlite: %s", errmsg);
+		sqlite3_free(errmsg);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Fill a repo.sqlite with npkgs synthetic packages, each with a couple of
+ * dependencies on lower numbered ones, categories, licenses and options.
+ */
+int
+bench_remote_catalogue(const char *path, int npkgs)
+{
+	sqlite3 *s;
+	sqlite3_stmt *stmt_pkg = NULL, *stmt_dep = NULL;
+	struct sbuf *vkey = sbuf_new_auto();
+	char origin[BUFSIZ], name[BUFSIZ], deporigin[BUFSIZ], depname[BUFSIZ];
+	int i, j, ret = EPKG_FATAL;
+	const char initsql[] = ""
+		"CREATE TABLE packages ("
+			"id INTEGER PRIMARY KEY, origin TEXT UNIQUE, "
+			"name TEXT NOT NULL, version TEXT NOT NULL, "
+			"comment TEXT NOT NULL, desc TEXT NOT NULL, "
+			"arch TEXT NOT NULL, osversion TEXT NOT NULL, "
+			"maintainer TEXT NOT NULL, www TEXT, "
+			"prefix TEXT NOT NULL, pkgsize INTEGER NOT NULL, "
+			"flatsize INTEGER NOT NULL, licenselogic INTEGER NOT NULL, "
+			"cksum TEXT NOT NULL, path TEXT NOT NULL, "
+			"pkg_format_version INTEGER, vkey BLOB);"
+		"CREATE INDEX packages_vkey ON packages(origin, vkey);"
+		"CREATE VIRTUAL TABLE packages_fts USING fts4(name, comment, desc);"
+		"CREATE TABLE deps (origin TEXT, name TEXT, version TEXT, "
+			"package_id INTEGER REFERENCES packages(id), "
+			"UNIQUE(package_id, origin));"
+		"CREATE TABLE categories (id INTEGER PRIMARY KEY, "
+			"name TEXT NOT NULL UNIQUE);"
+		"CREATE TABLE pkg_categories ("
+			"package_id INTEGER REFERENCES packages(id), "
+			"category_id INTEGER REFERENCES categories(id), "
+			"UNIQUE(package_id, category_id));"
+		"CREATE TABLE licenses (id INTEGER PRIMARY KEY, "
+			"name TEXT NOT NULL UNIQUE);"
+		"CREATE TABLE pkg_licenses ("
+			"package_id INTEGER REFERENCES packages(id), "
+			"license_id INTEGER REFERENCES licenses(id), "
+			"UNIQUE(package_id, license_id));"
+		"CREATE TABLE options ("
+			"package_id INTEGER REFERENCES packages(id), "
+			"option TEXT, value TEXT, UNIQUE (package_id, option));"
+		"PRAGMA user_version=4;";
+	const char pkgsql[] = ""
+		"INSERT INTO packages (origin, name, version, comment, desc, "
+			"arch, osversion, maintainer, www, prefix, pkgsize, "
+			"flatsize, licenselogic, cksum, path, vkey) "
+		"VALUES (?1, ?2, '1.0_1', 'benchmark package ' || ?2, "
+			"'a package generated by the benchmark suite', "
+			"'freebsd:9:x86:64', '900044', 'ports@FreeBSD.org', "
+			"'http://www.FreeBSD.org', '/usr/local', 4096, 16384, 1, "
+			"'0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef', "
+			"?3, ?4);";
+	const char depsql[] = ""
+		"INSERT INTO deps (origin, name, version, package_id) "
+		"VALUES (?1, ?2, '1.0_1', ?3);";
+
+	unlink(path);
+
+	if (sqlite3_open(path, &s) != SQLITE_OK)
+		goto cleanup;
+
+	if (bench_sql(s, initsql) != EPKG_OK ||
+	    bench_sql(s, "BEGIN;") != EPKG_OK)
+		goto cleanup;
+
+	if (sqlite3_prepare_v2(s, pkgsql, -1, &stmt_pkg, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(s, depsql, -1, &stmt_dep, NULL) != SQLITE_OK) {
+		warnx("sqlite: %s", sqlite3_errmsg(s));
+		goto cleanup;
+	}
+
+	pkg_version_key("1.0_1", vkey);
+
+	for (i = 0; i < npkgs; i++) {
+		snprintf(origin, sizeof(origin), "bench/pkg%05d", i);
+		snprintf(name, sizeof(name), "pkg%05d", i);
+		sqlite3_bind_text(stmt_pkg, 1, origin, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 2, name, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 3, origin, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(stmt_pkg, 4, sbuf_data(vkey), sbuf_len(vkey), SQLITE_STATIC);
+		if (sqlite3_step(stmt_pkg) != SQLITE_DONE) {
+			warnx("sqlite: %s", sqlite3_errmsg(s));
+			goto cleanup;
+		}
+		sqlite3_reset(stmt_pkg);
+
+		/* a dependency tree about log2(npkgs) levels deep */
+		for (j = i / 2; j > i / 6; j = j * 2 / 3) {
+			snprintf(deporigin, sizeof(deporigin), "bench/pkg%05d", j);
+			snprintf(depname, sizeof(depname), "pkg%05d", j);
+			sqlite3_bind_text(stmt_dep, 1, deporigin, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt_dep, 2, depname, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt_dep, 3, i + 1);
+			if (sqlite3_step(stmt_dep) != SQLITE_DONE) {
+				warnx("sqlite: %s", sqlite3_errmsg(s));
+				goto cleanup;
+			}
+			sqlite3_reset(stmt_dep);
+		}
+	}
+
+	if (bench_sql(s, ""
+	    "INSERT INTO categories(name) VALUES ('bench');"
+	    "INSERT INTO licenses(name) VALUES ('BSD');"
+	    "INSERT INTO pkg_categories SELECT id, 1 FROM packages;"
+	    "INSERT INTO pkg_licenses SELECT id, 1 FROM packages;"
+	    "INSERT INTO options SELECT id, 'DOCS', 'on' FROM packages;"
+	    "INSERT INTO packages_fts(docid, name, comment, desc) "
+	        "SELECT id, name, comment, desc FROM packages;"
+	    "COMMIT;") != EPKG_OK)
+		goto cleanup;
+
+	ret = EPKG_OK;
+
+cleanup:
+	if (stmt_pkg != NULL)
+		sqlite3_finalize(stmt_pkg);
+	if (stmt_dep != NULL)
+		sqlite3_finalize(stmt_dep);
+	sqlite3_close(s);
+	sbuf_delete(vkey);
+
+	return (ret);
+}
+
+static struct bench *
+bench_find(const char *name)
+{
+	int i;
+
+	for (i = 0; benches[i].name != NULL; i++) {
+		if (strcmp(benches[i].name, name) == 0)
+			return (&benches[i]);
+	}
+
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+	int i;
+
+	fprintf(stderr, "usage: bench [name ...]\n\n");
+	for (i = 0; benches[i].name != NULL; i++)
+		fprintf(stderr, "\t%-12s %s\n", benches[i].name, benches[i].desc);
+	exit(EX_USAGE);
+}
+
+static int
+bench_run(struct bench *b, const char *tmpdir)
+{
+	printf("%s: %s\n", b->name, b->desc);
+	if (b->run(tmpdir) != EPKG_OK) {
+		printf("%s: FAILED\n", b->name);
+		return (1);
+	}
+
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/pkgbench.XXXXXX";
+	char conf[MAXPATHLEN + 1];
+	int i, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (bench_find(argv[i]) == NULL)
+			usage();
+	}
+
+	if (mkdtemp(tmpdir) == NULL)
+		err(1, "mkdtemp");
+
+	/* everything the library writes goes into the scratch directory */
+	setenv("PKG_DBDIR", tmpdir, 1);
+	setenv("PKG_CACHEDIR", tmpdir, 1);
+
+	snprintf(conf, sizeof(conf), "%s/pkg.conf", tmpdir);
+	if (pkg_init(conf) != EPKG_OK)
+		errx(1, "can not initialize libpkg");
+
+	if (argc == 1) {
+		for (i = 0; benches[i].name != NULL; i++)
+			ret |= bench_run(&benches[i], tmpdir);
+	} else {
+		for (i = 1; i < argc; i++)
+			ret |= bench_run(bench_find(argv[i]), tmpdir);
+	}
+
+	pkg_shutdown();
+
+	return (ret);
+}
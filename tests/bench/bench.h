@@ -0,0 +1,24 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <sys/time.h>
+
+#include "sqlite3.h"
+
+struct bench {
+	const char *name;
+	const char *desc;
+	int (*run)(const char *tmpdir);
+};
+
+double bench_elapsed(struct timeval *start);
+int bench_sql(sqlite3 *s, const char *sql);
+int bench_remote_catalogue(const char *path, int npkgs);
+
+int bench_closure(const char *);
+int bench_decompress(const char *);
+int bench_register(const char *);
+int bench_rquery(const char *);
+int bench_search(const char *);
+
+#endif
@@ -0,0 +1,66 @@
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+
+#include <pkg.h>
+
+#include "bench.h"
+
+#define CLOSURE_NPKGS 25000
+#define CLOSURE_NREQUESTS 50
+#define CLOSURE_ROUNDS 5
+
+/*
+ * Ask for the installation of the last packages of the catalogue, which
+ * pulls the dependency tree of each of them into the job list.
+ */
+int
+bench_closure(const char *tmpdir)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it = NULL;
+	struct pkg *pkg = NULL;
+	struct timeval start;
+	char path[MAXPATHLEN + 1];
+	char names[CLOSURE_NREQUESTS][BUFSIZ];
+	char *pkgs[CLOSURE_NREQUESTS];
+	double elapsed;
+	int i, n, ret = EPKG_FATAL;
+
+	snprintf(path, sizeof(path), "%s/repo.sqlite", tmpdir);
+	if (bench_remote_catalogue(path, CLOSURE_NPKGS) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < CLOSURE_NREQUESTS; i++) {
+		snprintf(names[i], sizeof(names[i]), "pkg%05d",
+		    CLOSURE_NPKGS - 1 - i);
+		pkgs[i] = names[i];
+	}
+
+	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < CLOSURE_ROUNDS; i++) {
+		gettimeofday(&start, NULL);
+		if ((it = pkgdb_query_installs(db, MATCH_EXACT,
+		    CLOSURE_NREQUESTS, pkgs, NULL)) == NULL)
+			goto cleanup;
+
+		n = 0;
+		while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK)
+			n++;
+		pkgdb_it_free(it);
+		elapsed = bench_elapsed(&start);
+
+		printf("\tround %d: %d jobs in %.3fs\n", i + 1, n, elapsed);
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	pkg_free(pkg);
+	pkgdb_close(db);
+
+	return (ret);
+}
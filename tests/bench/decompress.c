@@ -0,0 +1,161 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "bench.h"
+
+#define DECOMPRESS_SIZE (64 * 1024 * 1024)
+#define DECOMPRESS_ROUNDS 3
+
+/*
+ * A payload which compresses about like the files of a package: lines of
+ * text from a small set, with some binary in between.
+ */
+static int
+write_payload(const char *path)
+{
+	static const char *lines[] = {
+		"static int",
+		"\treturn (EPKG_OK);",
+		"\tif (pkg == NULL)",
+		"\t\treturn (EPKG_FATAL);",
+		"\tstruct archive_entry *ae;",
+		"\tsnprintf(path, sizeof(path), \"%s/%s\", prefix, name);",
+		"/usr/local/lib/libfoo.so.1",
+		"The packages are installed in the prefix directory.",
+		"}",
+		"",
+	};
+	FILE *fp;
+	off_t n = 0;
+	int i, nlines = sizeof(lines) / sizeof(lines[0]);
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		return (EPKG_FATAL);
+	}
+
+	srandom(0);
+	while (n < DECOMPRESS_SIZE) {
+		if (random() % 256 == 0) {
+			for (i = 0; i < 512; i++)
+				fputc(random() & 0xff, fp);
+			n += 512;
+		} else {
+			n += fprintf(fp, "%s\n", lines[random() % nlines]);
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		perror(path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Read all the entries of the archive, as do_extract() does before writing
+ * them to the disk.
+ */
+static int
+decompress(const char *path, int64_t *size)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	char buf[65536];
+	ssize_t r;
+	int ret;
+
+	*size = 0;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_filename(a, path, 4096) != ARCHIVE_OK) {
+		fprintf(stderr, "%s: %s\n", path, archive_error_string(a));
+		archive_read_finish(a);
+		return (EPKG_FATAL);
+	}
+
+	while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		while ((r = archive_read_data(a, buf, sizeof(buf))) > 0)
+			*size += r;
+	}
+
+	if (ret != ARCHIVE_EOF)
+		fprintf(stderr, "%s: %s\n", path, archive_error_string(a));
+	archive_read_finish(a);
+
+	return (ret == ARCHIVE_EOF ? EPKG_OK : EPKG_FATAL);
+}
+
+/*
+ * Decompression throughput of the same payload packed as txz and tzst.
+ */
+int
+bench_decompress(const char *tmpdir)
+{
+	static const struct {
+		pkg_formats format;
+		const char *ext;
+	} formats[] = {
+		{ TXZ, "txz" },
+		{ TZST, "tzst" },
+	};
+	struct packing *pack;
+	struct timeval start;
+	struct stat st;
+	char payload[MAXPATHLEN + 1];
+	char path[MAXPATHLEN + 1];
+	double elapsed;
+	int64_t size;
+	int i, j;
+
+	snprintf(payload, sizeof(payload), "%s/payload", tmpdir);
+	if (write_payload(payload) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+		if (!packing_format_supported(formats[i].format)) {
+			fprintf(stderr, "decompress: libarchive does not "
+			    "support %s\n", formats[i].ext);
+			return (EPKG_FATAL);
+		}
+
+		if (packing_init(&pack, payload, formats[i].format, -1, -1) !=
+		    EPKG_OK ||
+		    packing_append_file(pack, payload, "payload") != EPKG_OK)
+			return (EPKG_FATAL);
+		packing_finish(pack);
+
+		snprintf(path, sizeof(path), "%s.%s", payload, formats[i].ext);
+		if (stat(path, &st) == -1) {
+			perror(path);
+			return (EPKG_FATAL);
+		}
+
+		for (j = 0; j < DECOMPRESS_ROUNDS; j++) {
+			gettimeofday(&start, NULL);
+			if (decompress(path, &size) != EPKG_OK)
+				return (EPKG_FATAL);
+			elapsed = bench_elapsed(&start);
+
+			printf("\t%s round %d: %.1f MB from %.1f MB in %.3fs "
+			    "(%.0f MB/s)\n", formats[i].ext, j + 1,
+			    size / 1048576.0, st.st_size / 1048576.0, elapsed,
+			    size / 1048576.0 / elapsed);
+		}
+	}
+
+	return (EPKG_OK);
+}
@@ -0,0 +1,159 @@
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "bench.h"
+
+#define REGISTER_NPKGS 500
+#define REGISTER_NFILES 50
+
+/*
+ * Query the local database in a loop until killed, and report how many
+ * queries went through, how many failed and the slowest one.
+ */
+static void
+reader(int fd)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	struct timeval start;
+	double elapsed, worst = 0;
+	int ok = 0, failed = 0;
+	char buf[BUFSIZ];
+	ssize_t len;
+
+	for (;;) {
+		gettimeofday(&start, NULL);
+		if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK) {
+			failed++;
+		} else if ((it = pkgdb_query(db, NULL, MATCH_ALL)) == NULL) {
+			failed++;
+		} else {
+			while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK)
+				;
+			pkgdb_it_free(it);
+			ok++;
+		}
+		pkgdb_close(db);
+		db = NULL;
+		elapsed = bench_elapsed(&start);
+		if (elapsed > worst)
+			worst = elapsed;
+
+		len = snprintf(buf, sizeof(buf), "%d %d %f\n", ok, failed,
+		    worst);
+		if (pwrite(fd, buf, len, 0) != len)
+			_exit(1);
+	}
+}
+
+static int
+register_one(struct pkgdb *db, int n)
+{
+	struct pkg *pkg = NULL;
+	char origin[BUFSIZ], name[BUFSIZ], path[MAXPATHLEN + 1];
+	int i, ret;
+
+	snprintf(origin, sizeof(origin), "bench/reg%05d", n);
+	snprintf(name, sizeof(name), "reg%05d", n);
+
+	pkg_new(&pkg, PKG_FILE);
+	pkg_set(pkg, PKG_ORIGIN, origin, PKG_NAME, name,
+	    PKG_VERSION, "1.0_1", PKG_COMMENT, "benchmark package",
+	    PKG_DESC, "a package generated by the benchmark suite",
+	    PKG_ARCH, "freebsd:9:x86:64", PKG_OSVERSION, "900044",
+	    PKG_MAINTAINER, "ports@FreeBSD.org", PKG_WWW, "http://www.FreeBSD.org",
+	    PKG_PREFIX, "/usr/local");
+	for (i = 0; i < REGISTER_NFILES; i++) {
+		snprintf(path, sizeof(path), "/usr/local/share/%s/file%d",
+		    name, i);
+		pkg_addfile(pkg, path, "0123456789abcdef0123456789abcdef"
+		    "0123456789abcdef0123456789abcdef");
+	}
+
+	ret = pkgdb_register_pkg(db, pkg, 0);
+	ret = pkgdb_register_finale(db, ret);
+	pkg_free(pkg);
+
+	return (ret);
+}
+
+/*
+ * Register packages one transaction each, as pkg add does, while another
+ * process keeps querying the database.  Run it once per PKG_DBPROFILE.
+ */
+int
+bench_register(const char *tmpdir)
+{
+	struct pkgdb *db = NULL;
+	struct timeval start;
+	char stats[MAXPATHLEN + 1];
+	const char *profile = NULL;
+	double elapsed, worst = 0;
+	int i, ok = 0, failed = 0;
+	int fd, ret = EPKG_FATAL;
+	pid_t pid;
+	FILE *fp;
+
+	pkg_config_string(PKG_CONFIG_DBPROFILE, &profile);
+	printf("\tprofile: %s\n", profile);
+
+	/* create the database before the reader starts */
+	if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(stats, sizeof(stats), "%s/reader.stats", tmpdir);
+	if ((fd = open(stats, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		warn("open(%s)", stats);
+		goto cleanup;
+	}
+
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		close(fd);
+		goto cleanup;
+	}
+	if (pid == 0)
+		reader(fd);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < REGISTER_NPKGS; i++) {
+		if (register_one(db, i) != EPKG_OK)
+			break;
+	}
+	elapsed = bench_elapsed(&start);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	close(fd);
+
+	if (i != REGISTER_NPKGS)
+		goto cleanup;
+
+	printf("\twriter: %d packages in %.3fs (%.0f commit/s)\n", i, elapsed,
+	    i / elapsed);
+
+	if ((fp = fopen(stats, "r")) != NULL) {
+		if (fscanf(fp, "%d %d %lf", &ok, &failed, &worst) == 3)
+			printf("\treader: %d queries, %d failed, slowest %.3fs\n",
+			    ok, failed, worst);
+		fclose(fp);
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	pkgdb_close(db);
+
+	return (ret);
+}
@@ -0,0 +1,123 @@
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+
+#include <pkg.h>
+
+#include "bench.h"
+
+#define RQUERY_NPKGS 30000
+#define RQUERY_ROUNDS 5
+
+#define SEARCH_NPKGS 25000
+#define SEARCH_ROUNDS 20
+
+/*
+ * Walk the whole remote catalogue through pkgdb_rquery(), the way
+ * pkg search and pkg upgrade read it.
+ */
+int
+bench_rquery(const char *tmpdir)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it = NULL;
+	struct pkg *pkg = NULL;
+	struct timeval start;
+	char path[MAXPATHLEN + 1];
+	double elapsed;
+	int i, n, ret = EPKG_FATAL;
+
+	snprintf(path, sizeof(path), "%s/repo.sqlite", tmpdir);
+	if (bench_remote_catalogue(path, RQUERY_NPKGS) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < RQUERY_ROUNDS; i++) {
+		gettimeofday(&start, NULL);
+		if ((it = pkgdb_rquery(db, "*", MATCH_GLOB, FIELD_NAME, NULL)) == NULL)
+			goto cleanup;
+
+		n = 0;
+		while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK)
+			n++;
+		pkgdb_it_free(it);
+		elapsed = bench_elapsed(&start);
+
+		if (n != RQUERY_NPKGS) {
+			fprintf(stderr, "rquery: %d packages instead of %d\n", n,
+			    RQUERY_NPKGS);
+			goto cleanup;
+		}
+		printf("\tround %d: %d packages in %.3fs (%.0f pkg/s)\n", i + 1,
+		    n, elapsed, n / elapsed);
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	pkg_free(pkg);
+	pkgdb_close(db);
+
+	return (ret);
+}
+
+/*
+ * Search words and prefixes in the comments, as pkg search -c does,
+ * through the full text index of the catalogue.
+ */
+int
+bench_search(const char *tmpdir)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it = NULL;
+	struct pkg *pkg = NULL;
+	struct timeval start;
+	char path[MAXPATHLEN + 1];
+	char pattern[BUFSIZ];
+	double elapsed;
+	int i, n, ret = EPKG_FATAL;
+
+	snprintf(path, sizeof(path), "%s/repo.sqlite", tmpdir);
+	if (bench_remote_catalogue(path, SEARCH_NPKGS) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < SEARCH_ROUNDS; i++) {
+		/* an exact word on even rounds, a prefix on odd ones */
+		if (i % 2 == 0)
+			snprintf(pattern, sizeof(pattern), "pkg%05d", i * 997);
+		else
+			snprintf(pattern, sizeof(pattern), "pkg%03d*", i * 37 % 250);
+
+		gettimeofday(&start, NULL);
+		if ((it = pkgdb_rquery(db, pattern, MATCH_EXACT, FIELD_COMMENT,
+		    NULL)) == NULL)
+			goto cleanup;
+
+		n = 0;
+		while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK)
+			n++;
+		pkgdb_it_free(it);
+		elapsed = bench_elapsed(&start);
+
+		if (n == 0) {
+			fprintf(stderr, "search: nothing found for %s\n", pattern);
+			goto cleanup;
+		}
+		printf("\tround %d: %d packages for %s in %.2fms\n", i + 1,
+		    n, pattern, elapsed * 1000);
+	}
+
+	ret = EPKG_OK;
+
+cleanup:
+	pkg_free(pkg);
+	pkgdb_close(db);
+
+	return (ret);
+}
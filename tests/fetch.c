@@ -0,0 +1,717 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "tests.h"
+
+#define NPKGS 8
+#define PKGSIZE (256 * 1024)
+
+static char tmpdir[] = "/tmp/pkgfetch.XXXXXX";
+
+static void
+write_random(const char *path, int size)
+{
+	FILE *fp;
+	int k;
+
+	fail_unless((fp = fopen(path, "w")) != NULL);
+	for (k = 0; k < size; k++)
+		fputc(random() & 0xff, fp);
+	fclose(fp);
+}
+
+/*
+ * Write NPKGS packages of random content in the site, queue them in a job
+ * list and start serving the site with the given latency.
+ */
+static struct httpd *
+setup(struct pkg_jobs **j, const char *workers, int latency)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { latency };
+	struct pkg *p;
+	char path[MAXPATHLEN + 1];
+	char repopath[MAXPATHLEN + 1];
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char name[32];
+	int i;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/site/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+
+	fail_unless((h = httpd_start(tmpdir, &opts)) != NULL);
+	snprintf(path, sizeof(path), "http://127.0.0.1:%d/site",
+	    httpd_port(h));
+	setenv("PACKAGESITE", path, 1);
+	snprintf(path, sizeof(path), "%s/cache", tmpdir);
+	setenv("PKG_CACHEDIR", path, 1);
+	setenv("FETCH_WORKERS", workers, 1);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(path) == EPKG_OK);
+
+	fail_unless((*j = calloc(1, sizeof(struct pkg_jobs))) != NULL);
+	STAILQ_INIT(&(*j)->jobs);
+	LIST_INIT(&(*j)->nodes);
+
+	srandom(0);
+	for (i = 0; i < NPKGS; i++) {
+		snprintf(name, sizeof(name), "pkg%d", i);
+		snprintf(repopath, sizeof(repopath), "All/%s-1.0.txz", name);
+		snprintf(path, sizeof(path), "%s/site/%s", tmpdir, repopath);
+		write_random(path, PKGSIZE);
+		fail_unless(sha256_file(path, cksum) == EPKG_OK);
+
+		p = NULL;
+		fail_unless(pkg_new(&p, PKG_REMOTE) == EPKG_OK);
+		pkg_set(p, PKG_NAME, name, PKG_VERSION, "1.0",
+		    PKG_REPOPATH, repopath, PKG_CKSUM, cksum,
+		    PKG_NEW_PKGSIZE, (int64_t)PKGSIZE);
+		pkg_jobs_add(*j, p);
+	}
+
+	return (h);
+}
+
+static void
+teardown(struct httpd *h, struct pkg_jobs *j)
+{
+	char cmd[MAXPATHLEN + 10];
+
+	httpd_stop(h);
+	pkg_jobs_free(j);
+	pkg_shutdown();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+
+static int
+cached(struct pkg *p)
+{
+	char path[MAXPATHLEN + 1];
+	const char *sum;
+	struct stat st;
+
+	pkg_get(p, PKG_CKSUM, &sum);
+	fail_unless(pkg_cache_path(sum, path, sizeof(path)) == EPKG_OK);
+
+	return (stat(path, &st) == 0 && st.st_size == PKGSIZE);
+}
+
+START_TEST(fetch_concurrent)
+{
+	struct pkg_jobs *j;
+	struct pkg *p;
+	struct httpd *h;
+	const char *name;
+
+	h = setup(&j, "4", 200);
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	STAILQ_FOREACH(p, &j->jobs, next) {
+		pkg_get(p, PKG_NAME, &name);
+		fail_unless(cached(p), "%s not fetched", name);
+	}
+	fail_unless(httpd_requests(h) == NPKGS);
+	fail_unless(httpd_maxclients(h) > 1, "fetched sequentially");
+	fail_unless(httpd_maxclients(h) <= 4, "%d concurrent fetches",
+	    httpd_maxclients(h));
+
+	/* everything is in the cache now */
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	fail_unless(httpd_requests(h) == NPKGS);
+
+	teardown(h, j);
+}
+END_TEST
+
+START_TEST(fetch_sequential)
+{
+	struct pkg_jobs *j;
+	struct httpd *h;
+
+	h = setup(&j, "1", 50);
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	fail_unless(httpd_requests(h) == NPKGS);
+	fail_unless(httpd_maxclients(h) == 1);
+
+	teardown(h, j);
+}
+END_TEST
+
+START_TEST(fetch_checksum)
+{
+	char path[MAXPATHLEN + 1];
+	const char *sum;
+	struct pkg_jobs *j;
+	struct pkg *p;
+	struct httpd *h;
+
+	h = setup(&j, "4", 50);
+
+	/* a package corrupted on the site */
+	p = STAILQ_FIRST(&j->jobs);
+	pkg_set(p, PKG_CKSUM,
+	    "0000000000000000000000000000000000000000000000000000000000000000");
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_FATAL);
+	fail_if(cached(p), "corrupted package left in the cache");
+	pkg_get(p, PKG_CKSUM, &sum);
+	fail_unless(pkg_cache_path(sum, path, sizeof(path)) == EPKG_OK);
+	strlcat(path, ".part", sizeof(path));
+	fail_unless(access(path, F_OK) != 0, "corrupted download kept");
+
+	teardown(h, j);
+}
+END_TEST
+
+/*
+ * A verified package is trusted until it is modified.
+ */
+START_TEST(fetch_cache_index)
+{
+	struct pkg_jobs *j;
+	struct pkg *p;
+	struct pkg_cache_entry *e = NULL;
+	struct httpd *h;
+	struct stat st;
+	struct timeval tv[2];
+	char path[MAXPATHLEN + 1];
+	const char *sum;
+	FILE *fp;
+	int n = 0;
+
+	h = setup(&j, "1", 0);
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	while (pkg_cache_list(&e) == EPKG_OK)
+		n++;
+	fail_unless(n == NPKGS, "%d packages in the index", n);
+
+	/* damaged without a trace: not hashed again */
+	p = STAILQ_FIRST(&j->jobs);
+	pkg_get(p, PKG_CKSUM, &sum);
+	fail_unless(pkg_cache_path(sum, path, sizeof(path)) == EPKG_OK);
+	fail_unless(stat(path, &st) == 0);
+	fail_unless((fp = fopen(path, "r+")) != NULL);
+	n = fgetc(fp);
+	fseek(fp, 0, SEEK_SET);
+	fputc(~n, fp);
+	fclose(fp);
+	tv[0].tv_sec = st.st_atime;
+	tv[1].tv_sec = st.st_mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	fail_unless(utimes(path, tv) == 0);
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	fail_unless(httpd_requests(h) == NPKGS);
+
+	/* modified: hashed and fetched again */
+	tv[1].tv_sec++;
+	fail_unless(utimes(path, tv) == 0);
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	fail_unless(httpd_requests(h) == NPKGS + 1);
+	fail_unless(cached(p));
+	fail_unless(pkg_cache_verified(sum));
+
+	fail_unless(pkg_cache_remove(sum) == EPKG_OK);
+	fail_unless(access(path, F_OK) != 0);
+	for (n = 0, e = NULL; pkg_cache_list(&e) == EPKG_OK; n++)
+		fail_if(strcmp(pkg_cache_get(e, PKG_CACHE_CKSUM), sum) == 0);
+	fail_unless(n == NPKGS - 1);
+
+	teardown(h, j);
+}
+END_TEST
+
+/*
+ * Over CACHE_SIZE, the least recently used packages are evicted once the
+ * jobs do not need them anymore.
+ */
+START_TEST(fetch_cache_budget)
+{
+	struct pkg_jobs *j;
+	struct pkg *p, *first;
+	struct pkg_cache_entry *e = NULL;
+	struct httpd *h;
+	const char *name;
+	int i = 0, n = 0;
+
+	/* room for half of the packages */
+	setenv("CACHE_SIZE", "1", 1);
+	h = setup(&j, "1", 0);
+
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	STAILQ_FOREACH(p, &j->jobs, next)
+		fail_unless(cached(p), "package in use evicted");
+
+	/* pkg0 becomes the most recently used */
+	first = STAILQ_FIRST(&j->jobs);
+	fail_unless(pkg_repo_fetch(first) == EPKG_OK);
+	fail_unless(httpd_requests(h) == NPKGS);
+
+	pkg_cache_release();
+	STAILQ_FOREACH(p, &j->jobs, next) {
+		pkg_get(p, PKG_NAME, &name);
+		if (p == first || i > NPKGS / 2)
+			fail_unless(cached(p), "%s evicted", name);
+		else if (i > 0)
+			fail_if(cached(p), "%s kept", name);
+		i++;
+	}
+	while (pkg_cache_list(&e) == EPKG_OK)
+		n++;
+	fail_unless(n == NPKGS / 2, "%d packages in the index", n);
+
+	teardown(h, j);
+	unsetenv("CACHE_SIZE");
+}
+END_TEST
+
+/*
+ * The files of the older layout are pruned, the packages, the downloads
+ * to resume and the index are kept.
+ */
+START_TEST(fetch_cache_prune)
+{
+	struct pkg_jobs *j;
+	struct pkg *p;
+	struct pkg_cache_entry *e = NULL;
+	struct httpd *h;
+	char path[MAXPATHLEN + 1];
+	char part[MAXPATHLEN + 1];
+	const char *sum;
+	int64_t count, bytes;
+	int n = 0;
+
+	h = setup(&j, "1", 0);
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+
+	snprintf(path, sizeof(path), "%s/cache/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/cache/All/pkg0-1.0.txz", tmpdir);
+	write_random(path, 1000);
+	snprintf(path, sizeof(path), "%s/cache/index.AbCdEf", tmpdir);
+	write_random(path, 10);
+	p = STAILQ_FIRST(&j->jobs);
+	pkg_get(p, PKG_CKSUM, &sum);
+	fail_unless(pkg_cache_path(sum, path, sizeof(path)) == EPKG_OK);
+	snprintf(part, sizeof(part), "%s.part", path);
+	write_random(part, 10);
+	snprintf(part, sizeof(part), "%s.txz", path);
+	write_random(part, 10);
+
+	fail_unless(pkg_cache_prune(&count, &bytes) == EPKG_OK);
+	fail_unless(count == 3, "%jd files pruned", (intmax_t)count);
+	fail_unless(bytes == 1020, "%jd bytes pruned", (intmax_t)bytes);
+	snprintf(path, sizeof(path), "%s/cache/All", tmpdir);
+	fail_unless(access(path, F_OK) != 0, "old layout left");
+	STAILQ_FOREACH(p, &j->jobs, next)
+		fail_unless(cached(p));
+	pkg_get(STAILQ_FIRST(&j->jobs), PKG_CKSUM, &sum);
+	fail_unless(pkg_cache_path(sum, path, sizeof(path)) == EPKG_OK);
+	snprintf(part, sizeof(part), "%s.part", path);
+	fail_unless(access(part, F_OK) == 0, "download removed");
+	while (pkg_cache_list(&e) == EPKG_OK)
+		n++;
+	fail_unless(n == NPKGS, "%d packages in the index", n);
+
+	teardown(h, j);
+}
+END_TEST
+
+/*
+ * A package used by another process is not evicted, until that process
+ * exits.
+ */
+START_TEST(fetch_cache_pinned)
+{
+	struct pkg_jobs *j;
+	struct pkg *p, *first;
+	struct httpd *h;
+	const char *sum, *name;
+	pid_t pid;
+	int in[2], out[2];
+	char c;
+
+	setenv("CACHE_SIZE", "1", 1);
+	h = setup(&j, "1", 0);
+	fail_unless(pkg_jobs_fetch(j) == EPKG_OK);
+	first = STAILQ_FIRST(&j->jobs);
+	pkg_get(first, PKG_CKSUM, &sum);
+
+	fail_unless(pipe(in) == 0 && pipe(out) == 0);
+	fail_unless((pid = fork()) != -1);
+	if (pid == 0) {
+		c = (pkg_cache_stamp(sum, "pkg0-1.0") == EPKG_OK);
+		write(in[1], &c, 1);
+		read(out[0], &c, 1);
+		_exit(0);
+	}
+	fail_unless(read(in[0], &c, 1) == 1 && c);
+
+	/* pkg0 becomes the least recently used */
+	STAILQ_FOREACH(p, &j->jobs, next) {
+		if (p != first)
+			fail_unless(pkg_repo_fetch(p) == EPKG_OK);
+	}
+	pkg_cache_release();
+	fail_unless(cached(first), "package used by another process evicted");
+	p = STAILQ_NEXT(first, next);
+	fail_if(cached(p));
+
+	/* the pin of a process which exited does not count */
+	write(out[1], &c, 1);
+	fail_unless(waitpid(pid, NULL, 0) == pid);
+	fail_unless(pkg_repo_fetch(p) == EPKG_OK);
+	pkg_get(p, PKG_NAME, &name);
+	fail_unless(cached(p), "%s not fetched", name);
+	fail_if(cached(first), "package of an exited process kept");
+
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	teardown(h, j);
+	unsetenv("CACHE_SIZE");
+}
+END_TEST
+
+/*
+ * A single file on a site served with the given options
+ */
+static struct httpd *
+setup_file(struct httpd_opts *opts, char *url, char *src, char *dest)
+{
+	struct httpd *h;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(src, MAXPATHLEN, "%s/file.txz", tmpdir);
+	snprintf(dest, MAXPATHLEN, "%s/fetched.txz", tmpdir);
+	srandom(0);
+	write_random(src, PKGSIZE);
+
+	fail_unless((h = httpd_start(tmpdir, opts)) != NULL);
+	snprintf(url, MAXPATHLEN, "http://127.0.0.1:%d/file.txz",
+	    httpd_port(h));
+
+	return (h);
+}
+
+static void
+same_file(const char *src, const char *dest)
+{
+	char sum1[SHA256_DIGEST_LENGTH * 2 + 1];
+	char sum2[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	fail_unless(sha256_file(src, sum1) == EPKG_OK);
+	fail_unless(sha256_file(dest, sum2) == EPKG_OK);
+	fail_unless(strcmp(sum1, sum2) == 0, "%s differs from %s", dest, src);
+}
+
+START_TEST(fetch_resume_dropped)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { 0, PKGSIZE / 4 + 1000 };
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+
+	h = setup_file(&opts, url, src, dest);
+
+	fail_unless(pkg_fetch_file(url, dest) == EPKG_OK);
+	same_file(src, dest);
+	fail_unless(httpd_requests(h) == 4, "%d requests", httpd_requests(h));
+	fail_unless(httpd_ranges(h) == 3);
+	fail_unless(httpd_sent(h) == PKGSIZE, "%jd bytes sent",
+	    (intmax_t)httpd_sent(h));
+	snprintf(cmd, sizeof(cmd), "%s.part", dest);
+	fail_unless(access(cmd, F_OK) != 0);
+
+	httpd_stop(h);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+START_TEST(fetch_resume_partial)
+{
+	struct httpd *h;
+	FILE *in, *out;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	int k;
+
+	h = setup_file(NULL, url, src, dest);
+	fail_unless(sha256_file(src, sum) == EPKG_OK);
+
+	/* left by an interrupted run */
+	snprintf(cmd, sizeof(cmd), "%s.part", dest);
+	fail_unless((in = fopen(src, "r")) != NULL);
+	fail_unless((out = fopen(cmd, "w")) != NULL);
+	for (k = 0; k < 100000; k++)
+		fputc(fgetc(in), out);
+	fclose(in);
+	fclose(out);
+
+	/* the checksum covers the bytes of the part file too */
+	fail_unless(pkg_fetch_file_cb(NULL, url, dest, true, sum, NULL,
+	    NULL) == EPKG_OK);
+	same_file(src, dest);
+	fail_unless(httpd_ranges(h) == 1);
+	fail_unless(httpd_sent(h) == PKGSIZE - 100000);
+
+	/* a complete part file is fetched again */
+	fail_unless(rename(dest, cmd) == 0);
+	fail_unless(pkg_fetch_file_cb(NULL, url, dest, true, sum, NULL,
+	    NULL) == EPKG_OK);
+	same_file(src, dest);
+
+	/* a corrupted part file is discarded */
+	fail_unless((out = fopen(cmd, "w")) != NULL);
+	for (k = 0; k < 100000; k++)
+		fputc(0, out);
+	fclose(out);
+	unlink(dest);
+	fail_unless(pkg_fetch_file_cb(NULL, url, dest, true, sum, NULL,
+	    NULL) == EPKG_FATAL);
+	fail_unless(access(dest, F_OK) != 0);
+	fail_unless(access(cmd, F_OK) != 0);
+
+	httpd_stop(h);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * A part file left by an interrupted download does not prevent a fresh one.
+ */
+START_TEST(fetch_stale_part)
+{
+	struct httpd *h;
+	FILE *fp;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+
+	h = setup_file(NULL, url, src, dest);
+
+	snprintf(cmd, sizeof(cmd), "%s.part", dest);
+	fail_unless((fp = fopen(cmd, "w")) != NULL);
+	fputs("stale", fp);
+	fclose(fp);
+
+	fail_unless(pkg_fetch_file(url, dest) == EPKG_OK);
+	same_file(src, dest);
+	fail_unless(httpd_ranges(h) == 0);
+	fail_unless(access(cmd, F_OK) != 0);
+
+	httpd_stop(h);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * A server which does not answer is given up after the timeout.
+ */
+START_TEST(fetch_timeout)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { 5000 };
+	time_t start;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+
+	h = setup_file(&opts, url, src, dest);
+	setenv("FETCH_TIMEOUT", "1", 1);
+	snprintf(cmd, sizeof(cmd), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(cmd) == EPKG_OK);
+
+	start = time(NULL);
+	fail_unless(pkg_fetch_file(url, dest) == EPKG_FATAL);
+	/* three attempts of a second, and a second between them */
+	fail_unless(time(NULL) - start < 10, "gave up after %ds",
+	    (int)(time(NULL) - start));
+	fail_unless(httpd_requests(h) == 3);
+	fail_unless(access(dest, F_OK) != 0);
+
+	httpd_stop(h);
+	pkg_shutdown();
+	unsetenv("FETCH_TIMEOUT");
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * Sequential downloads from one site share a single connection when the
+ * server keeps it open.
+ */
+START_TEST(fetch_keepalive)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { 0, 0, false };
+	struct fetch_session *s;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+	int64_t opened, reused;
+	int i, k;
+
+	for (k = 0; k < 2; k++) {
+		opts.keepalive = (k == 0);
+		h = setup_file(&opts, url, src, dest);
+		fail_unless((s = fetch_session_new()) != NULL);
+
+		for (i = 0; i < NPKGS; i++) {
+			fail_unless(pkg_fetch_file_cb(s, url, dest, false, NULL,
+			    NULL, NULL) == EPKG_OK);
+			same_file(src, dest);
+		}
+
+		fetch_session_stats(s, &opened, &reused);
+		fail_unless(httpd_requests(h) == NPKGS);
+		if (opts.keepalive) {
+			fail_unless(httpd_connections(h) == 1, "%d connections",
+			    httpd_connections(h));
+			fail_unless(opened == 1 && reused == NPKGS - 1);
+		} else {
+			fail_unless(httpd_connections(h) == NPKGS);
+			fail_unless(opened == NPKGS && reused == 0);
+		}
+
+		fetch_session_free(s);
+		httpd_stop(h);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+		system(cmd);
+		strlcpy(tmpdir, "/tmp/pkgfetch.XXXXXX", sizeof(tmpdir));
+	}
+}
+END_TEST
+
+/*
+ * An idle connection the server closed meanwhile is replaced, and only
+ * counted as a new one.
+ */
+START_TEST(fetch_keepalive_closed)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { 0, 0, true, 1 };
+	struct fetch_session *s;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+	int64_t opened, reused;
+	int i;
+
+	h = setup_file(&opts, url, src, dest);
+	fail_unless((s = fetch_session_new()) != NULL);
+
+	for (i = 0; i < NPKGS; i++) {
+		fail_unless(pkg_fetch_file_cb(s, url, dest, false, NULL,
+		    NULL, NULL) == EPKG_OK);
+		same_file(src, dest);
+	}
+
+	fetch_session_stats(s, &opened, &reused);
+	fail_unless(httpd_connections(h) == NPKGS, "%d connections",
+	    httpd_connections(h));
+	fail_unless(opened == NPKGS && reused == 0, "%jd opened, %jd reused",
+	    (intmax_t)opened, (intmax_t)reused);
+
+	fetch_session_free(s);
+	httpd_stop(h);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * A file is only downloaded again once it changed, according to its date or
+ * its tag.
+ */
+START_TEST(fetch_conditional)
+{
+	struct httpd *h;
+	struct fetch_cond cond;
+	struct timeval tv[2];
+	struct stat st;
+	char url[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN];
+	char cmd[MAXPATHLEN + 10];
+
+	h = setup_file(NULL, url, src, dest);
+	fail_unless(stat(src, &st) == 0);
+
+	memset(&cond, 0, sizeof(cond));
+	fail_unless(pkg_fetch_file_cond(url, dest, &cond, NULL,
+	    NULL) == EPKG_OK);
+	same_file(src, dest);
+	fail_unless(cond.mtime == st.st_mtime);
+	fail_unless(cond.etag[0] != '\0');
+
+	/* unchanged, by tag then by date alone */
+	unlink(dest);
+	fail_unless(pkg_fetch_file_cond(url, dest, &cond, NULL,
+	    NULL) == EPKG_UPTODATE);
+	cond.etag[0] = '\0';
+	fail_unless(pkg_fetch_file_cond(url, dest, &cond, NULL,
+	    NULL) == EPKG_UPTODATE);
+	fail_unless(access(dest, F_OK) != 0);
+	fail_unless(httpd_sent(h) == PKGSIZE);
+
+	/* modified */
+	tv[0].tv_sec = tv[1].tv_sec = st.st_mtime + 10;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	fail_unless(utimes(src, tv) == 0);
+	fail_unless(pkg_fetch_file_cond(url, dest, &cond, NULL,
+	    NULL) == EPKG_OK);
+	same_file(src, dest);
+	fail_unless(cond.mtime == st.st_mtime + 10);
+
+	/* a missing file is not an error when optional */
+	snprintf(cmd, sizeof(cmd), "%s.missing", url);
+	cond.optional = true;
+	fail_unless(pkg_fetch_file_cond(cmd, dest, &cond, NULL,
+	    NULL) == EPKG_END);
+	fail_unless(httpd_requests(h) == 5);
+
+	httpd_stop(h);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+TCase *
+tcase_fetch(void)
+{
+	TCase *tc = tcase_create("Fetch");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, fetch_concurrent);
+	tcase_add_test(tc, fetch_sequential);
+	tcase_add_test(tc, fetch_checksum);
+	tcase_add_test(tc, fetch_cache_index);
+	tcase_add_test(tc, fetch_cache_budget);
+	tcase_add_test(tc, fetch_cache_pinned);
+	tcase_add_test(tc, fetch_cache_prune);
+	tcase_add_test(tc, fetch_resume_dropped);
+	tcase_add_test(tc, fetch_resume_partial);
+	tcase_add_test(tc, fetch_stale_part);
+	tcase_add_test(tc, fetch_timeout);
+	tcase_add_test(tc, fetch_keepalive);
+	tcase_add_test(tc, fetch_keepalive_closed);
+	tcase_add_test(tc, fetch_conditional);
+
+	return (tc);
+}
@@ -0,0 +1,432 @@
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tests.h"
+
+/*
+ * Minimal HTTP/1.1 server on the loopback interface serving the files of a
+ * directory, standing in for a package site in the fetch tests. Connections
+ * are closed after each answer unless opts.keepalive is set, or silently
+ * after opts.maxrequests answers, as idle connections are. The files are
+ * tagged with their size and modification time for conditional requests.
+ */
+struct httpd {
+	int sock;
+	int port;
+	char root[MAXPATHLEN + 1];
+	struct httpd_opts opts;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	bool stop;
+	int clients;
+	int maxclients;
+	int connections;
+	int requests;
+	int ranges;
+	off_t sent;
+};
+
+struct httpd_client {
+	struct httpd *h;
+	int fd;
+};
+
+static int
+httpd_write(int fd, const char *buf, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, buf, len)) <= 0)
+			return (-1);
+		buf += w;
+		len -= w;
+	}
+
+	return (0);
+}
+
+#define HTTP_DATE "%a, %d %b %Y %H:%M:%S GMT"
+
+/*
+ * Returns whether the whole answer was sent
+ */
+static bool
+httpd_answer(struct httpd *h, int fd, const char *path, off_t offset,
+    time_t ims, const char *inm)
+{
+	char buf[BUFSIZ];
+	char file[MAXPATHLEN + 1];
+	char date[64];
+	char etag[64];
+	const char *conn;
+	struct stat st;
+	struct tm tm;
+	off_t len;
+	ssize_t r;
+	int f;
+	bool dropped = false;
+
+	conn = h->opts.keepalive ? "keep-alive" : "close";
+
+	snprintf(file, sizeof(file), "%s%s", h->root, path);
+	if (strstr(path, "..") != NULL || (f = open(file, O_RDONLY)) == -1) {
+		snprintf(buf, sizeof(buf), "HTTP/1.1 404 Not Found\r\n"
+		    "Content-Length: 0\r\nConnection: %s\r\n\r\n", conn);
+		return (httpd_write(fd, buf, strlen(buf)) == 0);
+	}
+
+	fstat(f, &st);
+	strftime(date, sizeof(date), HTTP_DATE, gmtime_r(&st.st_mtime, &tm));
+	snprintf(etag, sizeof(etag), "\"%jx-%jx\"", (intmax_t)st.st_size,
+	    (intmax_t)st.st_mtime);
+
+	/* the tag, when sent, takes precedence over the date */
+	if (inm[0] != '\0' ? strcmp(inm, etag) == 0 :
+	    (ims > 0 && st.st_mtime <= ims)) {
+		snprintf(buf, sizeof(buf), "HTTP/1.1 304 Not Modified\r\n"
+		    "Connection: %s\r\n\r\n", conn);
+		close(f);
+		return (httpd_write(fd, buf, strlen(buf)) == 0);
+	}
+
+	if (offset >= st.st_size && offset > 0) {
+		snprintf(buf, sizeof(buf), "HTTP/1.1 416 Requested Range Not "
+		    "Satisfiable\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+		    conn);
+		close(f);
+		return (httpd_write(fd, buf, strlen(buf)) == 0);
+	}
+
+	if (offset > 0)
+		snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\n"
+		    "Content-Range: bytes %jd-%jd/%jd\r\n"
+		    "Content-Length: %jd\r\nLast-Modified: %s\r\n"
+		    "ETag: %s\r\nConnection: %s\r\n\r\n",
+		    (intmax_t)offset, (intmax_t)st.st_size - 1,
+		    (intmax_t)st.st_size, (intmax_t)(st.st_size - offset), date,
+		    etag, conn);
+	else
+		snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+		    "Content-Length: %jd\r\nLast-Modified: %s\r\n"
+		    "ETag: %s\r\nConnection: %s\r\n\r\n",
+		    (intmax_t)st.st_size, date, etag, conn);
+
+	/* the connection drops after opts.drop bytes of the file */
+	len = st.st_size - offset;
+	if (h->opts.drop > 0 && len > h->opts.drop) {
+		len = h->opts.drop;
+		dropped = true;
+	}
+
+	if (httpd_write(fd, buf, strlen(buf)) == 0 &&
+	    lseek(f, offset, SEEK_SET) != -1) {
+		while (len > 0 && (r = read(f, buf,
+		    len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf))) > 0) {
+			if (httpd_write(fd, buf, r) != 0)
+				break;
+			len -= r;
+			pthread_mutex_lock(&h->lock);
+			h->sent += r;
+			pthread_mutex_unlock(&h->lock);
+		}
+	}
+	close(f);
+
+	return (len == 0 && !dropped);
+}
+
+/*
+ * Wait for the next request, false once the server is stopping
+ */
+static bool
+httpd_wait(struct httpd *h, int fd)
+{
+	struct pollfd pfd;
+	bool stop;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		stop = h->stop;
+		pthread_mutex_unlock(&h->lock);
+		if (stop)
+			return (false);
+		if (poll(&pfd, 1, 100) > 0)
+			return (true);
+	}
+}
+
+static void *
+httpd_client(void *arg)
+{
+	struct httpd_client *c = arg;
+	struct httpd *h = c->h;
+	char req[BUFSIZ];
+	char path[MAXPATHLEN + 1];
+	char inm[64];
+	const char *range, *v;
+	struct tm tm;
+	time_t ims;
+	off_t offset;
+	size_t len;
+	ssize_t r;
+	int n = 0;
+	bool done;
+
+	do {
+		/* the request headers, the body is never used */
+		len = 0;
+		req[0] = '\0';
+		while (len < sizeof(req) - 1 && httpd_wait(h, c->fd)) {
+			if ((r = read(c->fd, req + len, sizeof(req) - 1 - len)) <= 0)
+				break;
+			len += r;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n") != NULL)
+				break;
+		}
+		req[len] = '\0';
+
+		if (sscanf(req, "GET %1024s ", path) != 1)
+			break;
+
+		pthread_mutex_lock(&h->lock);
+		h->requests++;
+		pthread_mutex_unlock(&h->lock);
+
+		if (h->opts.latency > 0)
+			usleep(h->opts.latency * 1000);
+
+		offset = 0;
+		if ((range = strstr(req, "\r\nRange: bytes=")) != NULL) {
+			offset = strtoll(range + 15, NULL, 10);
+			pthread_mutex_lock(&h->lock);
+			h->ranges++;
+			pthread_mutex_unlock(&h->lock);
+		}
+
+		ims = 0;
+		if ((v = strstr(req, "\r\nIf-Modified-Since: ")) != NULL) {
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(v + 21, HTTP_DATE, &tm) != NULL)
+				ims = timegm(&tm);
+		}
+		inm[0] = '\0';
+		if ((v = strstr(req, "\r\nIf-None-Match: ")) != NULL)
+			sscanf(v + 17, "%63s", inm);
+
+		done = httpd_answer(h, c->fd, path, offset, ims, inm);
+	} while (done && h->opts.keepalive &&
+	    (h->opts.maxrequests == 0 || ++n < h->opts.maxrequests));
+
+	close(c->fd);
+	free(c);
+
+	pthread_mutex_lock(&h->lock);
+	h->clients--;
+	pthread_mutex_unlock(&h->lock);
+
+	return (NULL);
+}
+
+static void *
+httpd_loop(void *arg)
+{
+	struct httpd *h = arg;
+	struct httpd_client *c;
+	struct pollfd pfd;
+	pthread_t t;
+	int fd;
+
+	pfd.fd = h->sock;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		if (h->stop) {
+			pthread_mutex_unlock(&h->lock);
+			break;
+		}
+		pthread_mutex_unlock(&h->lock);
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if ((fd = accept(h->sock, NULL, NULL)) == -1)
+			continue;
+
+		if ((c = malloc(sizeof(struct httpd_client))) == NULL) {
+			close(fd);
+			continue;
+		}
+		c->h = h;
+		c->fd = fd;
+
+		/* counted here so that httpd_stop() waits for the thread */
+		pthread_mutex_lock(&h->lock);
+		h->connections++;
+		if (++h->clients > h->maxclients)
+			h->maxclients = h->clients;
+		pthread_mutex_unlock(&h->lock);
+
+		if (pthread_create(&t, NULL, httpd_client, c) != 0) {
+			pthread_mutex_lock(&h->lock);
+			h->clients--;
+			pthread_mutex_unlock(&h->lock);
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(t);
+	}
+
+	return (NULL);
+}
+
+struct httpd *
+httpd_start(const char *root, struct httpd_opts *opts)
+{
+	struct httpd *h;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	if ((h = calloc(1, sizeof(struct httpd))) == NULL)
+		return (NULL);
+
+	/* clients giving up on a slow answer close the connection first */
+	signal(SIGPIPE, SIG_IGN);
+
+	strlcpy(h->root, root, sizeof(h->root));
+	if (opts != NULL)
+		h->opts = *opts;
+	pthread_mutex_init(&h->lock, NULL);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+
+	if ((h->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    bind(h->sock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(h->sock, 64) == -1 ||
+	    getsockname(h->sock, (struct sockaddr *)&sin, &len) == -1 ||
+	    pthread_create(&h->thread, NULL, httpd_loop, h) != 0) {
+		if (h->sock != -1)
+			close(h->sock);
+		pthread_mutex_destroy(&h->lock);
+		free(h);
+		return (NULL);
+	}
+	h->port = ntohs(sin.sin_port);
+
+	return (h);
+}
+
+int
+httpd_port(struct httpd *h)
+{
+	return (h->port);
+}
+
+int
+httpd_connections(struct httpd *h)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->lock);
+	ret = h->connections;
+	pthread_mutex_unlock(&h->lock);
+
+	return (ret);
+}
+
+int
+httpd_requests(struct httpd *h)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->lock);
+	ret = h->requests;
+	pthread_mutex_unlock(&h->lock);
+
+	return (ret);
+}
+
+int
+httpd_ranges(struct httpd *h)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->lock);
+	ret = h->ranges;
+	pthread_mutex_unlock(&h->lock);
+
+	return (ret);
+}
+
+off_t
+httpd_sent(struct httpd *h)
+{
+	off_t ret;
+
+	pthread_mutex_lock(&h->lock);
+	ret = h->sent;
+	pthread_mutex_unlock(&h->lock);
+
+	return (ret);
+}
+
+int
+httpd_maxclients(struct httpd *h)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->lock);
+	ret = h->maxclients;
+	pthread_mutex_unlock(&h->lock);
+
+	return (ret);
+}
+
+void
+httpd_stop(struct httpd *h)
+{
+	int clients;
+
+	pthread_mutex_lock(&h->lock);
+	h->stop = true;
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->thread, NULL);
+	close(h->sock);
+
+	/* wait for the connections still being answered */
+	do {
+		pthread_mutex_lock(&h->lock);
+		clients = h->clients;
+		pthread_mutex_unlock(&h->lock);
+		if (clients > 0)
+			usleep(10000);
+	} while (clients > 0);
+
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
@@ -0,0 +1,383 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "tests.h"
+
+#define NPKGS 6
+
+static char tmpdir[] = "/tmp/pkgjobs.XXXXXX";
+static char root[MAXPATHLEN + 1];
+
+/*
+ * A package installing a file named after it below root, and the extra
+ * file if not NULL.
+ */
+static void
+write_pkg(int i, const char *extra, pkg_formats format)
+{
+	struct packing *pack;
+	struct sbuf *m = sbuf_new_auto();
+	struct utsname u;
+	char path[MAXPATHLEN + 1];
+	char file[MAXPATHLEN + 1];
+
+	fail_unless(uname(&u) == 0);
+	snprintf(file, sizeof(file), "%s/pkg%d/file", root, i);
+	sbuf_printf(m, ""
+	    "name: pkg%d\n"
+	    "version: 1.0\n"
+	    "origin: test/pkg%d\n"
+	    "comment: a test package\n"
+	    "desc: package number %d\n"
+	    "arch: %s\n"
+	    "osversion: 900000\n"
+	    "www: http://www.pkgng.lan\n"
+	    "maintainer: test@pkgng.lan\n"
+	    "prefix: %s\n"
+	    "flatsize: 0\n"
+	    "files:\n"
+	    "  %s: -\n",
+	    i, i, i, u.machine, root, file);
+	if (extra != NULL)
+		sbuf_printf(m, "  %s/%s: -\n", root, extra);
+	sbuf_finish(m);
+
+	snprintf(path, sizeof(path), "%s/site/All/pkg%d-1.0", tmpdir, i);
+	fail_unless(packing_init(&pack, path, format, -1, -1) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, sbuf_data(m), "+MANIFEST",
+	    sbuf_len(m)) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, "file\n", file, 5) == EPKG_OK);
+	if (extra != NULL) {
+		snprintf(file, sizeof(file), "%s/%s", root, extra);
+		fail_unless(packing_append_buffer(pack, "extra\n", file, 6) ==
+		    EPKG_OK);
+	}
+	packing_finish(pack);
+	sbuf_delete(m);
+}
+
+/*
+ * An empty local database, a package site and its catalogue used as the
+ * remote database.
+ */
+static struct httpd *
+setup(const char *xworkers, struct httpd_opts *opts)
+{
+	struct httpd *h;
+	char path[MAXPATHLEN + 1];
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(root, sizeof(root), "%s/root", tmpdir);
+	snprintf(path, sizeof(path), "%s/site/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/db", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	setenv("PKG_DBDIR", path, 1);
+	snprintf(path, sizeof(path), "%s/cache", tmpdir);
+	setenv("PKG_CACHEDIR", path, 1);
+	setenv("FETCH_WORKERS", "2", 1);
+	setenv("EXTRACT_WORKERS", xworkers, 1);
+
+	fail_unless((h = httpd_start(tmpdir, opts)) != NULL);
+	snprintf(path, sizeof(path), "http://127.0.0.1:%d/site",
+	    httpd_port(h));
+	setenv("PACKAGESITE", path, 1);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(path) == EPKG_OK);
+
+	return (h);
+}
+
+static void
+publish(void)
+{
+	char path[MAXPATHLEN + 1];
+	char dest[MAXPATHLEN + 1];
+
+	snprintf(path, sizeof(path), "%s/site", tmpdir);
+	fail_unless(pkg_create_repo(path, false, NULL, NULL) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/site/repo.sqlite", tmpdir);
+	snprintf(dest, sizeof(dest), "%s/db/repo.sqlite", tmpdir);
+	fail_unless(rename(path, dest) == 0);
+}
+
+static void
+teardown(struct httpd *h)
+{
+	char cmd[MAXPATHLEN + 10];
+
+	httpd_stop(h);
+	pkg_shutdown();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+	strlcpy(tmpdir, "/tmp/pkgjobs.XXXXXX", sizeof(tmpdir));
+	unsetenv("PKG_DBDIR");
+	unsetenv("EXTRACT_WORKERS");
+}
+
+/*
+ * Install the packages pkg<first> to pkg<last>, in one job set.
+ */
+static int
+install(struct pkgdb *db, int first, int last)
+{
+	struct pkg_jobs *j;
+	struct pkgdb_it *it;
+	struct pkg *p = NULL;
+	char names[NPKGS][16];
+	char *pkgs[NPKGS];
+	int i, ret;
+
+	for (i = first; i <= last; i++) {
+		snprintf(names[i - first], sizeof(names[0]), "pkg%d", i);
+		pkgs[i - first] = names[i - first];
+	}
+
+	fail_unless(pkg_jobs_new(&j, PKG_JOBS_INSTALL, db) == EPKG_OK);
+	fail_unless((it = pkgdb_query_installs(db, MATCH_EXACT,
+	    last - first + 1, pkgs, NULL)) != NULL);
+	while (pkgdb_it_next(it, &p, PKG_LOAD_BASIC|PKG_LOAD_DEPS) == EPKG_OK) {
+		pkg_jobs_add(j, p);
+		p = NULL;
+	}
+	pkgdb_it_free(it);
+
+	ret = pkg_jobs_apply(j, 0);
+	pkg_jobs_free(j);
+
+	return (ret);
+}
+
+static bool
+installed(struct pkgdb *db, int i)
+{
+	struct pkgdb_it *it;
+	struct pkg *p = NULL;
+	char origin[32];
+	bool ret;
+
+	snprintf(origin, sizeof(origin), "test/pkg%d", i);
+	fail_unless((it = pkgdb_query(db, origin, MATCH_EXACT)) != NULL);
+	ret = (pkgdb_it_next(it, &p, PKG_LOAD_BASIC) == EPKG_OK);
+	pkgdb_it_free(it);
+	pkg_free(p);
+
+	return (ret);
+}
+
+static bool
+extracted(int i)
+{
+	char path[MAXPATHLEN + 1];
+
+	snprintf(path, sizeof(path), "%s/pkg%d/file", root, i);
+
+	return (access(path, F_OK) == 0);
+}
+
+START_TEST(jobs_pipeline)
+{
+	struct pkgdb *db;
+	struct pkgdb_it *it;
+	struct pkg *p = NULL;
+	struct httpd *h;
+	int i;
+
+	h = setup("1", NULL);
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, NULL, TXZ);
+	publish();
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_OK);
+	for (i = 0; i < NPKGS; i++) {
+		fail_unless(installed(db, i), "pkg%d not registered", i);
+		fail_unless(extracted(i), "pkg%d not extracted", i);
+	}
+
+	/* the files checked by a job set are not left to the next one */
+	fail_unless((it = pkgdb_query(db, "test/pkg0", MATCH_EXACT)) != NULL);
+	fail_unless(pkgdb_it_next(it, &p, PKG_LOAD_BASIC) == EPKG_OK);
+	pkgdb_it_free(it);
+	fail_unless(pkg_delete(p, db, 0) == EPKG_OK);
+	pkg_free(p);
+	fail_if(extracted(0));
+	fail_unless(install(db, 0, 0) == EPKG_OK);
+	fail_unless(installed(db, 0) && extracted(0));
+
+	pkgdb_close(db);
+	teardown(h);
+}
+END_TEST
+
+/*
+ * Two new packages installing the same file: nothing is installed, even
+ * the packages of the set before them.
+ */
+START_TEST(jobs_conflict)
+{
+	struct pkgdb *db;
+	struct httpd *h;
+	int i;
+
+	h = setup("1", NULL);
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, i >= NPKGS - 2 ? "shared" : NULL, TXZ);
+	publish();
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_FATAL);
+	for (i = 0; i < NPKGS; i++) {
+		fail_if(installed(db, i), "pkg%d registered", i);
+		fail_if(extracted(i), "pkg%d extracted", i);
+	}
+
+	pkgdb_close(db);
+	teardown(h);
+}
+END_TEST
+
+/*
+ * One package of a batch extracted in parallel fails: the whole batch is
+ * rolled back, including the packages already extracted.
+ */
+START_TEST(jobs_batch_failure)
+{
+	struct pkgdb *db;
+	struct httpd *h;
+	char path[MAXPATHLEN + 1];
+	FILE *fp;
+	int i;
+
+	h = setup("4", NULL);
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, i == NPKGS / 2 ? "blocker/file" : NULL, TXZ);
+	publish();
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	/* a file where the package expects a directory */
+	fail_unless(mkdirs(root) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/blocker", root);
+	fail_unless((fp = fopen(path, "w")) != NULL);
+	fclose(fp);
+
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_FATAL);
+	for (i = 0; i < NPKGS; i++) {
+		fail_if(installed(db, i), "pkg%d registered", i);
+		fail_if(extracted(i), "pkg%d extracted", i);
+	}
+
+	/* and the set installs once the file is gone */
+	fail_unless(unlink(path) == 0);
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_OK);
+	for (i = 0; i < NPKGS; i++)
+		fail_unless(installed(db, i) && extracted(i));
+
+	pkgdb_close(db);
+	teardown(h);
+}
+END_TEST
+
+/*
+ * Packages in the zstd format are indexed, fetched and extracted like the
+ * others.
+ */
+START_TEST(jobs_tzst)
+{
+	struct pkgdb *db;
+	struct httpd *h;
+	char path[MAXPATHLEN + 1];
+	int i;
+
+	if (!packing_format_supported(TZST))
+		return;
+
+	h = setup("2", NULL);
+	for (i = 0; i < NPKGS; i++) {
+		write_pkg(i, NULL, TZST);
+		snprintf(path, sizeof(path), "%s/site/All/pkg%d-1.0.tzst",
+		    tmpdir, i);
+		fail_unless(access(path, F_OK) == 0);
+	}
+	publish();
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_OK);
+	for (i = 0; i < NPKGS; i++) {
+		fail_unless(installed(db, i), "pkg%d not registered", i);
+		fail_unless(extracted(i), "pkg%d not extracted", i);
+	}
+
+	pkgdb_close(db);
+	teardown(h);
+}
+END_TEST
+
+static int
+stage_times(void *data, struct pkg_event *ev)
+{
+	if (ev->type == PKG_EVENT_STAGE_TIMES)
+		*(struct pkg_event *)data = *ev;
+
+	return (0);
+}
+
+/*
+ * The packages downloaded first are extracted while the next ones are still
+ * being downloaded.
+ */
+START_TEST(jobs_overlap)
+{
+	struct pkgdb *db;
+	struct pkg_event ev;
+	struct httpd *h;
+	struct httpd_opts opts = { 200 };
+	int i;
+
+	h = setup("1", &opts);
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, NULL, TXZ);
+	publish();
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	memset(&ev, 0, sizeof(struct pkg_event));
+	pkg_event_register(stage_times, &ev);
+	fail_unless(install(db, 0, NPKGS - 1) == EPKG_OK);
+	pkg_event_register(NULL, NULL);
+	for (i = 0; i < NPKGS; i++)
+		fail_unless(installed(db, i) && extracted(i));
+
+	fail_unless(ev.type == PKG_EVENT_STAGE_TIMES);
+	fail_unless(ev.e_stage_times.overlap > 0, "extracted in %.2fs, "
+	    "%.2fs during the downloads of %.2fs", ev.e_stage_times.extract,
+	    ev.e_stage_times.overlap, ev.e_stage_times.fetch);
+
+	pkgdb_close(db);
+	teardown(h);
+}
+END_TEST
+
+TCase *
+tcase_jobs(void)
+{
+	TCase *tc = tcase_create("Jobs");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, jobs_pipeline);
+	tcase_add_test(tc, jobs_conflict);
+	tcase_add_test(tc, jobs_batch_failure);
+	tcase_add_test(tc, jobs_tzst);
+	tcase_add_test(tc, jobs_overlap);
+
+	return (tc);
+}
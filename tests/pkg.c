@@ -1,9 +1,162 @@
+#include <sys/param.h>
+
 #include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <pkg.h>
 
+#include "pkg_private.h"
+#include "tests.h"
+
+#define PAYLOAD (512 * 1024)
+
+static const char manifest[] = ""
+    "name: foo\n"
+    "version: 1.0\n"
+    "origin: test/foo\n"
+    "comment: a test package\n"
+    "desc: a package with a payload\n"
+    "arch: amd64\n"
+    "osversion: 900000\n"
+    "www: http://www.pkgng.lan\n"
+    "maintainer: test@pkgng.lan\n"
+    "prefix: /usr/local\n"
+    "flatsize: 0\n";
+
+/*
+ * The checksum computed while the metadata is read is the one of the whole
+ * file, whatever the compression.
+ */
+START_TEST(pkg_cksum)
+{
+	static const struct {
+		pkg_formats format;
+		const char *ext;
+	} formats[] = {
+		{ TAR, "tar" },
+		{ TGZ, "tgz" },
+		{ TBZ, "tbz" },
+		{ TXZ, "txz" },
+		{ TZST, "tzst" },
+	};
+	struct packing *pack;
+	struct pkg *p;
+	char tmpdir[] = "/tmp/pkgcksum.XXXXXX";
+	char path[MAXPATHLEN + 1];
+	char cmd[MAXPATHLEN + 10];
+	char sum1[SHA256_DIGEST_LENGTH * 2 + 1];
+	char sum2[SHA256_DIGEST_LENGTH * 2 + 1];
+	const char *name;
+	char *payload;
+	int i;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	fail_unless((payload = malloc(PAYLOAD)) != NULL);
+	srandom(0);
+	for (i = 0; i < PAYLOAD; i++)
+		payload[i] = random() & 0xff;
+
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+		if (!packing_format_supported(formats[i].format))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/foo", tmpdir);
+		fail_unless(packing_init(&pack, path, formats[i].format, -1,
+		    -1) == EPKG_OK);
+		fail_unless(packing_append_buffer(pack, manifest, "+MANIFEST",
+		    strlen(manifest)) == EPKG_OK);
+		fail_unless(packing_append_buffer(pack, payload,
+		    "/usr/local/share/foo/payload", PAYLOAD) == EPKG_OK);
+		packing_finish(pack);
+
+		snprintf(path, sizeof(path), "%s/foo.%s", tmpdir,
+		    formats[i].ext);
+		p = NULL;
+		fail_unless(pkg_open_cksum(&p, path, NULL, sum1) == EPKG_OK,
+		    "%s not opened", formats[i].ext);
+		pkg_get(p, PKG_NAME, &name);
+		fail_unless(strcmp(name, "foo") == 0);
+		fail_unless(sha256_file(path, sum2) == EPKG_OK);
+		fail_unless(strcmp(sum1, sum2) == 0, "%s: %s instead of %s",
+		    formats[i].ext, sum1, sum2);
+		pkg_free(p);
+	}
+
+	free(payload);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * The compression settings: a single thread unless asked, and a level over
+ * the maximum of the format used as the maximum.
+ */
+START_TEST(pkg_compression)
+{
+	struct packing *pack;
+	struct pkg *p;
+	char tmpdir[] = "/tmp/pkgcomp.XXXXXX";
+	char path[MAXPATHLEN + 1];
+	char cmd[MAXPATHLEN + 10];
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	int64_t threads;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(path) == EPKG_OK);
+	fail_unless(pkg_config_int64(PKG_CONFIG_COMPRESSION_THREADS,
+	    &threads) == EPKG_OK);
+	fail_unless(threads == 1, "%jd threads by default", (intmax_t)threads);
+
+	snprintf(path, sizeof(path), "%s/foo", tmpdir);
+	fail_unless(packing_init(&pack, path, TGZ, 12, -1) == EPKG_OK);
+	packing_finish(pack);
+	if (packing_format_supported(TZST)) {
+		fail_unless(packing_init(&pack, path, TZST, 20, -1) == EPKG_OK);
+		packing_finish(pack);
+	}
+
+	/* a zstd level for the catalogue, written as txz too */
+	pkg_shutdown();
+	setenv("COMPRESSION_LEVEL", "12", 1);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	fail_unless(pkg_create_repo(tmpdir, false, NULL, NULL) == EPKG_OK);
+	fail_unless(pkg_finish_repo(tmpdir, NULL, NULL, false) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/repo.txz", tmpdir);
+	fail_unless(access(path, F_OK) == 0);
+	unsetenv("COMPRESSION_LEVEL");
+
+	snprintf(path, sizeof(path), "%s/foo", tmpdir);
+
+	/* threads or not, the package reads the same */
+	fail_unless(packing_init(&pack, path, TXZ, 9, 4) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, manifest, "+MANIFEST",
+	    strlen(manifest)) == EPKG_OK);
+	packing_finish(pack);
+	snprintf(path, sizeof(path), "%s/foo.txz", tmpdir);
+	p = NULL;
+	fail_unless(pkg_open_cksum(&p, path, NULL, sum) == EPKG_OK);
+	pkg_free(p);
+
+	pkg_shutdown();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
 TCase *tcase_pkg(void)
 {
 	TCase *tc = tcase_create("Pkg");
+	tcase_add_test(tc, pkg_cksum);
+	tcase_add_test(tc, pkg_compression);
 
 	return (tc);
 }
@@ -0,0 +1,185 @@
+#include <sys/param.h>
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "pkgdb.h"
+#include "tests.h"
+
+#define MAXSTMTS 256
+
+/* tables holding one or more rows per package */
+static const char *relations[] = {
+	"files", "deps", "pkg_directories", "pkg_categories", "pkg_licenses",
+	"pkg_users", "pkg_groups", "scripts", "options", NULL
+};
+
+static char *stmts[MAXSTMTS];
+static int nstmts = 0;
+
+static void
+trace(void *arg, const char *sql)
+{
+	int i;
+
+	(void)arg;
+
+	/* only data statements have a query plan */
+	if (strncasecmp(sql, "SELECT", 6) != 0 &&
+	    strncasecmp(sql, "INSERT", 6) != 0 &&
+	    strncasecmp(sql, "UPDATE", 6) != 0 &&
+	    strncasecmp(sql, "DELETE", 6) != 0)
+		return;
+
+	for (i = 0; i < nstmts; i++) {
+		if (strcmp(stmts[i], sql) == 0)
+			return;
+	}
+
+	if (nstmts < MAXSTMTS)
+		stmts[nstmts++] = strdup(sql);
+}
+
+/*
+ * Return the relation table scanned without index by a query plan step
+ * such as "SCAN TABLE files AS f (~100000 rows)", or NULL.
+ */
+static const char *
+full_scan(const char *detail)
+{
+	size_t len;
+	int i;
+
+	if (strncmp(detail, "SCAN TABLE ", 11) != 0 ||
+	    strstr(detail, " USING ") != NULL)
+		return (NULL);
+
+	detail += 11;
+	len = strcspn(detail, " ");
+	for (i = 0; relations[i] != NULL; i++) {
+		if (strlen(relations[i]) == len &&
+		    strncmp(relations[i], detail, len) == 0)
+			return (relations[i]);
+	}
+
+	return (NULL);
+}
+
+static void
+register_pkg(struct pkgdb *db, const char *name, const char *dep)
+{
+	struct pkg *p = NULL;
+	char origin[BUFSIZ], path[MAXPATHLEN + 1], deporigin[BUFSIZ];
+
+	snprintf(origin, sizeof(origin), "test/%s", name);
+
+	fail_unless(pkg_new(&p, PKG_FILE) == EPKG_OK);
+	pkg_set(p, PKG_ORIGIN, origin, PKG_NAME, name, PKG_VERSION, "1.0",
+	    PKG_COMMENT, "test package", PKG_DESC, "test package",
+	    PKG_ARCH, "freebsd:9:x86:64", PKG_OSVERSION, "900044",
+	    PKG_MAINTAINER, "test@pkgng.lan", PKG_PREFIX, "/usr/local",
+	    PKG_MTREE, "#mtree");
+	snprintf(path, sizeof(path), "/usr/local/%s/file", name);
+	pkg_addfile(p, path, "01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b");
+	snprintf(path, sizeof(path), "/usr/local/%s", name);
+	pkg_adddir(p, path, 1);
+	if (dep != NULL) {
+		snprintf(deporigin, sizeof(deporigin), "test/%s", dep);
+		pkg_adddep(p, dep, deporigin, "1.0");
+	}
+	pkg_addcategory(p, "test");
+	pkg_addlicense(p, "BSD");
+	pkg_addoption(p, "DOCS", "on");
+	pkg_addscript(p, "echo", PKG_SCRIPT_INSTALL);
+
+	fail_unless(pkgdb_register_finale(db,
+	    pkgdb_register_pkg(db, p, 0)) == EPKG_OK);
+
+	pkgdb_integrity_append(db, p);
+	pkg_free(p);
+}
+
+START_TEST(query_plans)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it;
+	struct pkg *p = NULL;
+	sqlite3_stmt *stmt;
+	char tmpdir[] = "/tmp/pkgtest.XXXXXX";
+	char conf[MAXPATHLEN + 1];
+	const char *table;
+	char *sql;
+	int64_t res;
+	int i, flags;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	setenv("PKG_DBDIR", tmpdir, 1);
+	snprintf(conf, sizeof(conf), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(conf) == EPKG_OK);
+	fail_unless(pkgdb_open(&db, PKGDB_DEFAULT) == EPKG_OK);
+
+	flags = PKG_LOAD_DEPS|PKG_LOAD_RDEPS|PKG_LOAD_FILES|PKG_LOAD_SCRIPTS|
+	    PKG_LOAD_OPTIONS|PKG_LOAD_MTREE|PKG_LOAD_DIRS|PKG_LOAD_CATEGORIES|
+	    PKG_LOAD_LICENSES|PKG_LOAD_USERS|PKG_LOAD_GROUPS;
+
+	/* record what the library runs on the hot paths */
+	sqlite3_trace(db->sqlite, trace, NULL);
+
+	register_pkg(db, "foo", NULL);
+	register_pkg(db, "bar", "foo");
+
+	fail_unless((it = pkgdb_query(db, "bar", MATCH_EXACT)) != NULL);
+	while (pkgdb_it_next(it, &p, flags) == EPKG_OK)
+		;
+	pkgdb_it_free(it);
+
+	fail_unless((it = pkgdb_query_which(db, "/usr/local/foo/file")) != NULL);
+	while (pkgdb_it_next(it, &p, flags) == EPKG_OK)
+		;
+	pkgdb_it_free(it);
+
+	fail_unless(pkgdb_is_dir_used(db, "/usr/local/foo", &res) == EPKG_OK);
+	pkgdb_integrity_check(db);
+	if ((it = pkgdb_integrity_conflict_local(db, "test/foo")) != NULL) {
+		while (pkgdb_it_next(it, &p, PKG_LOAD_BASIC) == EPKG_OK)
+			;
+		pkgdb_it_free(it);
+	}
+	fail_unless(pkgdb_unregister_pkg(db, "test/bar") == EPKG_OK);
+
+	sqlite3_trace(db->sqlite, NULL, NULL);
+	fail_unless(nstmts > 0);
+
+	for (i = 0; i < nstmts; i++) {
+		sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", stmts[i]);
+		fail_unless(sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt,
+		    NULL) == SQLITE_OK, "%s: %s", stmts[i],
+		    sqlite3_errmsg(db->sqlite));
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			table = full_scan(sqlite3_column_text(stmt, 3));
+			fail_unless(table == NULL, "full scan of %s: %s", table,
+			    stmts[i]);
+		}
+		sqlite3_finalize(stmt);
+		sqlite3_free(sql);
+	}
+
+	pkg_free(p);
+	pkgdb_close(db);
+	pkg_shutdown();
+}
+END_TEST
+
+TCase *
+tcase_pkgdb(void)
+{
+	TCase *tc = tcase_create("Pkgdb");
+	tcase_add_test(tc, query_plans);
+
+	return (tc);
+}
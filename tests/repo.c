@@ -0,0 +1,259 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "tests.h"
+
+#define NPKGS 16
+
+static char tmpdir[] = "/tmp/pkgrepo.XXXXXX";
+
+static void
+write_pkg(int i, const char *version, const char *comment)
+{
+	struct packing *pack;
+	char path[MAXPATHLEN + 1];
+	char manifest[1024];
+
+	snprintf(manifest, sizeof(manifest), ""
+	    "name: pkg%d\n"
+	    "version: %s\n"
+	    "origin: test/pkg%d\n"
+	    "comment: %s\n"
+	    "desc: package number %d\n"
+	    "arch: amd64\n"
+	    "osversion: 900000\n"
+	    "www: http://www.pkgng.lan\n"
+	    "maintainer: test@pkgng.lan\n"
+	    "prefix: /usr/local\n"
+	    "flatsize: %d\n"
+	    "licenselogic: single\n"
+	    "licenses: [%s]\n"
+	    "categories: [test, cat%d]\n"
+	    "deps:\n"
+	    "  pkg%d: {origin: test/pkg%d, version: 1.0}\n"
+	    "options:\n"
+	    "  foo: %s\n",
+	    i, version, i, comment, i, i * 1000, i % 2 ? "BSD" : "GPLv2",
+	    i % 3, (i + 1) % NPKGS, (i + 1) % NPKGS, i % 2 ? "on" : "off");
+
+	snprintf(path, sizeof(path), "%s/All/pkg%d", tmpdir, i);
+	fail_unless(packing_init(&pack, path, TXZ, -1, -1) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, manifest, "+MANIFEST",
+	    strlen(manifest)) == EPKG_OK);
+	packing_finish(pack);
+}
+
+static void
+opened(struct pkg *pkg, void *data)
+{
+	if (pkg != NULL)
+		(*(int *)data)++;
+}
+
+static void
+build(bool incremental, int *nopened, const char *keep)
+{
+	char path[MAXPATHLEN + 1];
+
+	*nopened = 0;
+	fail_unless(pkg_create_repo(tmpdir, incremental, opened, nopened) ==
+	    EPKG_OK);
+
+	if (keep != NULL) {
+		snprintf(path, sizeof(path), "%s/repo.sqlite", tmpdir);
+		fail_unless(rename(path, keep) == 0);
+	}
+}
+
+static int
+same_file(const char *a, const char *b)
+{
+	char *abuf, *bbuf;
+	off_t asize, bsize;
+	int same;
+
+	fail_unless(file_to_buffer(a, &abuf, &asize) == EPKG_OK);
+	fail_unless(file_to_buffer(b, &bbuf, &bsize) == EPKG_OK);
+	same = (asize == bsize && memcmp(abuf, bbuf, asize) == 0);
+	free(abuf);
+	free(bbuf);
+
+	return (same);
+}
+
+START_TEST(repo_incremental)
+{
+	struct timeval tv[2];
+	char path[MAXPATHLEN + 1];
+	char inc[MAXPATHLEN + 1];
+	char full[MAXPATHLEN + 1];
+	char cmd[MAXPATHLEN + 10];
+	int i, nopened;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	setenv("REPO_WORKERS", "4", 1);
+	fail_unless(pkg_init(path) == EPKG_OK);
+
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, "1.0", "unchanged");
+	build(false, &nopened, NULL);
+	fail_unless(nopened == NPKGS);
+
+	/* one package is updated in place, one removed and one added */
+	write_pkg(3, "1.1", "rebuilt with a longer comment");
+	gettimeofday(&tv[0], NULL);
+	tv[0].tv_sec += 10;
+	tv[1] = tv[0];
+	snprintf(path, sizeof(path), "%s/All/pkg3.txz", tmpdir);
+	fail_unless(utimes(path, tv) == 0);
+	snprintf(path, sizeof(path), "%s/All/pkg7.txz", tmpdir);
+	fail_unless(unlink(path) == 0);
+	write_pkg(NPKGS, "1.0", "new");
+
+	snprintf(inc, sizeof(inc), "%s/inc.sqlite", tmpdir);
+	build(true, &nopened, inc);
+	fail_unless(nopened == 2, "%d packages opened", nopened);
+
+	/* the incremental catalogue is the one of a full rebuild */
+	snprintf(full, sizeof(full), "%s/full.sqlite", tmpdir);
+	build(false, &nopened, full);
+	fail_unless(nopened == NPKGS);
+	fail_unless(same_file(inc, full), "catalogues differ");
+
+	/* and the old catalogue may come from repo.txz too */
+	snprintf(path, sizeof(path), "%s/repo.sqlite", tmpdir);
+	fail_unless(rename(full, path) == 0);
+	fail_unless(pkg_finish_repo(tmpdir, NULL, NULL, false) == EPKG_OK);
+	fail_unless(access(path, F_OK) == -1);
+	build(true, &nopened, full);
+	fail_unless(nopened == 0, "%d packages opened", nopened);
+	fail_unless(same_file(inc, full), "catalogues differ");
+
+	pkg_shutdown();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+/*
+ * The packages opened by several workers are written to the catalogue in
+ * the order of a single worker.
+ */
+START_TEST(repo_workers)
+{
+	char path[MAXPATHLEN + 1];
+	char single[MAXPATHLEN + 1];
+	char pool[MAXPATHLEN + 1];
+	char cmd[MAXPATHLEN + 10];
+	int i, nopened;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+
+	setenv("REPO_WORKERS", "1", 1);
+	fail_unless(pkg_init(path) == EPKG_OK);
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, "1.0", i % 2 ? "odd" : "even");
+	snprintf(single, sizeof(single), "%s/single.sqlite", tmpdir);
+	build(false, &nopened, single);
+	fail_unless(nopened == NPKGS);
+	pkg_shutdown();
+
+	setenv("REPO_WORKERS", "8", 1);
+	fail_unless(pkg_init(path) == EPKG_OK);
+	snprintf(pool, sizeof(pool), "%s/pool.sqlite", tmpdir);
+	build(false, &nopened, pool);
+	fail_unless(nopened == NPKGS);
+	fail_unless(same_file(single, pool), "catalogues differ");
+
+	pkg_shutdown();
+	unsetenv("REPO_WORKERS");
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+static int
+search(const char *word)
+{
+	struct pkgdb *db;
+	struct pkgdb_it *it;
+	struct pkg *p = NULL;
+	int n = 0;
+
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+	fail_unless((it = pkgdb_rquery(db, word, MATCH_EXACT, FIELD_COMMENT,
+	    NULL)) != NULL);
+	while (pkgdb_it_next(it, &p, PKG_LOAD_BASIC) == EPKG_OK)
+		n++;
+	pkgdb_it_free(it);
+	pkg_free(p);
+	pkgdb_close(db);
+
+	return (n);
+}
+
+/*
+ * The ranked search of the words of the comments stops at SEARCH_LIMIT
+ * packages.
+ */
+START_TEST(repo_search)
+{
+	char path[MAXPATHLEN + 1];
+	char cmd[MAXPATHLEN + 10];
+	int i, nopened;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	setenv("PKG_DBDIR", tmpdir, 1);
+	setenv("SEARCH_LIMIT", "5", 1);
+	fail_unless(pkg_init(path) == EPKG_OK);
+
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i, "1.0", i % 2 ? "odd" : "even");
+	build(false, &nopened, NULL);
+	fail_unless(search("odd") == 5, "%d packages found", search("odd"));
+	pkg_shutdown();
+
+	setenv("SEARCH_LIMIT", "0", 1);
+	fail_unless(pkg_init(path) == EPKG_OK);
+	fail_unless(search("odd") == NPKGS / 2, "%d packages found",
+	    search("odd"));
+
+	pkg_shutdown();
+	unsetenv("SEARCH_LIMIT");
+	unsetenv("PKG_DBDIR");
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+}
+END_TEST
+
+TCase *
+tcase_repo(void)
+{
+	TCase *tc = tcase_create("Repo");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, repo_incremental);
+	tcase_add_test(tc, repo_workers);
+	tcase_add_test(tc, repo_search);
+
+	return (tc);
+}
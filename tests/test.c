@@ -8,8 +8,14 @@ main()
 	int nfailed = 0;
 	Suite *s = suite_create("pkgng");
 
+	suite_add_tcase(s, tcase_fetch());
+	suite_add_tcase(s, tcase_jobs());
 	suite_add_tcase(s, tcase_manifest());
 	suite_add_tcase(s, tcase_pkg());
+	suite_add_tcase(s, tcase_pkgdb());
+	suite_add_tcase(s, tcase_repo());
+	suite_add_tcase(s, tcase_update());
+	suite_add_tcase(s, tcase_version());
 
 	/* Run the tests ...*/
 	SRunner *sr = srunner_create(s);
@@ -1,4 +1,32 @@
+#include <sys/types.h>
+
+#include <stdbool.h>
+
 #include <check.h>
 
+TCase * tcase_fetch(void);
+TCase * tcase_jobs(void);
 TCase * tcase_manifest(void);
 TCase * tcase_pkg(void);
+TCase * tcase_pkgdb(void);
+TCase * tcase_repo(void);
+TCase * tcase_update(void);
+TCase * tcase_version(void);
+
+/* loopback package site, see httpd.c */
+struct httpd;
+struct httpd_opts {
+	int latency;	/* milliseconds to wait before answering */
+	off_t drop;	/* bytes of a file sent before closing, 0 for all */
+	bool keepalive;	/* several requests per connection */
+	int maxrequests; /* per connection before closing it, 0 for no limit */
+};
+
+struct httpd *httpd_start(const char *root, struct httpd_opts *opts);
+int httpd_port(struct httpd *);
+int httpd_connections(struct httpd *);
+int httpd_requests(struct httpd *);
+int httpd_ranges(struct httpd *);
+off_t httpd_sent(struct httpd *);
+int httpd_maxclients(struct httpd *);
+void httpd_stop(struct httpd *);
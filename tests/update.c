@@ -0,0 +1,365 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <check.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkg_private.h"
+#include "tests.h"
+
+#define NPKGS 4
+
+static char tmpdir[] = "/tmp/pkgupdate.XXXXXX";
+
+static void
+write_pkg(int i)
+{
+	struct packing *pack;
+	char path[MAXPATHLEN + 1];
+	char manifest[1024];
+
+	snprintf(manifest, sizeof(manifest), ""
+	    "name: pkg%d\n"
+	    "version: 1.0\n"
+	    "origin: test/pkg%d\n"
+	    "comment: a test package\n"
+	    "desc: package number %d\n"
+	    "arch: amd64\n"
+	    "osversion: 900000\n"
+	    "www: http://www.pkgng.lan\n"
+	    "maintainer: test@pkgng.lan\n"
+	    "prefix: /usr/local\n"
+	    "flatsize: 0\n",
+	    i, i, i);
+
+	snprintf(path, sizeof(path), "%s/site/All/pkg%d", tmpdir, i);
+	fail_unless(packing_init(&pack, path, TXZ, -1, -1) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, manifest, "+MANIFEST",
+	    strlen(manifest)) == EPKG_OK);
+	packing_finish(pack);
+}
+
+/*
+ * Publish the catalogue of the packages of the site, with a delta from the
+ * previous one if asked.
+ */
+static void
+publish(bool delta)
+{
+	char path[MAXPATHLEN + 1];
+
+	snprintf(path, sizeof(path), "%s/site", tmpdir);
+	fail_unless(pkg_create_repo(path, delta, NULL, NULL) == EPKG_OK);
+	fail_unless(pkg_finish_repo(path, NULL, NULL, delta) == EPKG_OK);
+}
+
+static struct httpd *
+setup(struct httpd_opts *opts, char *site)
+{
+	struct httpd *h;
+	char path[MAXPATHLEN + 1];
+	int i;
+
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(path, sizeof(path), "%s/site/All", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/db", tmpdir);
+	fail_unless(mkdirs(path) == EPKG_OK);
+	setenv("PKG_DBDIR", path, 1);
+	/* no key: the deltas are not signed */
+	snprintf(path, sizeof(path), "%s/pkg.pub", tmpdir);
+	setenv("PUBKEY", path, 1);
+	snprintf(path, sizeof(path), "%s/pkg.conf", tmpdir);
+	fail_unless(pkg_init(path) == EPKG_OK);
+
+	for (i = 0; i < NPKGS; i++)
+		write_pkg(i);
+	publish(false);
+
+	fail_unless((h = httpd_start(tmpdir, opts)) != NULL);
+	snprintf(site, MAXPATHLEN, "http://127.0.0.1:%d/site", httpd_port(h));
+
+	return (h);
+}
+
+static void
+teardown(struct httpd *h)
+{
+	char cmd[MAXPATHLEN + 10];
+
+	httpd_stop(h);
+	pkg_shutdown();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+	system(cmd);
+	unsetenv("PKG_DBDIR");
+	unsetenv("PUBKEY");
+}
+
+/* the packages in the local copy of the repository */
+static int
+npackages(const char *name)
+{
+	sqlite3 *sqlite;
+	sqlite3_stmt *stmt;
+	char path[MAXPATHLEN + 1];
+	int n = -1;
+
+	snprintf(path, sizeof(path), "%s/db/%s.sqlite", tmpdir, name);
+	fail_unless(sqlite3_open(path, &sqlite) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(sqlite, "SELECT count(*) FROM packages;",
+	    -1, &stmt, NULL) == SQLITE_OK);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		n = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	sqlite3_close(sqlite);
+
+	return (n);
+}
+
+/* nothing left in the database directory but the repository and its meta */
+static int
+nfiles(void)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[MAXPATHLEN + 1];
+	int n = 0;
+
+	snprintf(path, sizeof(path), "%s/db", tmpdir);
+	fail_unless((d = opendir(path)) != NULL);
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.')
+			n++;
+	}
+	closedir(d);
+
+	return (n);
+}
+
+/* the modification time recorded for a file of the repository, -1 if none */
+static intmax_t
+validator(const char *name, const char *file)
+{
+	FILE *fp;
+	char path[MAXPATHLEN + 1];
+	char line[BUFSIZ];
+	char key[32];
+	intmax_t mtime, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/db/%s.meta", tmpdir, name);
+	fail_unless((fp = fopen(path, "r")) != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%31s %jd", key, &mtime) == 2 &&
+		    strcmp(key, file) == 0)
+			ret = mtime;
+	}
+	fclose(fp);
+
+	return (ret);
+}
+
+START_TEST(update_delta)
+{
+	struct httpd *h;
+	char site[MAXPATHLEN], path[MAXPATHLEN + 1];
+
+	h = setup(NULL, site);
+
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+	fail_unless(npackages("test") == NPKGS);
+	fail_unless(nfiles() == 2, "%d files in the database directory",
+	    nfiles());
+
+	/* only the delta is left to update from */
+	write_pkg(NPKGS);
+	publish(true);
+	snprintf(path, sizeof(path), "%s/site/repo.delta.txz", tmpdir);
+	fail_unless(access(path, F_OK) == 0, "no delta published");
+	snprintf(path, sizeof(path), "%s/site/repo.txz", tmpdir);
+	fail_unless(unlink(path) == 0);
+	snprintf(path, sizeof(path), "%s/site/repo.tzst", tmpdir);
+	unlink(path);
+
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+	fail_unless(npackages("test") == NPKGS + 1);
+	fail_unless(pkg_update("test", site) == EPKG_UPTODATE);
+	fail_unless(nfiles() == 2, "%d files in the database directory",
+	    nfiles());
+
+	teardown(h);
+}
+END_TEST
+
+/* publish a delta from the local copy of the repository running sql */
+static void
+publish_delta(const char *name, const char *sql)
+{
+	struct packing *pack;
+	FILE *fp;
+	char path[MAXPATHLEN + 1];
+	char line[BUFSIZ];
+	char digest[65] = "";
+	char buf[BUFSIZ];
+
+	snprintf(path, sizeof(path), "%s/db/%s.meta", tmpdir, name);
+	fail_unless((fp = fopen(path, "r")) != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL)
+		sscanf(line, "digest %64s", digest);
+	fclose(fp);
+
+	snprintf(buf, sizeof(buf), "-- pkg delta %s %064d\n%s", digest, 0, sql);
+	snprintf(path, sizeof(path), "%s/site/repo.delta", tmpdir);
+	fail_unless(packing_init(&pack, path, TXZ, -1, -1) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, buf, "delta.sql",
+	    strlen(buf)) == EPKG_OK);
+	packing_finish(pack);
+
+	snprintf(path, sizeof(path), "%s/site/repo.txz", tmpdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/site/repo.tzst", tmpdir);
+	unlink(path);
+}
+
+/*
+ * A delta may only change the packages of the catalogue, and is not applied
+ * unsigned once there is a key to check it.
+ */
+START_TEST(update_delta_denied)
+{
+	struct httpd *h;
+	char site[MAXPATHLEN], path[MAXPATHLEN + 1];
+	char sql[BUFSIZ];
+	FILE *fp;
+
+	h = setup(NULL, site);
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+
+	snprintf(path, sizeof(path), "%s/attached.sqlite", tmpdir);
+	snprintf(sql, sizeof(sql), ""
+	    "ATTACH '%s' AS other;\n"
+	    "CREATE TABLE other.t (a);\n", path);
+	publish_delta("test", sql);
+	fail_unless(pkg_update("test", site) != EPKG_OK);
+	fail_unless(access(path, F_OK) != 0, "the delta attached a database");
+
+	publish_delta("test", "PRAGMA user_version=0;\n");
+	fail_unless(pkg_update("test", site) != EPKG_OK);
+	publish_delta("test", "DROP TABLE deps;\n");
+	fail_unless(pkg_update("test", site) != EPKG_OK);
+	fail_unless(npackages("test") == NPKGS);
+
+	publish_delta("test", "DELETE FROM packages;\n");
+	snprintf(path, sizeof(path), "%s/pkg.pub", tmpdir);
+	fail_unless((fp = fopen(path, "w")) != NULL);
+	fclose(fp);
+	fail_unless(pkg_update("test", site) != EPKG_OK);
+	fail_unless(npackages("test") == NPKGS);
+
+	/* without the key, the same delta is applied */
+	fail_unless(unlink(path) == 0);
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+	fail_unless(npackages("test") == 0);
+
+	teardown(h);
+}
+END_TEST
+
+/*
+ * Repositories updated at the same time get the outcome of their own
+ * downloads.
+ */
+START_TEST(update_repos)
+{
+	struct httpd *h;
+	struct httpd_opts opts = { 100 };
+	struct pkg_update_repo repos[2];
+	char site[MAXPATHLEN], missing[MAXPATHLEN + 10];
+	int i;
+
+	setenv("FETCH_WORKERS", "2", 1);
+	h = setup(&opts, site);
+	fail_unless(pkg_update("uptodate", site) == EPKG_OK);
+	snprintf(missing, sizeof(missing), "%s/missing", site);
+
+	for (i = 0; i < 5; i++) {
+		memset(repos, 0, sizeof(repos));
+		repos[0].name = "uptodate";
+		repos[0].packagesite = site;
+		repos[1].name = "missing";
+		repos[1].packagesite = missing;
+
+		fail_unless(pkg_update_repos(repos, 2) == EPKG_FATAL);
+		fail_unless(repos[0].retcode == EPKG_UPTODATE, "%d",
+		    repos[0].retcode);
+		fail_unless(repos[1].retcode == EPKG_FATAL, "%d",
+		    repos[1].retcode);
+	}
+
+	teardown(h);
+	unsetenv("FETCH_WORKERS");
+}
+END_TEST
+
+/*
+ * A repository without repo.tzst is updated from repo.txz, and the
+ * validators of each file are only those of its own download.
+ */
+START_TEST(update_fallback)
+{
+	struct httpd *h;
+	struct timeval tv[2];
+	char site[MAXPATHLEN], path[MAXPATHLEN + 1];
+
+	h = setup(NULL, site);
+	snprintf(path, sizeof(path), "%s/site/repo.tzst", tmpdir);
+	unlink(path);
+
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+	fail_unless(npackages("test") == NPKGS);
+	fail_unless(validator("test", "repo.txz") > 0);
+	fail_unless(validator("test", "repo.tzst") == 0);
+	fail_unless(pkg_update("test", site) == EPKG_UPTODATE);
+
+	if (!packing_format_supported(TZST)) {
+		teardown(h);
+		return;
+	}
+
+	/* once the repository has one, repo.tzst is preferred */
+	write_pkg(NPKGS);
+	publish(false);
+	gettimeofday(&tv[0], NULL);
+	tv[0].tv_sec += 10;
+	tv[1] = tv[0];
+	fail_unless(utimes(path, tv) == 0);
+
+	fail_unless(pkg_update("test", site) == EPKG_OK);
+	fail_unless(npackages("test") == NPKGS + 1);
+	fail_unless(validator("test", "repo.tzst") == tv[0].tv_sec);
+	fail_unless(validator("test", "repo.txz") == 0);
+	fail_unless(pkg_update("test", site) == EPKG_UPTODATE);
+
+	teardown(h);
+}
+END_TEST
+
+TCase *
+tcase_update(void)
+{
+	TCase *tc = tcase_create("Update");
+	tcase_set_timeout(tc, 60);
+	tcase_add_test(tc, update_delta);
+	tcase_add_test(tc, update_delta_denied);
+	tcase_add_test(tc, update_repos);
+	tcase_add_test(tc, update_fallback);
+
+	return (tc);
+}
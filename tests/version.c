@@ -0,0 +1,104 @@
+#include <check.h>
+#include <pkg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests.h"
+
+/* pieces of versions, covering the special cases of pkg_version_cmp() */
+static const char *atoms[] = {
+	"0", "1", "2", "10", "007", "a", "b", "z", "A", "pl", "alpha", "beta",
+	"pre", "rc", "Beta", "dev", ".", "..", ":", "+", "*", "1a1", "2b",
+	"_1", "_2", ",1", ",2"
+};
+
+#define NATOMS (sizeof(atoms) / sizeof(atoms[0]))
+
+static void
+random_version(char *buf, size_t len)
+{
+	int i, n;
+
+	buf[0] = '\0';
+	n = 1 + random() % 6;
+	for (i = 0; i < n; i++)
+		strlcat(buf, atoms[random() % NATOMS], len);
+}
+
+static int
+key_cmp(struct sbuf *k1, struct sbuf *k2)
+{
+	size_t len;
+	int ret;
+
+	len = sbuf_len(k1) < sbuf_len(k2) ? sbuf_len(k1) : sbuf_len(k2);
+	if ((ret = memcmp(sbuf_data(k1), sbuf_data(k2), len)) != 0)
+		return (ret < 0 ? -1 : 1);
+	if (sbuf_len(k1) != sbuf_len(k2))
+		return (sbuf_len(k1) < sbuf_len(k2) ? -1 : 1);
+
+	return (0);
+}
+
+START_TEST(version_key_order)
+{
+	struct sbuf *k1 = sbuf_new_auto();
+	struct sbuf *k2 = sbuf_new_auto();
+	char v1[64], v2[64];
+	int i;
+
+	srandom(0);
+	for (i = 0; i < 200000; i++) {
+		random_version(v1, sizeof(v1));
+		if (i % 4 == 0)
+			strlcpy(v2, v1, sizeof(v2));
+		else
+			random_version(v2, sizeof(v2));
+
+		fail_unless(pkg_version_key(v1, k1) == EPKG_OK);
+		fail_unless(pkg_version_key(v2, k2) == EPKG_OK);
+		fail_unless(key_cmp(k1, k2) == pkg_version_cmp(v1, v2),
+		    "%s and %s keys compare as %d", v1, v2, key_cmp(k1, k2));
+	}
+
+	sbuf_delete(k1);
+	sbuf_delete(k2);
+}
+END_TEST
+
+START_TEST(version_key_equal)
+{
+	struct sbuf *k1 = sbuf_new_auto();
+	struct sbuf *k2 = sbuf_new_auto();
+
+	/* missing components are 0 */
+	pkg_version_key("1.0", k1);
+	pkg_version_key("1", k2);
+	fail_unless(key_cmp(k1, k2) == 0);
+
+	pkg_version_key("1.0alpha1", k1);
+	pkg_version_key("1.0.a1", k2);
+	fail_unless(key_cmp(k1, k2) == 0);
+
+	pkg_version_key("2.*", k1);
+	pkg_version_key("2pl1", k2);
+	fail_unless(key_cmp(k1, k2) < 0);
+
+	pkg_version_key("1.2_1", k1);
+	pkg_version_key("1.1,1", k2);
+	fail_unless(key_cmp(k1, k2) < 0);
+
+	sbuf_delete(k1);
+	sbuf_delete(k2);
+}
+END_TEST
+
+TCase *
+tcase_version(void)
+{
+	TCase *tc = tcase_create("Version");
+	tcase_add_test(tc, version_key_order);
+	tcase_add_test(tc, version_key_equal);
+
+	return (tc);
+}